@@ -0,0 +1,477 @@
+#include "binlog.h"
+#include "util.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+
+
+namespace sylar {
+
+namespace {
+
+struct SiteInfo {
+    const char* file;
+    int32_t line;
+    std::string fmt;    // 复制一份, 写出调用点表时不依赖调用方的指针
+    std::string types;
+    std::vector<uint32_t> limits;   // BinLogSite::limits 指向这里
+};
+
+// 全局调用点表, 下标 + 1 即调用点 id; 用 deque, 追加时已有元素不会移动
+std::deque<SiteInfo>& GetSites() {
+    static std::deque<SiteInfo> s_sites;
+    return s_sites;
+}
+
+std::mutex& GetSitesMutex() {
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+std::atomic<uint64_t> s_writer_id(0);
+
+void PutString(std::string& out, const char* str, size_t len) {
+    char tmp[10];
+    out.append(tmp, binlog::PutVarint(tmp, len) - tmp);
+    out.append(str, len);
+}
+
+template<class T>
+void PutFixed(std::string& out, T v) {
+    out.append((const char*)&v, sizeof(v));
+}
+
+/**
+ * 按 printf 语法找出每个参数对应的转换 (和 sylar-logdecode 的解析一致), 记下 %s 的精度.
+ * 宽度和精度的 '*' 各占一个参数
+ */
+void ParseLimits(const std::string& fmt, std::vector<uint32_t>& limits) {
+    size_t arg = 0;
+    size_t n = fmt.size();
+    for (size_t i = 0; i < n; ++i) {
+        if (fmt[i] != '%') {
+            continue;
+        }
+        if (i + 1 < n && fmt[i + 1] == '%') {
+            ++i;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < n && strchr("-+ #0'", fmt[j])) {
+            ++j;
+        }
+        if (j < n && fmt[j] == '*') {
+            ++arg;
+            ++j;
+        }
+        while (j < n && isdigit((unsigned char)fmt[j])) {
+            ++j;
+        }
+        uint32_t limit = binlog::MAX_STRING;
+        if (j < n && fmt[j] == '.') {
+            ++j;
+            if (j < n && fmt[j] == '*') {
+                limit = binlog::PRECISION_ARG;
+                ++arg;
+                ++j;
+            } else {
+                uint64_t prec = 0;
+                while (j < n && isdigit((unsigned char)fmt[j])) {
+                    prec = std::min<uint64_t>(prec * 10 + (fmt[j] - '0'), binlog::MAX_STRING);
+                    ++j;
+                }
+                limit = (uint32_t)prec;
+            }
+        }
+        while (j < n && strchr("hlLqjzt", fmt[j])) {
+            ++j;
+        }
+        if (j >= n) {
+            break;
+        }
+        i = j;
+        if (fmt[j] == 'n') {
+            continue;
+        }
+        if (fmt[j] == 's' && arg < limits.size()) {
+            limits[arg] = limit;
+        }
+        ++arg;
+    }
+}
+
+void PutRecordHeader(std::string& out, binlog::RecordType type, size_t start) {
+    // 记录写完后回填长度
+    uint32_t len = out.size() - start;
+    out[start] = (char)type;
+    memcpy(&out[start + 1], &len, sizeof(len));
+}
+
+}
+
+uint32_t BinLogSite::registerSite(const char* types) {
+    std::lock_guard<std::mutex> lock(GetSitesMutex());
+    uint32_t v = id.load(std::memory_order_relaxed);
+    if (v) {
+        return v;
+    }
+    std::deque<SiteInfo>& sites = GetSites();
+    sites.push_back({file, line, fmt, types, std::vector<uint32_t>(strlen(types), binlog::MAX_STRING)});
+    ParseLimits(sites.back().fmt, sites.back().limits);
+    limits = sites.back().limits.data();
+    v = sites.size();
+    id.store(v, std::memory_order_release);
+    return v;
+}
+
+
+BinLogThreadBuffer::BinLogThreadBuffer(size_t capacity)
+    : m_write(0), m_read(0) {
+    size_t size = 4096;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+    m_data = (char*)malloc(size);
+}
+
+BinLogThreadBuffer::~BinLogThreadBuffer() {
+    free(m_data);
+}
+
+size_t BinLogThreadBuffer::used() const {
+    return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire);
+}
+
+char* BinLogThreadBuffer::tryReserve(size_t n) {
+    uint64_t w = m_write.load(std::memory_order_relaxed);
+    uint64_t r = m_read.load(std::memory_order_acquire);
+    size_t cap = capacity();
+    size_t off = w & m_mask;
+    size_t tail = cap - off;
+    if (tail < n) {
+        // 尾部放不下, 写一个 PAD 标记后从头开始, 保证每条记录在内存中连续
+        if (cap - (w - r) < tail + n) {
+            return nullptr;
+        }
+        m_data[off] = binlog::BINLOG_PAD;
+        m_write.store(w + tail, std::memory_order_release);
+        return m_data;
+    }
+    if (cap - (w - r) < n) {
+        return nullptr;
+    }
+    return m_data + off;
+}
+
+void BinLogThreadBuffer::commit(size_t n) {
+    m_write.store(m_write.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+size_t BinLogThreadBuffer::drain(std::string& out) {
+    uint64_t r = m_read.load(std::memory_order_relaxed);
+    uint64_t w = m_write.load(std::memory_order_acquire);
+    size_t n = 0;
+    while (r < w) {
+        size_t off = r & m_mask;
+        if (m_data[off] == binlog::BINLOG_PAD) {
+            r += capacity() - off;
+            continue;
+        }
+        uint32_t len;
+        memcpy(&len, m_data + off + 1, sizeof(len));
+        out.append(m_data + off, len);
+        r += len;
+        ++n;
+    }
+    m_read.store(r, std::memory_order_release);
+    return n;
+}
+
+
+BinLogWriter::BinLogWriter(const std::string& filename, const std::string& loggerName,
+                           const std::string& pattern, size_t bufferSize)
+    : m_id(++s_writer_id), m_filename(filename), m_loggerName(loggerName),
+      m_pattern(pattern), m_bufferSize(bufferSize),
+      m_stop(false), m_wakeup(false), m_dropped(0), m_producers(0) {
+    m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        std::cout << "BinLogWriter open " << m_filename << " failed, errno=" << errno << std::endl;
+    }
+    writeHeader();
+    m_thread = std::thread(std::bind(&BinLogWriter::run, this));
+}
+
+BinLogWriter::~BinLogWriter() {
+    stop();
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+uint64_t BinLogWriter::now() {
+    return LogEvent::IsCoarseClock() ? GetCurrentCoarseNS() : GetCurrentNS();
+}
+
+BinLogThreadBuffer* BinLogWriter::getThreadBuffer() {
+    struct Entry {
+        uint64_t id;
+        BinLogThreadBuffer::ptr buf;
+    };
+    static thread_local std::vector<Entry> t_buffers;
+    static thread_local uint64_t t_last_id = 0;
+    static thread_local BinLogThreadBuffer* t_last_buf = nullptr;
+
+    if (t_last_id == m_id) {
+        return t_last_buf;
+    }
+    for (auto& e : t_buffers) {
+        if (e.id == m_id) {
+            t_last_id = m_id;
+            t_last_buf = e.buf.get();
+            return t_last_buf;
+        }
+    }
+
+    BinLogThreadBuffer::ptr buf(new BinLogThreadBuffer(m_bufferSize));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffers.push_back(buf);
+    }
+    t_buffers.push_back({m_id, buf});
+    t_last_id = m_id;
+    t_last_buf = buf.get();
+    return t_last_buf;
+}
+
+char* BinLogWriter::reserve(BinLogThreadBuffer* buf, size_t size) {
+    // 先登记再检查 m_stop: 要么这里看到已经停止, 要么后台线程看到有生产者并等它提交完再最后收集一次
+    m_producers.fetch_add(1, std::memory_order_seq_cst);
+    if (size > buf->capacity() / 2 || m_stop.load(std::memory_order_seq_cst)) {
+        m_producers.fetch_sub(1, std::memory_order_release);
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    char* p = buf->tryReserve(size);
+    while (!p) {
+        if (m_stop.load(std::memory_order_relaxed)) {
+            // 后台线程要退出了, 不再等空间
+            m_producers.fetch_sub(1, std::memory_order_release);
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        // 缓冲区满, 唤醒后台线程并等待 (和 NanoLog 一样选择阻塞而不是丢日志)
+        if (!m_wakeup.exchange(true)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cond.notify_one();
+        }
+        std::this_thread::yield();
+        p = buf->tryReserve(size);
+    }
+    return p;
+}
+
+void BinLogWriter::commit(BinLogThreadBuffer* buf, size_t size) {
+    buf->commit(size);
+    if (buf->used() > buf->capacity() / 2 && !m_wakeup.load(std::memory_order_relaxed)
+            && !m_wakeup.exchange(true)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cond.notify_one();
+    }
+    m_producers.fetch_sub(1, std::memory_order_release);
+}
+
+void BinLogWriter::log(LogLevel::Level level, LogEvent::ptr event) {
+    const char* file = event->getFile() ? event->getFile() : "";
+    size_t file_len = strlen(file);
+    if (event->getFieldCount()) {
+        // 文本记录没有字段区, 字段以 k=v 接在消息后面
+        event->appendFields(event->getBuffer());
+    }
+    const LogBuffer& msg = event->getMessage();
+    size_t msg_len = msg.size() > binlog::MAX_STRING * 4 ? binlog::MAX_STRING * 4 : msg.size();
+    size_t size = binlog::RECORD_HEADER_SIZE + 8 + 4 + 4 + 4 + 1 + 4
+                + binlog::VarintSize(file_len) + file_len
+                + binlog::VarintSize(msg_len) + msg_len;
+
+    BinLogThreadBuffer* buf = getThreadBuffer();
+    char* p = reserve(buf, size);
+    if (!p) {
+        return;
+    }
+    *p++ = binlog::BINLOG_TEXT;
+    p = binlog::PutFixed<uint32_t>(p, size);
+    p = binlog::PutFixed<uint64_t>(p, event->getTime() * 1000000000ull + event->getNanoSecond());
+    p = binlog::PutFixed<uint32_t>(p, event->getThreadId());
+    p = binlog::PutFixed<uint32_t>(p, event->getFiberId());
+    p = binlog::PutFixed<uint32_t>(p, event->getElapse());
+    *p++ = (char)level;
+    p = binlog::PutFixed<int32_t>(p, event->getLine());
+    p = binlog::PutVarint(p, file_len);
+    memcpy(p, file, file_len);
+    p += file_len;
+    p = binlog::PutVarint(p, msg_len);
+    memcpy(p, msg.data(), msg_len);
+    commit(buf, size);
+}
+
+void BinLogWriter::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_stop.load(std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t req = ++m_flushReq;
+    m_wakeup.store(true, std::memory_order_relaxed);
+    m_cond.notify_one();
+    m_doneCond.wait(lock, [this, req]() {
+        return m_flushDone >= req || m_stop.load(std::memory_order_relaxed);
+    });
+}
+
+void BinLogWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop.exchange(true)) {
+            return;
+        }
+        m_cond.notify_one();
+    }
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    m_doneCond.notify_all();
+}
+
+void BinLogWriter::writeHeader() {
+    std::string out(binlog::MAGIC, sizeof(binlog::MAGIC));
+    PutFixed<uint32_t>(out, binlog::VERSION);
+    PutFixed<uint32_t>(out, binlog::ENDIAN_MARK);
+    PutFixed<uint64_t>(out, GetCurrentNS());
+    PutString(out, m_loggerName.data(), m_loggerName.size());
+    PutString(out, m_pattern.data(), m_pattern.size());
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+    PutString(out, host, strlen(host));
+    writeAll(out);
+}
+
+size_t BinLogWriter::collect(std::string& out) {
+    std::string records;
+    size_t n = 0;
+    {
+        std::vector<BinLogThreadBuffer::ptr> buffers;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            buffers = m_buffers;
+        }
+        for (auto& buf : buffers) {
+            n += buf->drain(records);
+        }
+    }
+    {
+        // 只剩这里持有的缓冲区说明所属线程已退出, 读完即可释放
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_buffers.begin(); it != m_buffers.end();) {
+            if (it->use_count() == 1 && (*it)->used() == 0) {
+                it = m_buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (!n) {
+        return 0;
+    }
+
+    // 必须在读取缓冲区之后再读调用点表, 才能保证记录引用的调用点都已写出
+    {
+        std::lock_guard<std::mutex> lock(GetSitesMutex());
+        std::deque<SiteInfo>& sites = GetSites();
+        for (; m_sitesWritten < sites.size(); ++m_sitesWritten) {
+            const SiteInfo& site = sites[m_sitesWritten];
+            size_t start = out.size();
+            out.append(binlog::RECORD_HEADER_SIZE, '\0');
+            PutFixed<uint32_t>(out, m_sitesWritten + 1);
+            PutFixed<int32_t>(out, site.line);
+            PutString(out, site.file, strlen(site.file));
+            PutString(out, site.fmt.data(), site.fmt.size());
+            PutString(out, site.types.data(), site.types.size());
+            PutRecordHeader(out, binlog::BINLOG_SITE, start);
+        }
+    }
+
+    size_t start = out.size();
+    out.append(binlog::RECORD_HEADER_SIZE, '\0');
+    PutRecordHeader(out, binlog::BINLOG_BATCH, start);
+    out.append(records);
+    return n;
+}
+
+void BinLogWriter::writeAll(const std::string& data) {
+    if (m_fd < 0) {
+        return;
+    }
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t rt = ::write(m_fd, data.data() + offset, data.size() - offset);
+        if (rt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offset += rt;
+    }
+}
+
+void BinLogWriter::run() {
+    std::string out;
+    while (true) {
+        uint64_t req;
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_wakeup.load(std::memory_order_relaxed) && !m_stop.load(std::memory_order_relaxed)
+                    && m_flushReq == m_flushDone) {
+                m_cond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            m_wakeup.store(false, std::memory_order_relaxed);
+            req = m_flushReq;
+            stop = m_stop.load(std::memory_order_relaxed);
+        }
+
+        out.clear();
+        if (collect(out)) {
+            writeAll(out);
+        }
+
+        if (req != m_flushDone) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_flushDone = req;
+            m_doneCond.notify_all();
+        }
+        if (stop) {
+            // 已经过了 m_stop 检查的生产者还会提交, 等它们提交完再最后收集一次
+            while (m_producers.load(std::memory_order_seq_cst) > 0) {
+                out.clear();
+                if (collect(out)) {
+                    writeAll(out);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            out.clear();
+            if (collect(out)) {
+                writeAll(out);
+            }
+            break;
+        }
+    }
+}
+
+}
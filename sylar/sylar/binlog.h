@@ -0,0 +1,350 @@
+#ifndef _SYLAR_BINLOG_H_
+#define _SYLAR_BINLOG_H_
+
+#include "log.h"
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <string>
+#include <type_traits>
+
+
+namespace sylar {
+
+/**
+ * 二进制日志 (延迟格式化): SYLAR_LOG_FMT_* 调用点的格式串只登记一次,
+ * 运行时只往线程私有缓冲区追加 调用点id + 原始参数字节, 由后台线程落盘,
+ * 再用 sylar-logdecode 按 LogFormatter 格式还原成文本.
+ *
+ * 文件格式 (整数为写入端的本机字节序, 由文件头里的标记检查):
+ *   文件头: "SYLARBL1" u32 版本 u32 字节序标记 u64 创建时间 str 日志器名 str 格式 str 主机名
+ *   之后是一串记录, 每条以 u8 类型 + u32 总长度开头:
+ *     BINLOG_SITE  u32 id, u32 行号, str 文件, str 格式串, str 参数类型
+ *     BINLOG_BATCH 一次落盘的开始, 同一批内的记录可按时间排序
+ *     BINLOG_LOG   u32 id, u8 级别, u64 时间(ns), u32 线程id, u32 协程id, u32 elapse, 参数...
+ *     BINLOG_TEXT  u64 时间(ns), u32 线程id, u32 协程id, u32 elapse, u8 级别, u32 行号, str 文件, str 消息
+ *   str 为 varint 长度 + 字节; 整数参数为 (zigzag) varint, 浮点为 8 字节 double
+ */
+namespace binlog {
+
+static const char MAGIC[8] = {'S', 'Y', 'L', 'A', 'R', 'B', 'L', '1'};
+static const uint32_t VERSION = 2;
+static const uint32_t ENDIAN_MARK = 0x01020304;
+
+enum RecordType {
+    BINLOG_PAD = 0,     // 只出现在内存环形缓冲区中, 表示跳到缓冲区开头
+    BINLOG_SITE = 1,
+    BINLOG_BATCH = 2,
+    BINLOG_LOG = 3,
+    BINLOG_TEXT = 4,
+};
+
+// 记录头: u8 类型 + u32 总长度
+static const size_t RECORD_HEADER_SIZE = 5;
+
+enum ArgType {
+    ARG_INT = 'i',
+    ARG_UINT = 'u',
+    ARG_DOUBLE = 'f',
+    ARG_STRING = 's',
+    ARG_POINTER = 'p',
+};
+
+// 格式串是字符串字面量 (const char 数组) 时才能按调用点登记, 其他情况走文本日志
+template<class T>
+struct IsLiteralFormat : std::false_type {};
+
+template<size_t N>
+struct IsLiteralFormat<const char (&)[N]> : std::true_type {};
+
+inline size_t VarintSize(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+inline char* PutVarint(char* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+inline uint64_t ZigZag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+template<class T>
+inline char* PutFixed(char* p, T v) {
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+// 单个字符串参数最多保存的字节数
+static const uint32_t MAX_STRING = 4096;
+// 字符串参数的长度上限由前一个参数给出 (%.*s)
+static const uint32_t PRECISION_ARG = 0xffffffff;
+
+/**
+ * 参数编码: size/encode 的 limit 只对字符串有效, 是登记调用点时按格式串算出的 %s 精度;
+ * precision 返回参数作为下一个 %.*s 的精度时的值, 不是整数时为 -1
+ */
+
+template<class T, class Enable = void>
+struct ArgTraits;
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type> {
+    static const char type = ARG_INT;
+    static size_t size(T v, uint32_t) { return VarintSize(ZigZag(v)); }
+    static char* encode(char* p, T v, uint32_t) { return PutVarint(p, ZigZag(v)); }
+    static int64_t precision(T v) { return v; }
+};
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type> {
+    static const char type = ARG_UINT;
+    static size_t size(T v, uint32_t) { return VarintSize(v); }
+    static char* encode(char* p, T v, uint32_t) { return PutVarint(p, v); }
+    static int64_t precision(T v) { return v > (T)INT32_MAX ? INT32_MAX : (int64_t)v; }
+};
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    static const char type = ARG_INT;
+    static size_t size(T v, uint32_t) { return VarintSize(ZigZag((int64_t)v)); }
+    static char* encode(char* p, T v, uint32_t) { return PutVarint(p, ZigZag((int64_t)v)); }
+    static int64_t precision(T v) { return (int64_t)v; }
+};
+
+template<class T>
+struct ArgTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static const char type = ARG_DOUBLE;
+    static size_t size(T, uint32_t) { return sizeof(double); }
+    static char* encode(char* p, T v, uint32_t) { return PutFixed<double>(p, v); }
+    static int64_t precision(T) { return -1; }
+};
+
+struct StringArgTraits {
+    static const char type = ARG_STRING;
+    // 最多读 limit 个字节, 带精度的 %s 可以传没有结尾 '\0' 的缓冲区
+    static size_t length(const char* v, uint32_t limit) {
+        if (!v) {
+            return limit < 6 ? limit : 6;
+        }
+        return strnlen(v, limit);
+    }
+    static size_t size(const char* v, uint32_t limit) {
+        size_t n = length(v, limit);
+        return VarintSize(n) + n;
+    }
+    static char* encode(char* p, const char* v, uint32_t limit) {
+        size_t n = length(v, limit);
+        p = PutVarint(p, n);
+        memcpy(p, v ? v : "(null)", n);
+        return p + n;
+    }
+    static int64_t precision(const char*) { return -1; }
+};
+
+template<>
+struct ArgTraits<const char*> : public StringArgTraits {};
+
+template<>
+struct ArgTraits<char*> : public StringArgTraits {};
+
+template<class T>
+struct ArgTraits<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type> {
+    static const char type = ARG_POINTER;
+    static size_t size(const T* v, uint32_t) { return VarintSize((uintptr_t)v); }
+    static char* encode(char* p, const T* v, uint32_t) { return PutVarint(p, (uintptr_t)v); }
+    static int64_t precision(const T*) { return -1; }
+};
+
+template<class T>
+struct Arg : public ArgTraits<typename std::decay<T>::type> {};
+
+// limits 为调用点登记时算出的每个参数的字符串长度上限, prev 为前一个参数的 precision()
+inline uint32_t ArgLimit(const uint32_t* limits, int64_t prev) {
+    if (*limits != PRECISION_ARG) {
+        return *limits;
+    }
+    // 负的精度等于没有精度
+    return prev < 0 || prev > (int64_t)MAX_STRING ? MAX_STRING : (uint32_t)prev;
+}
+
+inline size_t ArgsSize(const uint32_t*, int64_t) {
+    return 0;
+}
+
+template<class T, class... Args>
+inline size_t ArgsSize(const uint32_t* limits, int64_t prev, const T& v, const Args&... args) {
+    return Arg<T>::size(v, ArgLimit(limits, prev)) + ArgsSize(limits + 1, Arg<T>::precision(v), args...);
+}
+
+inline char* EncodeArgs(char* p, const uint32_t*, int64_t) {
+    return p;
+}
+
+template<class T, class... Args>
+inline char* EncodeArgs(char* p, const uint32_t* limits, int64_t prev, const T& v, const Args&... args) {
+    return EncodeArgs(Arg<T>::encode(p, v, ArgLimit(limits, prev)), limits + 1, Arg<T>::precision(v), args...);
+}
+
+template<class... Args>
+struct ArgTypes {
+    static const char value[sizeof...(Args) + 1];
+};
+
+template<class... Args>
+const char ArgTypes<Args...>::value[sizeof...(Args) + 1] = {Arg<Args>::type..., 0};
+
+}
+
+
+/**
+ * 调用点的静态信息, 常量初始化; 第一次写日志时在全局表中分配 id,
+ * 同时解析一次格式串, 得到每个参数的字符串长度上限 (%.Ns 为 N, %.*s 由前一个参数给出)
+ */
+struct BinLogSite {
+    const char* file;
+    int32_t line;
+    const char* fmt;
+    std::atomic<uint32_t> id;
+    const uint32_t* limits;     // 在 id 之前写好, 读到 id 之后可用
+
+    // 分配 id 并返回, 已分配时直接返回
+    uint32_t registerSite(const char* types);
+};
+
+
+/**
+ * 单个线程写、后台线程读的环形字节缓冲区
+ */
+class BinLogThreadBuffer {
+private:
+    char* m_data;
+    size_t m_mask;
+    char m_pad0[64];
+    std::atomic<uint64_t> m_write;
+    char m_pad1[64];
+    std::atomic<uint64_t> m_read;
+    char m_pad2[64];
+public:
+    typedef std::shared_ptr<BinLogThreadBuffer> ptr;
+
+    BinLogThreadBuffer(size_t capacity);
+    ~BinLogThreadBuffer();
+
+    size_t capacity() const { return m_mask + 1; }
+    size_t used() const;
+
+    // 生产者: 取得 n 字节的连续空间, 空间不足返回 nullptr
+    char* tryReserve(size_t n);
+    void commit(size_t n);
+
+    // 消费者: 把已提交的记录追加到 out
+    size_t drain(std::string& out);
+};
+
+
+class BinLogWriter {
+public:
+    typedef std::shared_ptr<BinLogWriter> ptr;
+
+    /**
+     * @param filename 输出文件 (追加写入时会新写一个文件头, 解码器支持)
+     * @param pattern 解码时使用的 LogFormatter 格式
+     * @param bufferSize 每个线程的缓冲区大小
+     */
+    BinLogWriter(const std::string& filename, const std::string& loggerName = "root",
+                 const std::string& pattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n",
+                 size_t bufferSize = 1 << 20);
+    ~BinLogWriter();
+
+    template<class... Args>
+    void log(BinLogSite& site, LogLevel::Level level, const Args&... args) {
+        uint32_t id = site.id.load(std::memory_order_acquire);
+        if (!id) {
+            id = site.registerSite(binlog::ArgTypes<Args...>::value);
+        }
+        size_t size = binlog::RECORD_HEADER_SIZE + 4 + 1 + 8 + 4 + 4 + 4 + binlog::ArgsSize(site.limits, -1, args...);
+        BinLogThreadBuffer* buf = getThreadBuffer();
+        char* p = reserve(buf, size);
+        if (!p) {
+            return;
+        }
+        *p++ = binlog::BINLOG_LOG;
+        p = binlog::PutFixed<uint32_t>(p, size);
+        p = binlog::PutFixed<uint32_t>(p, id);
+        p = binlog::PutFixed<uint8_t>(p, level);
+        p = binlog::PutFixed<uint64_t>(p, now());
+        p = binlog::PutFixed<uint32_t>(p, GetThreadId());
+        p = binlog::PutFixed<uint32_t>(p, GetFiberId());
+        p = binlog::PutFixed<uint32_t>(p, (uint32_t)GetElapsedMS());
+        binlog::EncodeArgs(p, site.limits, -1, args...);
+        commit(buf, size);
+    }
+
+    // 已经格式化好的事件 (流式宏) 以文本记录写入
+    void log(LogLevel::Level level, LogEvent::ptr event);
+
+    // 等待调用前写入的记录全部落盘
+    void flush();
+    void stop();
+
+    const std::string& getFilename() const { return m_filename; }
+    // 单条记录过大或 stop() 之后写入而丢弃的条数
+    uint64_t getDropCount() const { return m_dropped.load(std::memory_order_relaxed); }
+private:
+    // 缓冲区满时等待后台线程腾出空间; 记录超过缓冲区一半大小或已经 stop() 时丢弃并返回 nullptr.
+    // 返回非空时调用方必须 commit
+    char* reserve(BinLogThreadBuffer* buf, size_t size);
+    void commit(BinLogThreadBuffer* buf, size_t size);
+    BinLogThreadBuffer* getThreadBuffer();
+    static uint64_t now();
+    void run();
+    void writeHeader();
+    size_t collect(std::string& out);
+    void writeAll(const std::string& data);
+private:
+    uint64_t m_id;
+    std::string m_filename;
+    std::string m_loggerName;
+    std::string m_pattern;
+    size_t m_bufferSize;
+    int m_fd = -1;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_doneCond;
+    std::vector<BinLogThreadBuffer::ptr> m_buffers;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_wakeup;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<int> m_producers;       // 在 reserve 和 commit 之间的线程数
+    uint64_t m_flushReq = 0;
+    uint64_t m_flushDone = 0;
+    size_t m_sitesWritten = 0;
+    std::thread m_thread;
+};
+
+}
+
+
+// 级别不记在调用点里, 同一调用点的级别可以是运行时变量
+#define SYLAR_BINLOG_SITE(fmt) \
+    static sylar::BinLogSite sylar_binlog_site = {__FILE__, __LINE__, fmt, {0}, nullptr}
+
+#define SYLAR_BINLOG_LITERAL(fmt) sylar::binlog::IsLiteralFormat<decltype((fmt))>::value
+
+#endif
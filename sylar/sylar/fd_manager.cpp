@@ -0,0 +1,119 @@
+#include "fd_manager.h"
+#include "hook.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace sylar {
+
+FdCtx::FdCtx(int fd)
+    : m_fd(fd) {
+    init();
+}
+
+bool FdCtx::init() {
+    if (m_isInit) {
+        return true;
+    }
+    m_recvTimeout = ~0ull;
+    m_sendTimeout = ~0ull;
+
+    struct stat fd_stat;
+    if (fstat(m_fd, &fd_stat) == -1) {
+        m_isInit = false;
+        m_isSocket = false;
+    } else {
+        m_isInit = true;
+        m_isSocket = S_ISSOCK(fd_stat.st_mode);
+    }
+
+    if (m_isSocket) {
+        int flags = fcntl_f(m_fd, F_GETFL, 0);
+        if (!(flags & O_NONBLOCK)) {
+            fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        m_sysNonblock = true;
+    } else {
+        m_sysNonblock = false;
+    }
+    m_userNonblock = false;
+    m_isClosed = false;
+    return m_isInit;
+}
+
+void FdCtx::setTimeout(int type, uint64_t v) {
+    if (type == SO_RCVTIMEO) {
+        m_recvTimeout = v;
+    } else {
+        m_sendTimeout = v;
+    }
+}
+
+uint64_t FdCtx::getTimeout(int type) const {
+    if (type == SO_RCVTIMEO) {
+        return m_recvTimeout;
+    }
+    return m_sendTimeout;
+}
+
+FdManager::FdManager() {
+    for (auto& c : m_chunks) {
+        c.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+FdManager::~FdManager() {
+    // 退出时其他静态对象的析构还可能调用被 hook 的 close, 清空后查找直接返回空
+    for (auto& c : m_chunks) {
+        delete[] c.exchange(nullptr, std::memory_order_acq_rel);
+    }
+}
+
+FdCtx::ptr* FdManager::slot(int fd, bool create) {
+    if (fd < 0 || fd >= CHUNK_SIZE * MAX_CHUNKS) {
+        return nullptr;
+    }
+    std::atomic<FdCtx::ptr*>& chunk = m_chunks[fd >> CHUNK_BITS];
+    FdCtx::ptr* c = chunk.load(std::memory_order_acquire);
+    if (!c) {
+        if (!create) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        c = chunk.load(std::memory_order_relaxed);
+        if (!c) {
+            c = new FdCtx::ptr[CHUNK_SIZE];
+            chunk.store(c, std::memory_order_release);
+        }
+    }
+    return &c[fd & (CHUNK_SIZE - 1)];
+}
+
+FdCtx::ptr FdManager::get(int fd, bool auto_create) {
+    FdCtx::ptr* s = slot(fd, auto_create);
+    if (!s) {
+        return nullptr;
+    }
+    FdCtx::ptr ctx = std::atomic_load(s);
+    if (ctx || !auto_create) {
+        return ctx;
+    }
+    FdCtx::ptr created(new FdCtx(fd));
+    // 两个线程同时创建时以先放进去的为准
+    if (std::atomic_compare_exchange_strong(s, &ctx, created)) {
+        return created;
+    }
+    return ctx;
+}
+
+void FdManager::del(int fd) {
+    FdCtx::ptr* s = slot(fd, false);
+    if (s) {
+        std::atomic_store(s, FdCtx::ptr());
+    }
+}
+
+}
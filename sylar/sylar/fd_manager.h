@@ -0,0 +1,76 @@
+#ifndef _SYLAR_FD_MANAGER_H_
+#define _SYLAR_FD_MANAGER_H_
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "singleton.h"
+
+
+namespace sylar {
+
+/**
+ * hook 记录的文件描述符状态: 是否 socket, 用户是否自己设置了非阻塞, 收发超时.
+ * socket 在 hook 里总是被设成非阻塞, 用户看到的仍是自己设置的阻塞模式
+ */
+class FdCtx : public std::enable_shared_from_this<FdCtx> {
+public:
+    typedef std::shared_ptr<FdCtx> ptr;
+
+    FdCtx(int fd);
+
+    bool isInit() const { return m_isInit; }
+    bool isSocket() const { return m_isSocket; }
+    bool isClose() const { return m_isClosed; }
+    void setClose() { m_isClosed = true; }
+
+    void setUserNonblock(bool v) { m_userNonblock = v; }
+    bool getUserNonblock() const { return m_userNonblock; }
+    void setSysNonblock(bool v) { m_sysNonblock = v; }
+    bool getSysNonblock() const { return m_sysNonblock; }
+
+    // type 为 SO_RCVTIMEO 或 SO_SNDTIMEO, 毫秒, ~0ull 表示不超时
+    void setTimeout(int type, uint64_t v);
+    uint64_t getTimeout(int type) const;
+private:
+    bool init();
+private:
+    bool m_isInit = false;
+    bool m_isSocket = false;
+    bool m_sysNonblock = false;
+    bool m_userNonblock = false;
+    bool m_isClosed = false;
+    int m_fd;
+    uint64_t m_recvTimeout = ~0ull;
+    uint64_t m_sendTimeout = ~0ull;
+};
+
+/**
+ * fd 到 FdCtx 的表. 两级数组: 第一级固定大小, 第二级每块 4096 个槽位按需分配, 分配后不再移动;
+ * 查找不加锁, 槽位里的 shared_ptr 用 atomic_load/atomic_store 读写
+ */
+class FdManager {
+public:
+    static const int CHUNK_BITS = 12;
+    static const int CHUNK_SIZE = 1 << CHUNK_BITS;
+    static const int MAX_CHUNKS = 1024;     // 最大 fd 4M
+
+    FdManager();
+    ~FdManager();
+
+    // auto_create 为 true 时没有记录就新建
+    FdCtx::ptr get(int fd, bool auto_create = false);
+    void del(int fd);
+private:
+    FdCtx::ptr* slot(int fd, bool create);
+private:
+    std::mutex m_mutex;
+    std::atomic<FdCtx::ptr*> m_chunks[MAX_CHUNKS];
+};
+
+typedef Singleton<FdManager> FdMgr;
+
+}
+
+#endif
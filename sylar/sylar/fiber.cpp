@@ -0,0 +1,349 @@
+#include "fiber.h"
+#include "log.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <vector>
+#include <mutex>
+
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+namespace {
+
+std::atomic<uint64_t> s_fiber_id{0};
+std::atomic<uint64_t> s_fiber_count{0};
+std::atomic<size_t> s_stack_size{128 * 1024};
+
+thread_local Fiber* t_fiber = nullptr;
+thread_local Fiber::ptr t_thread_fiber;
+
+/**
+ * 协程在线程间迁移后, 编译器可能沿用切换前算出的线程局部变量地址 (-fPIC 下 __tls_get_addr 的结果).
+ * 所有访问都经过这两个不内联的函数, 切换之后重新取地址
+ */
+__attribute__((noinline)) Fiber* CurrentFiber() {
+    return t_fiber;
+}
+
+__attribute__((noinline)) void SetCurrentFiber(Fiber* f) {
+    t_fiber = f;
+}
+
+size_t PageSize() {
+    static size_t s_page = sysconf(_SC_PAGESIZE);
+    return s_page;
+}
+
+/**
+ * 协程栈分配器. 每个栈单独 mmap, 最低的一页设为不可访问作为保护页, 栈溢出时直接 SIGSEGV 而不是踩坏别的内存.
+ * 释放的栈先放进线程缓存, 满了放进全局池, 都满了才 munmap; 复用时物理页已经在, 省掉 mmap 和缺页.
+ * 每个栈占两个内存映射区, 同时存在的协程数受 vm.max_map_count 限制
+ */
+class StackAllocator {
+public:
+    static const size_t THREAD_CACHE = 16;
+    static const size_t GLOBAL_CACHE = 256;
+
+    struct Stack {
+        void* base;     // 可用区域的最低地址
+        size_t size;
+    };
+
+    static void* Alloc(size_t size) {
+        ThreadCache& tc = t_cache;
+        for (size_t i = tc.stacks.size(); i > 0; --i) {
+            if (tc.stacks[i - 1].size == size) {
+                void* base = tc.stacks[i - 1].base;
+                tc.stacks.erase(tc.stacks.begin() + (i - 1));
+                return base;
+            }
+        }
+        {
+            Global& g = GetGlobal();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            for (size_t i = g.stacks.size(); i > 0; --i) {
+                if (g.stacks[i - 1].size == size) {
+                    void* base = g.stacks[i - 1].base;
+                    g.stacks.erase(g.stacks.begin() + (i - 1));
+                    return base;
+                }
+            }
+        }
+        size_t page = PageSize();
+        void* p = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        if (mprotect(p, page, PROT_NONE)) {
+            munmap(p, size + page);
+            return nullptr;
+        }
+        return (char*)p + page;
+    }
+
+    static void Dealloc(void* base, size_t size) {
+        ThreadCache& tc = t_cache;
+        if (tc.stacks.size() < THREAD_CACHE) {
+            tc.stacks.push_back(Stack{base, size});
+            return;
+        }
+        Release(base, size);
+    }
+private:
+    struct Global {
+        std::mutex mutex;
+        std::vector<Stack> stacks;
+    };
+
+    // 线程退出时缓存的栈交给全局池
+    struct ThreadCache {
+        std::vector<Stack> stacks;
+
+        ~ThreadCache() {
+            for (auto& s : stacks) {
+                Release(s.base, s.size);
+            }
+        }
+    };
+
+    static Global& GetGlobal() {
+        // 不析构, 退出时别的线程可能还在释放栈
+        static Global* s_global = new Global;
+        return *s_global;
+    }
+
+    static void Release(void* base, size_t size) {
+        {
+            Global& g = GetGlobal();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            if (g.stacks.size() < GLOBAL_CACHE) {
+                g.stacks.push_back(Stack{base, size});
+                return;
+            }
+        }
+        size_t page = PageSize();
+        munmap((char*)base - page, size + page);
+    }
+
+    static thread_local ThreadCache t_cache;
+};
+
+thread_local StackAllocator::ThreadCache StackAllocator::t_cache;
+
+}
+
+#if defined(__x86_64__)
+/**
+ * sylar_fiber_switch(void** from_sp, void* to_sp)
+ * 把被调用者保存的寄存器和 mxcsr/x87 控制字压到当前栈上, 栈顶存入 *from_sp, 再从 to_sp 弹出对方的
+ */
+extern "C" void sylar_fiber_switch(void** from_sp, void* to_sp);
+
+asm(R"(
+    .text
+    .globl sylar_fiber_switch
+    .hidden sylar_fiber_switch
+    .type sylar_fiber_switch, @function
+sylar_fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size sylar_fiber_switch, .-sylar_fiber_switch
+)");
+#endif
+
+Fiber::Fiber()
+    : m_running(true) {
+    m_state = EXEC;
+#if !defined(__x86_64__)
+    getcontext(&m_ctx);
+#endif
+    SetCurrentFiber(this);
+}
+
+Fiber::Fiber(std::function<void()> cb, size_t stacksize)
+    : m_id(++s_fiber_id),
+      m_stacksize(stacksize ? stacksize : GetDefaultStackSize()),
+      m_running(false),
+      m_cb(std::move(cb)) {
+    size_t page = PageSize();
+    m_stacksize = (m_stacksize + page - 1) / page * page;
+    m_stack = StackAllocator::Alloc(m_stacksize);
+    if (!m_stack) {
+        throw std::bad_alloc();
+    }
+    ++s_fiber_count;
+    initContext();
+}
+
+Fiber::~Fiber() {
+    if (m_stack) {
+        assert(m_state == INIT || m_state == TERM || m_state == EXCEPT);
+        StackAllocator::Dealloc(m_stack, m_stacksize);
+        --s_fiber_count;
+    } else if (CurrentFiber() == this) {
+        SetCurrentFiber(nullptr);
+    }
+}
+
+void Fiber::initContext() {
+#if defined(__x86_64__)
+    // 从高地址往下: 假的返回地址 0, MainFunc 作为 ret 的目标, rbp..r15 清零, mxcsr/x87 控制字取默认值.
+    // ret 之后 rsp = 栈顶 - 8, 和 call 进入函数时的对齐一致
+    uintptr_t top = ((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15;
+    uint64_t* sp = (uint64_t*)(top - 72);
+    memset(sp, 0, 72);
+    uint32_t mxcsr = 0x1F80;
+    uint16_t fpucw = 0x037F;
+    memcpy(sp, &mxcsr, 4);
+    memcpy((char*)sp + 4, &fpucw, 2);
+    sp[7] = (uint64_t)(uintptr_t)&Fiber::MainFunc;
+    m_sp = sp;
+#else
+    getcontext(&m_ctx);
+    m_ctx.uc_link = nullptr;
+    m_ctx.uc_stack.ss_sp = m_stack;
+    m_ctx.uc_stack.ss_size = m_stacksize;
+    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+#endif
+}
+
+void Fiber::Switch(Fiber* from, Fiber* to) {
+#if defined(__x86_64__)
+    sylar_fiber_switch(&from->m_sp, to->m_sp);
+#else
+    swapcontext(&from->m_ctx, &to->m_ctx);
+#endif
+}
+
+void Fiber::reset(std::function<void()> cb) {
+    assert(m_stack);
+    assert(m_state == INIT || m_state == TERM || m_state == EXCEPT);
+    m_cb = std::move(cb);
+    initContext();
+    m_state = INIT;
+}
+
+Fiber::State Fiber::resume() {
+    bool expected = false;
+    while (!m_running.compare_exchange_weak(expected, true, std::memory_order_acquire)) {
+        expected = false;
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+    assert(m_stack && m_state != EXEC && m_state != TERM && m_state != EXCEPT);
+    Fiber* cur = CurrentFiber();
+    if (!cur) {
+        GetThis();
+        cur = CurrentFiber();
+    }
+    m_caller = cur;
+    m_state = EXEC;
+    SetCurrentFiber(this);
+    Switch(cur, this);
+    // 回到了调用方, 本协程的上下文已经保存好, 先取状态再放行别的线程
+    State state = m_state;
+    m_running.store(false, std::memory_order_release);
+    return state;
+}
+
+void Fiber::yield() {
+    assert(m_stack && m_caller);
+    if (m_state == EXEC) {
+        m_state = HOLD;
+    }
+    Fiber* caller = m_caller;
+    m_caller = nullptr;
+    SetCurrentFiber(caller);
+    Switch(this, caller);
+}
+
+Fiber::ptr Fiber::GetThis() {
+    Fiber* cur = CurrentFiber();
+    if (cur) {
+        return cur->shared_from_this();
+    }
+    Fiber::ptr main(new Fiber);
+    t_thread_fiber = main;
+    return main;
+}
+
+void Fiber::SetThis(Fiber* f) {
+    SetCurrentFiber(f);
+}
+
+void Fiber::YieldToReady() {
+    Fiber* cur = CurrentFiber();
+    cur->m_state = READY;
+    cur->yield();
+}
+
+void Fiber::YieldToHold() {
+    Fiber* cur = CurrentFiber();
+    cur->m_state = HOLD;
+    cur->yield();
+}
+
+uint64_t Fiber::TotalFibers() {
+    return s_fiber_count.load(std::memory_order_relaxed);
+}
+
+uint64_t Fiber::GetFiberId() {
+    Fiber* cur = CurrentFiber();
+    return cur ? cur->m_id : 0;
+}
+
+void Fiber::SetDefaultStackSize(size_t size) {
+    s_stack_size.store(size, std::memory_order_relaxed);
+}
+
+size_t Fiber::GetDefaultStackSize() {
+    return s_stack_size.load(std::memory_order_relaxed);
+}
+
+void Fiber::MainFunc() {
+    // 回调里可能换了线程, 之后只用栈上的 cur
+    Fiber* cur = CurrentFiber();
+    try {
+        cur->m_cb();
+        cur->m_cb = nullptr;
+        cur->m_state = TERM;
+    } catch (std::exception& ex) {
+        cur->m_cb = nullptr;
+        cur->m_state = EXCEPT;
+        SYLAR_LOG_ERROR(g_logger) << "fiber " << cur->m_id << " except: " << ex.what();
+    } catch (...) {
+        cur->m_cb = nullptr;
+        cur->m_state = EXCEPT;
+        SYLAR_LOG_ERROR(g_logger) << "fiber " << cur->m_id << " except";
+    }
+    cur->yield();
+    // 结束的协程不会再被恢复
+    abort();
+}
+
+}
@@ -0,0 +1,98 @@
+#ifndef _SYLAR_FIBER_H_
+#define _SYLAR_FIBER_H_
+
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <stdint.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+
+namespace sylar {
+
+/**
+ * 有栈协程. 每个线程第一次调用 GetThis() 时为线程本身创建一个没有独立栈的主协程.
+ * resume() 从当前协程切到目标协程, 目标协程 yield() 时回到恢复它的那个协程, 所以可以嵌套.
+ * 协程可以在一个线程上切出、在另一个线程上恢复 (调度器就是这样用的), 协程里不要跨 yield 持有线程局部变量的引用.
+ * x86_64 上用几条汇编保存/恢复被调用者保存的寄存器完成切换, 不像 swapcontext 那样每次都有一次 sigprocmask 系统调用;
+ * 其他平台用 ucontext
+ */
+class Fiber : public std::enable_shared_from_this<Fiber> {
+public:
+    typedef std::shared_ptr<Fiber> ptr;
+
+    enum State {
+        INIT,       // 创建或 reset 之后还没运行
+        HOLD,       // 切出后等待别人重新调度
+        EXEC,       // 正在运行
+        TERM,       // 回调正常结束
+        READY,      // 切出后希望调度器马上重新调度
+        EXCEPT,     // 回调抛出异常结束
+    };
+private:
+    // 线程主协程
+    Fiber();
+public:
+    // stacksize 为 0 时使用 GetDefaultStackSize()
+    Fiber(std::function<void()> cb, size_t stacksize = 0);
+    ~Fiber();
+
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+
+    // 在 INIT/TERM/EXCEPT 状态下换一个回调, 复用已有的栈
+    void reset(std::function<void()> cb);
+
+    /**
+     * 切到本协程运行, 它 yield 或结束后返回, 返回值是切回时的状态.
+     * 状态为 HOLD 时协程可能已经被别的线程再次恢复, 调用方之后不能再读 getState().
+     * 协程在别的线程上还没切出时, 这里会自旋等它保存完上下文
+     */
+    State resume();
+    // 切回恢复本协程的协程; 状态为 EXEC 时改为 HOLD
+    void yield();
+
+    uint64_t getId() const { return m_id; }
+    State getState() const { return m_state; }
+    void setState(State state) { m_state = state; }
+public:
+    // 当前线程正在运行的协程, 没有时创建线程主协程
+    static Fiber::ptr GetThis();
+    static void SetThis(Fiber* f);
+    // 切出到调用方, 调度器会马上重新调度
+    static void YieldToReady();
+    // 切出到调用方, 由别人通过调度器重新调度
+    static void YieldToHold();
+    // 当前存活的有栈协程数
+    static uint64_t TotalFibers();
+    // 当前协程 id, 不在协程中 (线程主协程) 时为 0
+    static uint64_t GetFiberId();
+
+    // 新协程的默认栈大小, 默认 128KB. 栈按需分配物理页, 实际占用的内存取决于用到的深度
+    static void SetDefaultStackSize(size_t size);
+    static size_t GetDefaultStackSize();
+
+    static void MainFunc();
+private:
+    void initContext();
+    static void Switch(Fiber* from, Fiber* to);
+private:
+    uint64_t m_id = 0;
+    size_t m_stacksize = 0;
+    State m_state = INIT;
+    void* m_stack = nullptr;
+#if defined(__x86_64__)
+    void* m_sp = nullptr;           // 切出时的栈顶, 寄存器保存在栈上
+#else
+    ucontext_t m_ctx;
+#endif
+    Fiber* m_caller = nullptr;      // 恢复本协程的协程
+    std::atomic<bool> m_running;    // 在某个线程上运行, 上下文还没保存完
+    std::function<void()> m_cb;
+};
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "format.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+namespace sylar {
+
+namespace logfmt {
+
+namespace {
+
+// 解析 {:[[填充]对齐][0][宽度][.精度][类型]}, 不带 ':' 的内容忽略
+void ParseSpec(const char* s, const char* end, FormatSpec& spec) {
+    if (s == end || *s != ':') {
+        return;
+    }
+    ++s;
+    if (end - s >= 2 && (s[1] == '<' || s[1] == '>')) {
+        spec.fill = s[0];
+        spec.align = s[1];
+        s += 2;
+    } else if (s < end && (*s == '<' || *s == '>')) {
+        spec.align = *s++;
+    }
+    if (s < end && *s == '0') {
+        spec.fill = '0';
+        ++s;
+    }
+    while (s < end && *s >= '0' && *s <= '9') {
+        spec.width = spec.width * 10 + (*s++ - '0');
+    }
+    if (s < end && *s == '.') {
+        ++s;
+        spec.precision = 0;
+        while (s < end && *s >= '0' && *s <= '9') {
+            spec.precision = spec.precision * 10 + (*s++ - '0');
+        }
+    }
+    if (s < end) {
+        spec.type = *s;
+    }
+}
+
+const uint64_t s_pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull,
+    1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+};
+
+}
+
+FormatSite::FormatSite(const char* fmt) {
+    const char* p = fmt;
+    uint32_t begin = 0;
+    while (true) {
+        const char* start = p;
+        while (*p && *p != '{' && *p != '}') {
+            ++p;
+        }
+        m_text.append(start, p - start);
+        if (!*p) {
+            break;
+        }
+        if (p[1] == *p || *p == '}') {
+            // {{ }} 转义, 单独的 } 原样输出
+            m_text.append(1, *p);
+            p += p[1] == *p ? 2 : 1;
+            continue;
+        }
+        // 编译期已经检查过, 这里的未闭合 { 只会来自绕过宏的调用, 原样输出
+        const char* close = strchr(p + 1, '}');
+        if (!close) {
+            m_text.append(p);
+            break;
+        }
+        Piece piece;
+        piece.begin = begin;
+        piece.end = m_text.size();
+        ParseSpec(p + 1, close, piece.spec);
+        m_pieces.push_back(piece);
+        begin = m_text.size();
+        p = close + 1;
+    }
+    Piece tail;
+    tail.begin = begin;
+    tail.end = m_text.size();
+    m_pieces.push_back(tail);
+}
+
+void AppendHex(LogBuffer& buf, uint64_t v, bool upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = digits[v & 15];
+        v >>= 4;
+    } while (v);
+    char* p = buf.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        p[i] = tmp[n - 1 - i];
+    }
+    buf.commit(n);
+}
+
+void AppendDouble(LogBuffer& buf, double v, const FormatSpec& spec) {
+    if (isnan(v)) {
+        buf.append("nan", 3);
+        return;
+    }
+    if (isinf(v)) {
+        buf.append(v < 0 ? "-inf" : "inf");
+        return;
+    }
+
+    // {} 不指定精度: 输出能原样读回的最短表示, 不丢精度
+    if (spec.type == 0 && spec.precision < 0) {
+        double a = fabs(v);
+        if (a < 1e15 && a == floor(a)) {
+            if (v < 0) {
+                buf.append('-');
+            }
+            buf.appendUInt((uint64_t)a);
+            return;
+        }
+        char tmp[32];
+        int n = 0;
+        for (int prec = 15; prec <= 17; ++prec) {
+            n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+            if (strtod(tmp, nullptr) == v) {
+                break;
+            }
+        }
+        buf.append(tmp, n);
+        return;
+    }
+
+    // 显式的定点小数 {:.Nf} 直接按整数拼出来
+    bool fixed = spec.type == 'f' || spec.type == 'F';
+    int precision = spec.precision >= 0 ? spec.precision : 6;
+    if (fixed && precision <= 9) {
+        double scaled = fabs(v) * s_pow10[precision] + 0.5;
+        if (scaled < 1e18) {
+            uint64_t scale = s_pow10[precision];
+            uint64_t n = (uint64_t)scaled;
+            uint64_t frac = n % scale;
+            if (v < 0 && n) {
+                buf.append('-');
+            }
+            buf.appendUInt(n / scale);
+            if (precision > 0) {
+                buf.append('.');
+                char* p = buf.reserve(precision);
+                for (int i = precision - 1; i >= 0; --i) {
+                    p[i] = '0' + frac % 10;
+                    frac /= 10;
+                }
+                buf.commit(precision);
+            }
+            return;
+        }
+    }
+
+    char type = spec.type ? spec.type : 'g';
+    if (!strchr("fFeEgGaA", type)) {
+        type = 'g';
+    }
+    char fmt[8] = {'%', '.', '*', type, 0};
+    char* p = buf.reserve(64);
+    int n = snprintf(p, 64, fmt, precision, v);
+    if (n >= 64) {
+        p = buf.reserve(n + 1);
+        n = snprintf(p, n + 1, fmt, precision, v);
+    }
+    if (n > 0) {
+        buf.commit(n);
+    }
+}
+
+void Pad(LogBuffer& buf, size_t start, const FormatSpec& spec, bool numeric) {
+    size_t len = buf.size() - start;
+    if ((int)len >= spec.width) {
+        return;
+    }
+    size_t pad = spec.width - len;
+    char* base = buf.reserve(pad) - buf.size();
+    bool right = spec.align ? spec.align == '>' : numeric;
+    if (right) {
+        memmove(base + start + pad, base + start, len);
+        memset(base + start, spec.fill, pad);
+        if (spec.fill == '0' && base[start + pad] == '-') {
+            // 补 0 时负号放在最前面
+            base[start] = '-';
+            base[start + pad] = '0';
+        }
+    } else {
+        memset(base + start + len, spec.fill, pad);
+    }
+    buf.commit(pad);
+}
+
+}
+
+}
@@ -0,0 +1,317 @@
+#ifndef _SYLAR_FORMAT_H_
+#define _SYLAR_FORMAT_H_
+
+#include "log.h"
+#include <cmath>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+
+/**
+ * {} 风格的格式化日志, 直接写入事件的消息缓冲区, 不经过 vasprintf 和 stringstream.
+ *   SYLAR_LOG_FORMAT_INFO(logger, "user {} login from {}, cost {:.3f}ms", uid, ip, ms);
+ * 占位符: {} 默认格式 (浮点数输出能原样读回的最短表示), {:x} {:X} 十六进制, {:.3f} 定点小数, {:e} {:g} 科学计数,
+ *         {:8} {:08} {:<8} {:>8} 宽度/填充/对齐; {{ 和 }} 输出花括号.
+ * 格式串必须是字符串字面量, 占位符个数和格式说明在编译期检查;
+ * 运行期每个调用点只在第一次执行时解析一次格式串 (FormatSite), 之后按解析结果直接拼接.
+ */
+#define SYLAR_LOG_FORMAT_LEVEL(logger, level, format_str, ...) \
+    do { \
+        static_assert(sylar::logfmt::ValidFormat(format_str), \
+                      "invalid {} format spec or unterminated '{'"); \
+        static_assert(sylar::logfmt::CountPlaceholders(format_str) == \
+                      std::tuple_size<decltype(std::forward_as_tuple(__VA_ARGS__))>::value, \
+                      "number of {} placeholders does not match number of arguments"); \
+        if (SYLAR_LOG_ENABLED(logger, level)) { \
+            static const sylar::logfmt::FormatSite sylar_format_site(format_str); \
+            sylar::LogEventWrap sylar_wrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId())); \
+            sylar::logfmt::FormatTo(sylar_wrap.getEvent()->getBuffer(), sylar_format_site, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define SYLAR_LOG_FORMAT_DEBUG(logger, format_str, ...) SYLAR_LOG_FORMAT_LEVEL(logger, sylar::LogLevel::DEBUG, format_str, ##__VA_ARGS__)
+#define SYLAR_LOG_FORMAT_INFO(logger, format_str, ...) SYLAR_LOG_FORMAT_LEVEL(logger, sylar::LogLevel::INFO, format_str, ##__VA_ARGS__)
+#define SYLAR_LOG_FORMAT_WARN(logger, format_str, ...) SYLAR_LOG_FORMAT_LEVEL(logger, sylar::LogLevel::WARN, format_str, ##__VA_ARGS__)
+#define SYLAR_LOG_FORMAT_ERROR(logger, format_str, ...) SYLAR_LOG_FORMAT_LEVEL(logger, sylar::LogLevel::ERROR, format_str, ##__VA_ARGS__)
+#define SYLAR_LOG_FORMAT_FATAL(logger, format_str, ...) SYLAR_LOG_FORMAT_LEVEL(logger, sylar::LogLevel::FATAL, format_str, ##__VA_ARGS__)
+
+
+namespace sylar {
+
+namespace logfmt {
+
+// 返回 '}' 之后的位置
+constexpr const char* SkipSpec(const char* s) {
+    return *s == '\0' ? s : (*s == '}' ? s + 1 : SkipSpec(s + 1));
+}
+
+// 编译期统计占位符个数 (递归深度等于格式串长度, 受编译器 constexpr 深度限制)
+constexpr size_t CountPlaceholders(const char* s) {
+    return *s == '\0' ? 0
+        : (*s == '{' && s[1] == '{') ? CountPlaceholders(s + 2)
+        : (*s == '}' && s[1] == '}') ? CountPlaceholders(s + 2)
+        : *s == '{' ? 1 + CountPlaceholders(SkipSpec(s + 1))
+        : CountPlaceholders(s + 1);
+}
+
+/**
+ * 编译期检查格式说明, 语法和 ParseSpec 一致: {} 或 {:[[填充]对齐][0][宽度][.精度][类型]},
+ * 类型只能是 x X d f F e E g G a A; 未闭合的 { 和不以 ':' 开头的内容 (如 {0}) 都不合法
+ */
+constexpr bool IsSpecDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr const char* SkipSpecDigits(const char* s) {
+    return IsSpecDigit(*s) ? SkipSpecDigits(s + 1) : s;
+}
+
+constexpr bool IsSpecType(char c) {
+    return c == 'x' || c == 'X' || c == 'd' || c == 'f' || c == 'F' || c == 'e' || c == 'E'
+        || c == 'g' || c == 'G' || c == 'a' || c == 'A';
+}
+
+constexpr bool ValidSpecType(const char* s) {
+    return *s == '}' || (IsSpecType(*s) && s[1] == '}');
+}
+
+constexpr bool ValidSpecPrecision(const char* s) {
+    return *s == '.' ? IsSpecDigit(s[1]) && ValidSpecType(SkipSpecDigits(s + 1)) : ValidSpecType(s);
+}
+
+// '0' 填充和宽度都是数字, 一起跳过
+constexpr bool ValidSpecAlign(const char* s) {
+    return (*s != '\0' && *s != '}' && (s[1] == '<' || s[1] == '>')) ? ValidSpecPrecision(SkipSpecDigits(s + 2))
+        : (*s == '<' || *s == '>') ? ValidSpecPrecision(SkipSpecDigits(s + 1))
+        : ValidSpecPrecision(SkipSpecDigits(s));
+}
+
+constexpr bool ValidSpec(const char* s) {
+    return *s == '}' || (*s == ':' && ValidSpecAlign(s + 1));
+}
+
+constexpr bool ValidFormat(const char* s) {
+    return *s == '\0' ? true
+        : (*s == '{' && s[1] == '{') ? ValidFormat(s + 2)
+        : (*s == '}' && s[1] == '}') ? ValidFormat(s + 2)
+        : *s == '{' ? ValidSpec(s + 1) && ValidFormat(SkipSpec(s + 1))
+        : ValidFormat(s + 1);
+}
+
+struct FormatSpec {
+    char type = 0;          // x X f e g 等, 0 表示默认
+    char fill = ' ';
+    char align = 0;         // '<' '>', 0 表示默认 (数字右对齐, 其他左对齐)
+    int width = 0;
+    int precision = -1;
+};
+
+/**
+ * 一个调用点解析好的格式串: 去掉 {{ }} 转义后的文字, 按占位符切成若干段,
+ * 每段后面跟一个参数和它的格式说明; 最后一段之后没有参数
+ */
+class FormatSite {
+public:
+    explicit FormatSite(const char* fmt);
+
+    // 占位符个数
+    size_t size() const { return m_pieces.size() - 1; }
+    const FormatSpec& spec(size_t i) const { return m_pieces[i].spec; }
+    // 追加第 i 个占位符之前的文字, i == size() 时为最后一段
+    void appendLiteral(LogBuffer& buf, size_t i) const {
+        const Piece& piece = m_pieces[i];
+        if (piece.end > piece.begin) {
+            buf.append(m_text.data() + piece.begin, piece.end - piece.begin);
+        }
+    }
+private:
+    struct Piece {
+        uint32_t begin;
+        uint32_t end;
+        FormatSpec spec;
+    };
+    std::string m_text;
+    std::vector<Piece> m_pieces;
+};
+
+void AppendHex(LogBuffer& buf, uint64_t v, bool upper);
+void AppendDouble(LogBuffer& buf, double v, const FormatSpec& spec);
+// 按宽度在 start 之后写入的内容两侧补齐
+void Pad(LogBuffer& buf, size_t start, const FormatSpec& spec, bool numeric);
+
+template<class T, class Enable = void>
+struct Formatter {
+    // 其他类型使用 operator<<
+    static void format(LogBuffer& buf, const T& v, const FormatSpec&) {
+        LogStreamBuf sb(&buf);
+        std::ostream os(&sb);
+        os << v;
+    }
+    static const bool numeric = false;
+};
+
+template<>
+struct Formatter<bool> {
+    static void format(LogBuffer& buf, bool v, const FormatSpec&) {
+        buf.append(v ? "true" : "false");
+    }
+    static const bool numeric = false;
+};
+
+template<>
+struct Formatter<char> {
+    static void format(LogBuffer& buf, char v, const FormatSpec& spec) {
+        if (spec.type == 'd') {
+            buf.appendInt(v);
+        } else {
+            buf.append(v);
+        }
+    }
+    static const bool numeric = false;
+};
+
+template<class T>
+struct Formatter<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value
+                                            && !std::is_same<T, char>::value>::type> {
+    static void format(LogBuffer& buf, T v, const FormatSpec& spec) {
+        if (spec.type == 'x' || spec.type == 'X') {
+            AppendHex(buf, (uint64_t)(typename std::make_unsigned<T>::type)v, spec.type == 'X');
+        } else {
+            buf.appendInt(v);
+        }
+    }
+    static const bool numeric = true;
+};
+
+template<class T>
+struct Formatter<T, typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value
+                                            && !std::is_same<T, bool>::value>::type> {
+    static void format(LogBuffer& buf, T v, const FormatSpec& spec) {
+        if (spec.type == 'x' || spec.type == 'X') {
+            AppendHex(buf, v, spec.type == 'X');
+        } else {
+            buf.appendUInt(v);
+        }
+    }
+    static const bool numeric = true;
+};
+
+template<class T>
+struct Formatter<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    static void format(LogBuffer& buf, T v, const FormatSpec& spec) {
+        buf.appendInt((int64_t)v);
+    }
+    static const bool numeric = true;
+};
+
+template<class T>
+struct Formatter<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static void format(LogBuffer& buf, T v, const FormatSpec& spec) {
+        AppendDouble(buf, v, spec);
+    }
+    static const bool numeric = true;
+};
+
+struct CStringFormatter {
+    static void format(LogBuffer& buf, const char* v, const FormatSpec& spec) {
+        buf.append(v ? v : "(null)");
+    }
+    static const bool numeric = false;
+};
+
+template<>
+struct Formatter<const char*> : public CStringFormatter {};
+
+template<>
+struct Formatter<char*> : public CStringFormatter {};
+
+template<>
+struct Formatter<std::string> {
+    static void format(LogBuffer& buf, const std::string& v, const FormatSpec&) {
+        buf.append(v);
+    }
+    static const bool numeric = false;
+};
+
+template<class T>
+struct Formatter<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type> {
+    static void format(LogBuffer& buf, const T* v, const FormatSpec&) {
+        buf.append("0x", 2);
+        AppendHex(buf, (uintptr_t)v, false);
+    }
+    static const bool numeric = true;
+};
+
+template<class T>
+inline void FormatArg(LogBuffer& buf, const T& v, const FormatSpec& spec) {
+    typedef Formatter<typename std::decay<T>::type> F;
+    if (spec.width <= 0) {
+        F::format(buf, v, spec);
+        return;
+    }
+    size_t start = buf.size();
+    F::format(buf, v, spec);
+    Pad(buf, start, spec, F::numeric);
+}
+
+inline void FormatArgs(LogBuffer& buf, const FormatSite& site, size_t i) {
+    // 参数个数由编译期检查保证, 运行期多出的占位符输出为 {}
+    for (; i < site.size(); ++i) {
+        site.appendLiteral(buf, i);
+        buf.append("{}", 2);
+    }
+    site.appendLiteral(buf, i);
+}
+
+template<class T, class... Args>
+inline void FormatArgs(LogBuffer& buf, const FormatSite& site, size_t i, const T& v, const Args&... args) {
+    if (i >= site.size()) {
+        site.appendLiteral(buf, site.size());
+        return;
+    }
+    site.appendLiteral(buf, i);
+    FormatArg(buf, v, site.spec(i));
+    FormatArgs(buf, site, i + 1, args...);
+}
+
+template<class... Args>
+inline void FormatTo(LogBuffer& buf, const FormatSite& site, const Args&... args) {
+    FormatArgs(buf, site, 0, args...);
+}
+
+// 数字和布尔在 JSON 中不加引号; char 按字符输出, 非有限的浮点数输出为字符串
+template<class T>
+inline bool IsQuoted(const T&, typename std::enable_if<!std::is_floating_point<T>::value>::type* = 0) {
+    return !(std::is_arithmetic<T>::value || std::is_enum<T>::value) || std::is_same<T, char>::value;
+}
+
+template<class T>
+inline bool IsQuoted(const T& v, typename std::enable_if<std::is_floating_point<T>::value>::type* = 0) {
+    return !std::isfinite(v);
+}
+
+}
+
+template<class T>
+LogEventWrap& LogEventWrap::kv(const char* key, const T& value) {
+    typedef typename std::decay<T>::type D;
+    LogBuffer& buf = m_event->beginField(key, strlen(key));
+    logfmt::Formatter<D>::format(buf, value, logfmt::FormatSpec());
+    m_event->endField(logfmt::IsQuoted(value));
+    return *this;
+}
+
+template<class T>
+LogEventWrap& LogEventWrap::kv(const std::string& key, const T& value) {
+    typedef typename std::decay<T>::type D;
+    LogBuffer& buf = m_event->beginField(key.data(), key.size());
+    logfmt::Formatter<D>::format(buf, value, logfmt::FormatSpec());
+    m_event->endField(logfmt::IsQuoted(value));
+    return *this;
+}
+
+}
+
+#endif
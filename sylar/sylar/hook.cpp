@@ -0,0 +1,517 @@
+#include "hook.h"
+#include "fd_manager.h"
+#include "iomanager.h"
+#include "log.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static thread_local bool t_hook_enable = false;
+
+// connect 默认超时, 毫秒
+static uint64_t s_connect_timeout = 5000;
+
+#define HOOK_FUN(XX) \
+    XX(sleep) \
+    XX(usleep) \
+    XX(nanosleep) \
+    XX(socket) \
+    XX(connect) \
+    XX(accept) \
+    XX(read) \
+    XX(readv) \
+    XX(recv) \
+    XX(recvfrom) \
+    XX(recvmsg) \
+    XX(write) \
+    XX(writev) \
+    XX(send) \
+    XX(sendto) \
+    XX(sendmsg) \
+    XX(close) \
+    XX(fcntl) \
+    XX(ioctl) \
+    XX(getsockopt) \
+    XX(setsockopt)
+
+void hook_init() {
+    static bool is_inited = false;
+    if (is_inited) {
+        return;
+    }
+#define XX(name) name ## _f = (name ## _fun)dlsym(RTLD_NEXT, #name);
+    HOOK_FUN(XX);
+#undef XX
+    is_inited = true;
+}
+
+struct _HookIniter {
+    _HookIniter() {
+        hook_init();
+    }
+};
+
+static _HookIniter s_hook_initer;
+
+bool is_hook_enable() {
+    return t_hook_enable;
+}
+
+void set_hook_enable(bool flag) {
+    t_hook_enable = flag;
+}
+
+}
+
+// 其他模块的静态初始化可能先于 s_hook_initer 调到这些函数
+#define HOOK_ENSURE(name) \
+    if (__builtin_expect(!name ## _f, 0)) { \
+        sylar::hook_init(); \
+    }
+
+struct timer_info {
+    int cancelled = 0;
+};
+
+/**
+ * __errno_location 声明为 const, 编译器会把它的结果沿用到 yield 之后; 协程换了线程时就读写了原线程的 errno.
+ * 可能跨 yield 的地方都通过这两个不内联的函数访问
+ */
+static __attribute__((noinline)) int get_errno() {
+    return errno;
+}
+
+static __attribute__((noinline)) void set_errno(int e) {
+    errno = e;
+}
+
+/**
+ * 没有 IOManager 的调度线程上, socket 已经被设成非阻塞, 用 poll 模拟用户期望的阻塞语义
+ */
+static int wait_fd(int fd, uint32_t event, uint64_t timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = event == sylar::IOManager::READ ? POLLIN : POLLOUT;
+    pfd.revents = 0;
+    int rt;
+    do {
+        rt = poll(&pfd, 1, timeout_ms == ~0ull ? -1 : (int)timeout_ms);
+    } while (rt < 0 && errno == EINTR);
+    if (rt == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return rt < 0 ? -1 : 0;
+}
+
+template<typename OriginFun, typename... Args>
+static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
+                     uint32_t event, int timeout_so, Args&&... args) {
+    if (!sylar::t_hook_enable) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(fd);
+    if (!ctx) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+    if (ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!ctx->isSocket() || ctx->getUserNonblock()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    uint64_t to = ctx->getTimeout(timeout_so);
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+
+retry:
+    ssize_t n = fun(fd, args...);
+    while (n == -1 && get_errno() == EINTR) {
+        n = fun(fd, args...);
+    }
+    if (n == -1 && get_errno() == EAGAIN) {
+        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        if (!iom) {
+            if (wait_fd(fd, event, to)) {
+                return -1;
+            }
+            goto retry;
+        }
+
+        sylar::Timer::ptr timer;
+        std::weak_ptr<timer_info> winfo(tinfo);
+        if (to != ~0ull) {
+            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if (!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancelEvent(fd, (sylar::IOManager::Event)event);
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, (sylar::IOManager::Event)event);
+        if (rt) {
+            SYLAR_LOG_ERROR(sylar::g_logger) << hook_fun_name << " addEvent(" << fd << ", " << event << ") failed";
+            if (timer) {
+                timer->cancel();
+            }
+            return -1;
+        }
+        sylar::Fiber::YieldToHold();
+        if (timer) {
+            timer->cancel();
+        }
+        if (tinfo->cancelled) {
+            set_errno(tinfo->cancelled);
+            return -1;
+        }
+        goto retry;
+    }
+    return n;
+}
+
+// 挂起当前协程 ms 毫秒, 不在 IOManager 线程上时返回 false
+static bool fiber_sleep(uint64_t ms) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if (!sylar::t_hook_enable || !iom) {
+        return false;
+    }
+    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
+    iom->addTimer(ms, [iom, fiber]() {
+        iom->schedule(fiber);
+    });
+    sylar::Fiber::YieldToHold();
+    return true;
+}
+
+extern "C" {
+
+#define XX(name) name ## _fun name ## _f = nullptr;
+    HOOK_FUN(XX);
+#undef XX
+
+unsigned int sleep(unsigned int seconds) {
+    HOOK_ENSURE(sleep);
+    if (fiber_sleep(seconds * 1000ull)) {
+        return 0;
+    }
+    return sleep_f(seconds);
+}
+
+int usleep(useconds_t usec) {
+    HOOK_ENSURE(usleep);
+    if (fiber_sleep(usec / 1000)) {
+        return 0;
+    }
+    return usleep_f(usec);
+}
+
+int nanosleep(const struct timespec* req, struct timespec* rem) {
+    HOOK_ENSURE(nanosleep);
+    if (req && fiber_sleep(req->tv_sec * 1000ull + req->tv_nsec / 1000000)) {
+        return 0;
+    }
+    return nanosleep_f(req, rem);
+}
+
+int socket(int domain, int type, int protocol) {
+    HOOK_ENSURE(socket);
+    int fd = socket_f(domain, type, protocol);
+    if (!sylar::t_hook_enable || fd == -1) {
+        return fd;
+    }
+    sylar::FdMgr::getInstance()->get(fd, true);
+    return fd;
+}
+
+int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms) {
+    HOOK_ENSURE(connect);
+    if (!sylar::t_hook_enable) {
+        return connect_f(fd, addr, addrlen);
+    }
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(fd);
+    if (ctx && ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!ctx || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    int n = connect_f(fd, addr, addrlen);
+    if (n == 0) {
+        return 0;
+    } else if (n != -1 || errno != EINPROGRESS) {
+        return n;
+    }
+
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if (!iom) {
+        if (wait_fd(fd, sylar::IOManager::WRITE, timeout_ms)) {
+            return -1;
+        }
+    } else {
+        sylar::Timer::ptr timer;
+        std::shared_ptr<timer_info> tinfo(new timer_info);
+        std::weak_ptr<timer_info> winfo(tinfo);
+        if (timeout_ms != ~0ull) {
+            timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+                auto t = winfo.lock();
+                if (!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancelEvent(fd, sylar::IOManager::WRITE);
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
+        if (rt == 0) {
+            sylar::Fiber::YieldToHold();
+            if (timer) {
+                timer->cancel();
+            }
+            if (tinfo->cancelled) {
+                set_errno(tinfo->cancelled);
+                return -1;
+            }
+        } else {
+            if (timer) {
+                timer->cancel();
+            }
+            SYLAR_LOG_ERROR(sylar::g_logger) << "connect addEvent(" << fd << ", WRITE) failed";
+        }
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        return -1;
+    }
+    if (!error) {
+        return 0;
+    }
+    set_errno(error);
+    return -1;
+}
+
+int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
+    return connect_with_timeout(sockfd, addr, addrlen, sylar::s_connect_timeout);
+}
+
+int accept(int s, struct sockaddr* addr, socklen_t* addrlen) {
+    HOOK_ENSURE(accept);
+    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if (fd >= 0 && sylar::t_hook_enable) {
+        sylar::FdMgr::getInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+    HOOK_ENSURE(read);
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    HOOK_ENSURE(readv);
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+}
+
+ssize_t recv(int sockfd, void* buf, size_t len, int flags) {
+    HOOK_ENSURE(recv);
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+}
+
+ssize_t recvfrom(int sockfd, void* buf, size_t len, int flags, struct sockaddr* src_addr, socklen_t* addrlen) {
+    HOOK_ENSURE(recvfrom);
+    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags) {
+    HOOK_ENSURE(recvmsg);
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+    HOOK_ENSURE(write);
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+    HOOK_ENSURE(writev);
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+}
+
+ssize_t send(int s, const void* msg, size_t len, int flags) {
+    HOOK_ENSURE(send);
+    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+}
+
+ssize_t sendto(int s, const void* msg, size_t len, int flags, const struct sockaddr* to, socklen_t tolen) {
+    HOOK_ENSURE(sendto);
+    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+}
+
+ssize_t sendmsg(int s, const struct msghdr* msg, int flags) {
+    HOOK_ENSURE(sendmsg);
+    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+}
+
+int close(int fd) {
+    HOOK_ENSURE(close);
+    // 不管是否开启 hook 都要清掉记录, 否则复用这个 fd 号的新文件会拿到旧状态
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(fd);
+    if (ctx) {
+        ctx->setClose();
+        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        if (iom) {
+            iom->cancelAll(fd);
+        }
+        sylar::FdMgr::getInstance()->del(fd);
+    }
+    return close_f(fd);
+}
+
+int fcntl(int fd, int cmd, ... /* arg */) {
+    HOOK_ENSURE(fcntl);
+    va_list va;
+    va_start(va, cmd);
+    switch (cmd) {
+        case F_SETFL:
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(fd);
+                if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return fcntl_f(fd, cmd, arg);
+                }
+                ctx->setUserNonblock(arg & O_NONBLOCK);
+                if (ctx->getSysNonblock()) {
+                    arg |= O_NONBLOCK;
+                } else {
+                    arg &= ~O_NONBLOCK;
+                }
+                return fcntl_f(fd, cmd, arg);
+            }
+        case F_GETFL:
+            {
+                va_end(va);
+                int arg = fcntl_f(fd, cmd);
+                sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(fd);
+                if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return arg;
+                }
+                if (ctx->getUserNonblock()) {
+                    return arg | O_NONBLOCK;
+                }
+                return arg & ~O_NONBLOCK;
+            }
+        case F_DUPFD:
+        case F_DUPFD_CLOEXEC:
+        case F_SETFD:
+        case F_SETOWN:
+        case F_SETSIG:
+        case F_SETLEASE:
+        case F_NOTIFY:
+#ifdef F_SETPIPE_SZ
+        case F_SETPIPE_SZ:
+#endif
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+        case F_GETFD:
+        case F_GETOWN:
+        case F_GETSIG:
+        case F_GETLEASE:
+#ifdef F_GETPIPE_SZ
+        case F_GETPIPE_SZ:
+#endif
+            {
+                va_end(va);
+                return fcntl_f(fd, cmd);
+            }
+        case F_SETLK:
+        case F_SETLKW:
+        case F_GETLK:
+            {
+                struct flock* arg = va_arg(va, struct flock*);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+        case F_GETOWN_EX:
+        case F_SETOWN_EX:
+            {
+                struct f_owner_ex* arg = va_arg(va, struct f_owner_ex*);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+        default:
+            {
+                // 未知命令按指针参数透传
+                void* arg = va_arg(va, void*);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+    }
+}
+
+int ioctl(int d, unsigned long int request, ...) {
+    HOOK_ENSURE(ioctl);
+    va_list va;
+    va_start(va, request);
+    void* arg = va_arg(va, void*);
+    va_end(va);
+
+    if (FIONBIO == request) {
+        bool user_nonblock = !!*(int*)arg;
+        sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(d);
+        if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+            return ioctl_f(d, request, arg);
+        }
+        ctx->setUserNonblock(user_nonblock);
+        // 系统层面保持 hook 设置的非阻塞
+        if (ctx->getSysNonblock()) {
+            int on = 1;
+            return ioctl_f(d, request, &on);
+        }
+    }
+    return ioctl_f(d, request, arg);
+}
+
+int getsockopt(int sockfd, int level, int optname, void* optval, socklen_t* optlen) {
+    HOOK_ENSURE(getsockopt);
+    return getsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen) {
+    HOOK_ENSURE(setsockopt);
+    if (!sylar::t_hook_enable) {
+        return setsockopt_f(sockfd, level, optname, optval, optlen);
+    }
+    if (level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)) {
+        sylar::FdCtx::ptr ctx = sylar::FdMgr::getInstance()->get(sockfd);
+        if (ctx) {
+            const timeval* v = (const timeval*)optval;
+            uint64_t ms = v->tv_sec * 1000ull + v->tv_usec / 1000;
+            ctx->setTimeout(optname, ms ? ms : ~0ull);
+        }
+    }
+    return setsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+}
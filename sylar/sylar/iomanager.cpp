@@ -0,0 +1,328 @@
+#include "iomanager.h"
+#include "hook.h"
+#include "log.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+IOManager::FdContext::EventContext& IOManager::FdContext::getContext(Event event) {
+    switch (event) {
+        case READ:
+            return read;
+        case WRITE:
+            return write;
+        default:
+            assert(false);
+    }
+    return read;
+}
+
+void IOManager::FdContext::resetContext(EventContext& ctx) {
+    ctx.scheduler = nullptr;
+    ctx.fiber.reset();
+    ctx.cb = nullptr;
+}
+
+void IOManager::FdContext::triggerEvent(Event event) {
+    assert(events & event);
+    events = (Event)(events & ~event);
+    EventContext& ctx = getContext(event);
+    Scheduler* scheduler = ctx.scheduler;
+    ctx.scheduler = nullptr;
+    if (ctx.cb) {
+        std::function<void()> cb;
+        cb.swap(ctx.cb);
+        scheduler->schedule(std::move(cb));
+    } else {
+        scheduler->schedule(std::move(ctx.fiber));
+        ctx.fiber.reset();
+    }
+}
+
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name, bool hook)
+    : Scheduler(threads, use_caller, name, hook) {
+    for (auto& c : m_chunks) {
+        c.store(nullptr, std::memory_order_relaxed);
+    }
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(m_epfd >= 0);
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(m_tickleFd >= 0);
+
+    // 边沿触发: 每次 tickle 只唤醒一个在 epoll_wait 的线程
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = nullptr;
+    int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
+    assert(rt == 0);
+    (void)rt;
+
+    start();
+}
+
+IOManager::~IOManager() {
+    stop();
+    close_f(m_epfd);
+    close_f(m_tickleFd);
+    for (auto& c : m_chunks) {
+        delete[] c.load(std::memory_order_relaxed);
+    }
+}
+
+IOManager::FdContext* IOManager::getFdContext(int fd, bool create) {
+    if (fd < 0 || fd >= CHUNK_SIZE * MAX_CHUNKS) {
+        return nullptr;
+    }
+    std::atomic<FdContext*>& chunk = m_chunks[fd >> CHUNK_BITS];
+    FdContext* c = chunk.load(std::memory_order_acquire);
+    if (!c) {
+        if (!create) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(m_chunkMutex);
+        c = chunk.load(std::memory_order_relaxed);
+        if (!c) {
+            c = new FdContext[CHUNK_SIZE];
+            int base = fd & ~(CHUNK_SIZE - 1);
+            for (int i = 0; i < CHUNK_SIZE; ++i) {
+                c[i].fd = base + i;
+            }
+            chunk.store(c, std::memory_order_release);
+        }
+    }
+    return &c[fd & (CHUNK_SIZE - 1)];
+}
+
+int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if (!fd_ctx) {
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    if (fd_ctx->events & event) {
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " event=" << event
+                                  << " already registered, events=" << fd_ctx->events;
+        return -1;
+    }
+
+    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    epoll_event epevent;
+    memset(&epevent, 0, sizeof(epevent));
+    epevent.events = EPOLLET | fd_ctx->events | event;
+    epevent.data.ptr = fd_ctx;
+    if (epoll_ctl(m_epfd, op, fd, &epevent)) {
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", " << op << ", " << fd << ", "
+                                  << epevent.events << "): " << errno << " " << strerror(errno);
+        return -1;
+    }
+
+    ++m_pendingEventCount;
+    fd_ctx->events = (Event)(fd_ctx->events | event);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
+    event_ctx.scheduler = Scheduler::GetThis() ? Scheduler::GetThis() : this;
+    if (cb) {
+        event_ctx.cb.swap(cb);
+    } else {
+        event_ctx.fiber = Fiber::GetThis();
+    }
+    return 0;
+}
+
+bool IOManager::delEvent(int fd, Event event) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    if (!(fd_ctx->events & event)) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    memset(&epevent, 0, sizeof(epevent));
+    epevent.events = EPOLLET | new_events;
+    epevent.data.ptr = fd_ctx;
+    if (epoll_ctl(m_epfd, op, fd, &epevent)) {
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", " << op << ", " << fd << "): "
+                                  << errno << " " << strerror(errno);
+        return false;
+    }
+
+    --m_pendingEventCount;
+    fd_ctx->events = new_events;
+    fd_ctx->resetContext(fd_ctx->getContext(event));
+    return true;
+}
+
+bool IOManager::cancelEvent(int fd, Event event) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    if (!(fd_ctx->events & event)) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    memset(&epevent, 0, sizeof(epevent));
+    epevent.events = EPOLLET | new_events;
+    epevent.data.ptr = fd_ctx;
+    if (epoll_ctl(m_epfd, op, fd, &epevent)) {
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", " << op << ", " << fd << "): "
+                                  << errno << " " << strerror(errno);
+        return false;
+    }
+
+    fd_ctx->triggerEvent(event);
+    --m_pendingEventCount;
+    return true;
+}
+
+bool IOManager::cancelAll(int fd) {
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+    if (!fd_ctx->events) {
+        return false;
+    }
+
+    epoll_event epevent;
+    memset(&epevent, 0, sizeof(epevent));
+    epevent.data.ptr = fd_ctx;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &epevent)) {
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", DEL, " << fd << "): "
+                                  << errno << " " << strerror(errno);
+        return false;
+    }
+
+    if (fd_ctx->events & READ) {
+        fd_ctx->triggerEvent(READ);
+        --m_pendingEventCount;
+    }
+    if (fd_ctx->events & WRITE) {
+        fd_ctx->triggerEvent(WRITE);
+        --m_pendingEventCount;
+    }
+    assert(fd_ctx->events == 0);
+    return true;
+}
+
+IOManager* IOManager::GetThis() {
+    return dynamic_cast<IOManager*>(Scheduler::GetThis());
+}
+
+void IOManager::tickle() {
+    if (!hasIdleThreads()) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t rt = write_f(m_tickleFd, &one, sizeof(one));
+    (void)rt;
+}
+
+bool IOManager::stopping(uint64_t& timeout) {
+    timeout = getNextTimer();
+    return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+}
+
+bool IOManager::stopping() {
+    uint64_t timeout = 0;
+    return stopping(timeout);
+}
+
+void IOManager::idle() {
+    static const int MAX_EVENTS = 256;
+    static const uint64_t MAX_TIMEOUT = 5000;
+    epoll_event events[MAX_EVENTS];
+
+    uint64_t next_timeout = 0;
+    if (stopping(next_timeout)) {
+        return;
+    }
+    int timeout = (int)std::min(next_timeout, MAX_TIMEOUT);
+    int rt;
+    do {
+        rt = epoll_wait(m_epfd, events, MAX_EVENTS, timeout);
+    } while (rt < 0 && errno == EINTR);
+    // 醒来后不再算空闲, 下面触发事件时不用互相 tickle; 返回前恢复, 由调度循环统一减掉
+    --m_idleThreadCount;
+
+    std::vector<std::function<void()>> cbs;
+    listExpiredCb(cbs);
+    if (!cbs.empty()) {
+        schedule(cbs.begin(), cbs.end());
+    }
+
+    for (int i = 0; i < rt; ++i) {
+        epoll_event& event = events[i];
+        FdContext* fd_ctx = (FdContext*)event.data.ptr;
+        if (!fd_ctx) {
+            uint64_t dummy;
+            ssize_t n = read_f(m_tickleFd, &dummy, sizeof(dummy));
+            (void)n;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        if (event.events & (EPOLLERR | EPOLLHUP)) {
+            event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+        }
+        int real_events = NONE;
+        if (event.events & EPOLLIN) {
+            real_events |= READ;
+        }
+        if (event.events & EPOLLOUT) {
+            real_events |= WRITE;
+        }
+        if ((fd_ctx->events & real_events) == NONE) {
+            continue;
+        }
+
+        int left_events = fd_ctx->events & ~real_events;
+        int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        event.events = EPOLLET | left_events;
+        if (epoll_ctl(m_epfd, op, fd_ctx->fd, &event)) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", " << op << ", " << fd_ctx->fd << "): "
+                                      << errno << " " << strerror(errno);
+            continue;
+        }
+
+        if (real_events & fd_ctx->events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
+        }
+        if (real_events & fd_ctx->events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
+        }
+    }
+    ++m_idleThreadCount;
+}
+
+void IOManager::onTimerInsertedAtFront() {
+    tickle();
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef _SYLAR_IOMANAGER_H_
+#define _SYLAR_IOMANAGER_H_
+
+#include "scheduler.h"
+#include "timer.h"
+
+
+namespace sylar {
+
+/**
+ * 基于 epoll (边沿触发) 的 IO 调度器. addEvent 登记 fd 上的读/写事件和要恢复的协程 (或回调),
+ * 事件到达时把它们放回调度队列, 每个事件只触发一次.
+ * 空闲线程阻塞在 epoll_wait 上, 超时取最近的定时器; 有新任务或新的最早定时器时通过 eventfd 唤醒
+ */
+class IOManager : public Scheduler, public TimerManager {
+public:
+    typedef std::shared_ptr<IOManager> ptr;
+
+    enum Event {
+        NONE = 0x0,
+        READ = 0x1,     // EPOLLIN
+        WRITE = 0x4,    // EPOLLOUT
+    };
+private:
+    struct FdContext {
+        struct EventContext {
+            Scheduler* scheduler = nullptr;
+            Fiber::ptr fiber;
+            std::function<void()> cb;
+        };
+
+        EventContext& getContext(Event event);
+        void resetContext(EventContext& ctx);
+        // 调用时持有 mutex
+        void triggerEvent(Event event);
+
+        EventContext read;
+        EventContext write;
+        int fd = 0;
+        Event events = NONE;
+        std::mutex mutex;
+    };
+
+    static const int CHUNK_BITS = 12;
+    static const int CHUNK_SIZE = 1 << CHUNK_BITS;
+    static const int MAX_CHUNKS = 1024;
+public:
+    // hook 为 true 时调度线程上的阻塞 socket 调用和 sleep 改为等事件/定时器, 见 hook.h
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "", bool hook = false);
+    ~IOManager();
+
+    // cb 为空时事件到达后恢复当前协程; 成功返回 0, 事件已经登记过或出错返回 -1
+    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    // 删除事件, 不触发
+    bool delEvent(int fd, Event event);
+    // 删除事件并立即触发一次
+    bool cancelEvent(int fd, Event event);
+    // 删除 fd 上的所有事件并触发
+    bool cancelAll(int fd);
+
+    static IOManager* GetThis();
+protected:
+    void tickle() override;
+    bool stopping() override;
+    void idle() override;
+    void onTimerInsertedAtFront() override;
+
+    bool stopping(uint64_t& timeout);
+private:
+    // 取 fd 对应的上下文, create 为 false 且所在块没有分配时返回 nullptr
+    FdContext* getFdContext(int fd, bool create);
+private:
+    int m_epfd = 0;
+    int m_tickleFd = 0;         // eventfd
+    std::atomic<size_t> m_pendingEventCount{0};
+    std::mutex m_chunkMutex;
+    // 按 fd 分块的上下文数组, 块按需分配, 分配后不移动不释放, 查找不加锁
+    std::atomic<FdContext*> m_chunks[MAX_CHUNKS];
+};
+
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include "json_formatter.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace sylar {
+
+namespace {
+
+// 0 表示原样输出, 'u' 表示 \u00XX, 其他为 '\' 之后的字符
+struct EscapeTable {
+    char esc[256];
+
+    EscapeTable() {
+        memset(esc, 0, sizeof(esc));
+        for (int c = 0; c < 0x20; ++c) {
+            esc[c] = 'u';
+        }
+        esc[(unsigned char)'\b'] = 'b';
+        esc[(unsigned char)'\f'] = 'f';
+        esc[(unsigned char)'\n'] = 'n';
+        esc[(unsigned char)'\r'] = 'r';
+        esc[(unsigned char)'\t'] = 't';
+        esc[(unsigned char)'"'] = '"';
+        esc[(unsigned char)'\\'] = '\\';
+    }
+};
+
+const EscapeTable s_escape;
+
+void AppendEscape(LogBuffer& buf, unsigned char c) {
+    char e = s_escape.esc[c];
+    if (e == 'u') {
+        static const char hex[] = "0123456789abcdef";
+        char tmp[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        buf.append(tmp, 6);
+    } else {
+        char tmp[2] = {'\\', e};
+        buf.append(tmp, 2);
+    }
+}
+
+void AppendQuoted(LogBuffer& buf, const char* data, size_t len) {
+    buf.append('"');
+    AppendJsonEscaped(buf, data, len);
+    buf.append('"');
+}
+
+void AppendKey(LogBuffer& buf, const char* key, size_t len) {
+    buf.append(',');
+    AppendQuoted(buf, key, len);
+    buf.append(':');
+}
+
+}
+
+void AppendJsonEscaped(LogBuffer& buf, const char* data, size_t len) {
+    const char* p = data;
+    const char* end = data + len;
+    const char* start = p;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        // max_epu8(v, 0x1f) == 0x1f 即无符号比较 v <= 0x1f
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        int mask = _mm_movemask_epi8(m);
+        if (!mask) {
+            p += 16;
+            continue;
+        }
+        p += __builtin_ctz(mask);
+        buf.append(start, p - start);
+        AppendEscape(buf, (unsigned char)*p);
+        start = ++p;
+    }
+#endif
+    for (; p < end; ++p) {
+        if (s_escape.esc[(unsigned char)*p]) {
+            buf.append(start, p - start);
+            AppendEscape(buf, (unsigned char)*p);
+            start = p + 1;
+        }
+    }
+    buf.append(start, p - start);
+}
+
+JsonLogFormatter::JsonLogFormatter(const std::string& dateFormat)
+    : LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n") {
+    CompileDate(m_date, dateFormat);
+}
+
+void JsonLogFormatter::format(LogBuffer& buf, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+    buf.append("{\"time\":\"", 9);
+    // 日期格式由用户配置, 先格式化到栈上的缓冲区再转义
+    LogBuffer date;
+    FormatDate(date, m_date, event->getTime(), event->getNanoSecond());
+    AppendJsonEscaped(buf, date.data(), date.size());
+    buf.append("\",\"level\":\"", 11);
+    buf.append(LogLevel::toString(level));
+    buf.append('"');
+    AppendKey(buf, "logger", 6);
+    AppendQuoted(buf, logger->getName().data(), logger->getName().size());
+    buf.append(",\"thread\":", 10);
+    buf.appendUInt(event->getThreadId());
+    buf.append(",\"fiber\":", 9);
+    buf.appendUInt(event->getFiberId());
+    buf.append(",\"elapse\":", 10);
+    buf.appendUInt(event->getElapse());
+    AppendKey(buf, "file", 4);
+    const char* file = event->getFile() ? event->getFile() : "";
+    AppendQuoted(buf, file, strlen(file));
+    buf.append(",\"line\":", 8);
+    buf.appendInt(event->getLine());
+    AppendKey(buf, "msg", 3);
+    const LogBuffer& msg = event->getMessage();
+    AppendQuoted(buf, msg.data(), msg.size());
+
+    for (size_t i = 0; i < event->getFieldCount(); ++i) {
+        const LogField& f = event->getField(i);
+        AppendKey(buf, event->getFieldKey(f), f.keyLength);
+        if (f.quoted) {
+            AppendQuoted(buf, event->getFieldValue(f), f.valueLength);
+        } else {
+            buf.append(event->getFieldValue(f), f.valueLength);
+        }
+    }
+    buf.append("}\n", 2);
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef _SYLAR_JSON_FORMATTER_H_
+#define _SYLAR_JSON_FORMATTER_H_
+
+#include "log.h"
+#include <string>
+
+
+namespace sylar {
+
+/**
+ * 按 JSON 字符串的规则转义后追加 (不含两侧引号), 只有 '"' '\' 和控制字符需要转义,
+ * 0x80 以上的字节按 UTF-8 原样输出. x86 上用 SSE2 每次检查 16 字节, 没有要转义的字符时整段拷贝
+ */
+void AppendJsonEscaped(LogBuffer& buf, const char* data, size_t len);
+
+/**
+ * JSON 格式化器, 每条日志一行:
+ * {"time":"2026-10-17T10:00:00.123456+0800","level":"INFO","logger":"root","thread":1234,"fiber":0,
+ *  "elapse":15,"file":"main.cpp","line":42,"msg":"login","user":42,"lat_us":35.2}
+ * 结构化字段接在固定键之后, 数字和布尔不加引号
+ */
+class JsonLogFormatter : public LogFormatter {
+public:
+    typedef std::shared_ptr<JsonLogFormatter> ptr;
+private:
+    DateFormat m_date;
+public:
+    // dateFormat 的语法同 %d{...}; 飞行记录器等只能用 formatSafe 的场合按默认的文本格式输出
+    JsonLogFormatter(const std::string& dateFormat = "%Y-%m-%dT%H:%M:%S.%6N%z");
+
+    using LogFormatter::format;
+    void format(LogBuffer& buf, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) override;
+};
+
+}
+
+#endif
@@ -1,136 +1,166 @@
 #include "log.h"
+#include "util.h"
+#include "binlog.h"
 #include <map>
 #include <iostream>
 #include <functional>
 #include <time.h>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <signal.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <set>
 
 
 namespace sylar {
 
-class MessageFormatItem : public LogFormatter::FormatItem {
-public:
-    MessageFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getContent();
-    }
-};
-
-class LevelFormatItem : public LogFormatter::FormatItem {
-public:
-    LevelFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << LogLevel::toString(level);
-    }
-};
+static const char s_digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+LogBuffer::LogBuffer()
+    : m_data(m_inline), m_size(0), m_capacity(INLINE_SIZE) {
+}
 
-class ElapseFormatItem : public LogFormatter::FormatItem {
-public:
-    ElapseFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getElapse();
+LogBuffer::~LogBuffer() {
+    if (m_data != m_inline) {
+        free(m_data);
     }
-};
+}
 
-class NameFormatItem : public LogFormatter::FormatItem {
-public:
-    NameFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << logger->getName();
+void LogBuffer::grow(size_t need) {
+    size_t cap = m_capacity * 2;
+    while (cap < need) {
+        cap *= 2;
     }
-};
-
-class ThreadIdFormatItem : public LogFormatter::FormatItem {
-public:
-    ThreadIdFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getThreadId();
+    char* data = (char*)malloc(cap);
+    memcpy(data, m_data, m_size);
+    if (m_data != m_inline) {
+        free(m_data);
     }
-};
+    m_data = data;
+    m_capacity = cap;
+}
 
-class FiberIdFormatItem : public LogFormatter::FormatItem {
-public:
-    FiberIdFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getFiberId();
+void LogBuffer::shrink(size_t max) {
+    if (m_data != m_inline && m_capacity > max) {
+        free(m_data);
+        m_data = m_inline;
+        m_capacity = INLINE_SIZE;
+        m_size = 0;
     }
-};
+}
 
-class DateTimeFormatItem : public LogFormatter::FormatItem {
-private:
-    std::string m_format;
-public:
-    DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S") 
-        : m_format(format) {
-        if (m_format.empty()) {
-            m_format = "%Y-%m-%d %H:%M:%S";
-        }
+void LogBuffer::appendUInt(uint64_t v) {
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        unsigned idx = (v % 100) * 2;
+        v /= 100;
+        *--p = s_digits[idx + 1];
+        *--p = s_digits[idx];
     }
-
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        struct tm tm;
-        time_t time = event->getTime();
-        localtime_r(&time, &tm);
-        char buf[64];
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
+    if (v >= 10) {
+        unsigned idx = v * 2;
+        *--p = s_digits[idx + 1];
+        *--p = s_digits[idx];
+    } else {
+        *--p = (char)('0' + v);
     }
-};
+    append(p, tmp + sizeof(tmp) - p);
+}
 
-class FilenameFormatItem : public LogFormatter::FormatItem {
-public:
-    FilenameFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getFile();
+void LogBuffer::appendInt(int64_t v) {
+    if (v < 0) {
+        append('-');
+        appendUInt(0 - (uint64_t)v);
+    } else {
+        appendUInt(v);
     }
-};
+}
 
-class LineFormatItem : public LogFormatter::FormatItem {
-public:
-    LineFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getLine();
-    }
-};
 
-class NewLineFormatItem : public LogFormatter::FormatItem {
-public:
-    NewLineFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << std::endl;
-    }
-};
+namespace {
 
-class TabFormatItem : public LogFormatter::FormatItem {
-public:
-    TabFormatItem(const std::string& str="") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << "\t";
-    }
-};
+// 每个线程复用一块格式化缓冲区; 发生重入时 (例如自定义 FormatItem 内部又打日志) 退回到栈上的临时缓冲区
+thread_local LogBuffer t_format_buffer;
+thread_local bool t_format_buffer_busy = false;
 
-class StringFormatItem : public LogFormatter::FormatItem {
+class ThreadLogBuffer {
 private:
-    std::string m_string;
+    LogBuffer* m_buf;
+    std::unique_ptr<LogBuffer> m_tmp;
 public:
-    StringFormatItem(const std::string& str) 
-        : m_string(str) {}
+    ThreadLogBuffer() {
+        if (t_format_buffer_busy) {
+            m_tmp.reset(new LogBuffer);
+            m_buf = m_tmp.get();
+        } else {
+            t_format_buffer_busy = true;
+            m_buf = &t_format_buffer;
+            m_buf->clear();
+        }
+    }
 
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << m_string;
+    ~ThreadLogBuffer() {
+        if (!m_tmp) {
+            m_buf->shrink(64 * 1024);
+            t_format_buffer_busy = false;
+        }
     }
+
+    LogBuffer& get() { return *m_buf; }
 };
 
+}
+
 
 Logger::Logger(const std::string& name) 
-    : m_name(name), m_level(LogLevel::DEBUG) {
+    : m_name(name), m_level(LogLevel::DEBUG), m_appenders(new AppenderList), m_binlog(nullptr) {
     m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
 }
 
+Logger::~Logger() {
+    delete m_appenders.load(std::memory_order_relaxed);
+}
+
 void Logger::log(LogLevel::Level level, LogEvent::ptr event) {
-    if (level >= m_level) {
+    if (BinLogWriter* binlog = getBinLog()) {
+        if (isEnabled(level)) {
+            binlog->log(level, event);
+        }
+        return;
+    }
+    if (isEnabled(level)) {
         auto self = shared_from_this();
-        for (auto& appender : m_appenders) {
-            appender->log(self, level, event);
+        RcuReadGuard guard;
+        for (Logger* logger = this; logger; logger = logger->m_parent.get()) {
+            const AppenderList* appenders = logger->m_appenders.load(std::memory_order_seq_cst);
+            if (appenders->empty()) {
+                continue;
+            }
+            for (auto& appender : *appenders) {
+                appender->log(self, level, event);
+            }
+            break;
         }
     }
 }
@@ -159,24 +189,53 @@ void Logger::addAppender(LogAppender::ptr appender) {
     if (!appender->getFormatter()) {
         appender->setFormatter(m_formatter);
     }
-    m_appenders.push_back(appender);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const AppenderList* old = m_appenders.load(std::memory_order_relaxed);
+    AppenderList* list = new AppenderList(*old);
+    list->push_back(appender);
+    m_appenders.store(list, std::memory_order_seq_cst);
+    Rcu::Retire(old);
 }
 
 void Logger::delAppender(LogAppender::ptr appender) {
-    for (auto it = m_appenders.begin(); it != m_appenders.end(); ++it) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const AppenderList* old = m_appenders.load(std::memory_order_relaxed);
+    AppenderList* list = new AppenderList(*old);
+    for (auto it = list->begin(); it != list->end(); ++it) {
         if (*it == appender) {
-            m_appenders.erase(it);
+            list->erase(it);
             break;
         }
     }
+    m_appenders.store(list, std::memory_order_seq_cst);
+    Rcu::Retire(old);
+}
+
+void Logger::clearAppenders() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const AppenderList* old = m_appenders.exchange(new AppenderList, std::memory_order_seq_cst);
+    Rcu::Retire(old);
+}
+
+Logger::AppenderList Logger::getAppenders() const {
+    RcuReadGuard guard;
+    return *m_appenders.load(std::memory_order_seq_cst);
+}
+
+void Logger::setBinLog(BinLogWriter::ptr writer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (writer) {
+        m_binlogs.push_back(writer);
+    }
+    m_binlog.store(writer.get(), std::memory_order_release);
 }
 
 LogLevel::Level Logger::getLevel() const {
-    return m_level;
+    return m_level.load(std::memory_order_relaxed);
 }
 
 void Logger::setLevel(LogLevel::Level level) {
-    m_level = level;
+    m_level.store(level, std::memory_order_relaxed);
 }
 
 const std::string& Logger::getName() const {
@@ -184,11 +243,246 @@ const std::string& Logger::getName() const {
 }
 
 
-LogEvent::LogEvent(Logger::ptr logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t time) 
-    : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_threadId(threadId), m_fiberId(fiberId), m_time(time) {
+LogEvent::LogEvent(Logger::ptr logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t time, uint32_t nsec) 
+    : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_threadId(threadId), m_fiberId(fiberId), m_time(time), m_nsec(nsec),
+      m_streambuf(&m_buffer), m_ss(&m_streambuf) {
+}
+
+LogEvent::LogEvent()
+    : m_streambuf(&m_buffer), m_ss(&m_streambuf) {
+}
+
+void LogEvent::reset(const Logger::ptr& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t timeNs) {
+    m_logger = logger;
+    m_level = level;
+    m_file = file;
+    m_line = line;
+    m_elapse = elapse;
+    m_threadId = threadId;
+    m_fiberId = fiberId;
+    m_time = timeNs / 1000000000ull;
+    m_nsec = timeNs % 1000000000ull;
+}
+
+void LogEvent::recycle() {
+    m_logger.reset();
+    m_buffer.clear();
+    m_buffer.shrink(64 * 1024);
+    m_ss.clear();
+    m_ss.flags(std::ios_base::skipws | std::ios_base::dec);
+    m_ss.width(0);
+    m_ss.precision(6);
+    m_ss.fill(' ');
+    m_fieldCount = 0;
+    m_moreFields.clear();
+    m_fieldText.clear();
+    m_fieldText.shrink(64 * 1024);
+}
+
+
+/**
+ * 每个线程一个 LogEvent 池. 事件可能在别的线程 (例如 AsyncLogAppender 的后台线程) 释放,
+ * 这时放进 m_remote 无锁栈, 由所属线程整体取回, 所以不存在 ABA 问题.
+ * 池的引用计数 = 所属线程 + 未归还的事件, 线程退出后由最后归还的事件销毁池.
+ */
+class LogEventPool {
+public:
+    static const size_t MAX_FREE = 1024;
+
+    struct Slot {
+        typename std::aligned_storage<sizeof(LogEvent), alignof(LogEvent)>::type event;
+        // shared_ptr 的控制块也放在槽位里, 获取事件不需要任何堆分配
+        alignas(16) char ctrl[64];
+        LogEventPool* pool;
+        Slot* next;
+
+        LogEvent* get() { return reinterpret_cast<LogEvent*>(&event); }
+    };
+
+    template<class T>
+    class Allocator {
+    public:
+        typedef T value_type;
+        Slot* m_slot;
+
+        Allocator(Slot* slot) : m_slot(slot) {}
+        template<class U>
+        Allocator(const Allocator<U>& other) : m_slot(other.m_slot) {}
+
+        T* allocate(size_t n) {
+            if (n * sizeof(T) <= sizeof(m_slot->ctrl) && alignof(T) <= 16) {
+                return reinterpret_cast<T*>(m_slot->ctrl);
+            }
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        // 控制块最后才释放, 此时事件已经没有任何引用, 可以安全地归还槽位
+        void deallocate(T* p, size_t) {
+            if ((void*)p != (void*)m_slot->ctrl) {
+                ::operator delete(p);
+            }
+            LogEventPool::Release(m_slot);
+        }
+
+        template<class U>
+        bool operator==(const Allocator<U>& other) const { return m_slot == other.m_slot; }
+        template<class U>
+        bool operator!=(const Allocator<U>& other) const { return m_slot != other.m_slot; }
+    };
+
+    struct Recycler {
+        void operator()(LogEvent* event) const {
+            event->recycle();
+        }
+    };
+
+    static LogEvent::ptr Create(const Logger::ptr& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t timeNs);
+    static void Release(Slot* slot);
+private:
+    LogEventPool() : m_refs(1), m_free(nullptr), m_freeCount(0), m_remote(nullptr) {}
+    ~LogEventPool();
+
+    static LogEventPool* GetThis();
+    Slot* acquire();
+    void unref();
+    static void destroy(Slot* slot);
+
+    struct Holder {
+        ~Holder();
+    };
+
+    static thread_local LogEventPool* t_pool;
+    static thread_local bool t_pool_dead;
+    static thread_local Holder t_holder;
+
+    std::atomic<int> m_refs;
+    Slot* m_free;
+    size_t m_freeCount;
+    std::atomic<Slot*> m_remote;
+};
+
+thread_local LogEventPool* LogEventPool::t_pool = nullptr;
+thread_local bool LogEventPool::t_pool_dead = false;
+thread_local LogEventPool::Holder LogEventPool::t_holder;
+
+LogEventPool::Holder::~Holder() {
+    LogEventPool* pool = t_pool;
+    t_pool = nullptr;
+    t_pool_dead = true;
+    if (pool) {
+        pool->unref();
+    }
+}
+
+LogEventPool::~LogEventPool() {
+    Slot* slot = m_free;
+    while (slot) {
+        Slot* next = slot->next;
+        destroy(slot);
+        slot = next;
+    }
+    slot = m_remote.exchange(nullptr, std::memory_order_acquire);
+    while (slot) {
+        Slot* next = slot->next;
+        destroy(slot);
+        slot = next;
+    }
+}
+
+LogEventPool* LogEventPool::GetThis() {
+    if (t_pool) {
+        return t_pool;
+    }
+    if (t_pool_dead) {
+        return nullptr;
+    }
+    (void)&t_holder;    // 注册线程退出时的清理
+    t_pool = new LogEventPool;
+    return t_pool;
+}
+
+void LogEventPool::destroy(Slot* slot) {
+    slot->get()->~LogEvent();
+    delete slot;
+}
+
+LogEventPool::Slot* LogEventPool::acquire() {
+    if (!m_free) {
+        m_free = m_remote.exchange(nullptr, std::memory_order_acquire);
+        m_freeCount = 0;
+        for (Slot* s = m_free; s; s = s->next) {
+            ++m_freeCount;
+        }
+    }
+
+    Slot* slot = m_free;
+    if (slot) {
+        m_free = slot->next;
+        --m_freeCount;
+    } else {
+        slot = new Slot;
+        new (&slot->event) LogEvent();
+        slot->pool = this;
+    }
+    m_refs.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+void LogEventPool::Release(Slot* slot) {
+    LogEventPool* pool = slot->pool;
+    if (pool == t_pool) {
+        if (pool->m_freeCount < MAX_FREE) {
+            slot->next = pool->m_free;
+            pool->m_free = slot;
+            ++pool->m_freeCount;
+        } else {
+            destroy(slot);
+        }
+    } else {
+        Slot* head = pool->m_remote.load(std::memory_order_relaxed);
+        do {
+            slot->next = head;
+        } while (!pool->m_remote.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+    }
+    pool->unref();
+}
+
+void LogEventPool::unref() {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+LogEvent::ptr LogEventPool::Create(const Logger::ptr& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t timeNs) {
+    LogEventPool* pool = GetThis();
+    if (!pool) {
+        // 线程正在退出, 不再使用事件池
+        LogEvent::ptr event(new LogEvent);
+        event->reset(logger, level, file, line, elapse, threadId, fiberId, timeNs);
+        return event;
+    }
+    Slot* slot = pool->acquire();
+    LogEvent* event = slot->get();
+    event->reset(logger, level, file, line, elapse, threadId, fiberId, timeNs);
+    return LogEvent::ptr(event, Recycler(), Allocator<LogEvent>(slot));
+}
+
+std::atomic<bool> LogEvent::s_coarse_clock(false);
+
+LogEvent::ptr LogEvent::Create(const Logger::ptr& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t threadId, uint32_t fiberId) {
+    uint64_t now = s_coarse_clock.load(std::memory_order_relaxed) ? GetCurrentCoarseNS() : GetCurrentNS();
+    return LogEventPool::Create(logger, level, file, line, GetElapsedMS(), threadId, fiberId, now);
+}
+
+void LogEvent::SetCoarseClock(bool v) {
+    s_coarse_clock.store(v, std::memory_order_relaxed);
+}
+
+bool LogEvent::IsCoarseClock() {
+    return s_coarse_clock.load(std::memory_order_relaxed);
 }
 
-Logger::ptr LogEvent::getLogger() const {
+const Logger::ptr& LogEvent::getLogger() const {
     return m_logger;
 }
 
@@ -220,11 +514,19 @@ uint64_t LogEvent::getTime() const {
     return m_time;
 }
 
+uint32_t LogEvent::getNanoSecond() const {
+    return m_nsec;
+}
+
 std::string LogEvent::getContent() const {
-    return m_ss.str();
+    return m_buffer.toString();
+}
+
+const LogBuffer& LogEvent::getMessage() const {
+    return m_buffer;
 }
 
-std::stringstream& LogEvent::getSS() {
+std::ostream& LogEvent::getSS() {
     return m_ss;
 }
 
@@ -236,28 +538,107 @@ void LogEvent::format(const char* fmt, ...) {
 }
 
 void LogEvent::format(const char* fmt, va_list al) {
-    char* buf = nullptr;
-    int len = vasprintf(&buf, fmt, al);
-    if (len != -1) {
-        m_ss << std::string(buf, len);
-        free(buf);
+    // 先按缓冲区剩余空间直接格式化, 放不下时扩容后再格式化一次
+    va_list copy;
+    va_copy(copy, al);
+    size_t avail = m_buffer.capacity() - m_buffer.size();
+    if (avail < 128) {
+        avail = 128;
+    }
+    char* p = m_buffer.reserve(avail);
+    int len = vsnprintf(p, avail, fmt, copy);
+    va_end(copy);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= avail) {
+        p = m_buffer.reserve(len + 1);
+        vsnprintf(p, len + 1, fmt, al);
+    }
+    m_buffer.commit(len);
+}
+
+
+LogBuffer& LogEvent::beginField(const char* key, size_t keyLength) {
+    LogField* f;
+    if (m_fieldCount < INLINE_FIELDS) {
+        f = &m_fields[m_fieldCount];
+    } else {
+        m_moreFields.resize(m_fieldCount - INLINE_FIELDS + 1);
+        f = &m_moreFields.back();
     }
+    keyLength = std::min<size_t>(keyLength, UINT16_MAX);
+    f->keyOffset = m_fieldText.size();
+    f->keyLength = keyLength;
+    m_fieldText.append(key, keyLength);
+    f->valueOffset = m_fieldText.size();
+    return m_fieldText;
+}
+
+void LogEvent::endField(bool quoted) {
+    LogField& f = m_fieldCount < INLINE_FIELDS ? m_fields[m_fieldCount] : m_moreFields.back();
+    f.valueLength = m_fieldText.size() - f.valueOffset;
+    f.quoted = quoted;
+    ++m_fieldCount;
 }
 
+void LogEvent::appendFields(LogBuffer& buf) const {
+    for (size_t i = 0; i < m_fieldCount; ++i) {
+        const LogField& f = getField(i);
+        const char* v = getFieldValue(f);
+        buf.append(' ');
+        buf.append(getFieldKey(f), f.keyLength);
+        buf.append('=');
+        bool quote = f.valueLength == 0;
+        for (uint32_t j = 0; j < f.valueLength && !quote; ++j) {
+            unsigned char c = v[j];
+            quote = c <= ' ' || c == '"' || c == '=' || c == '\\';
+        }
+        if (!quote) {
+            buf.append(v, f.valueLength);
+            continue;
+        }
+        buf.append('"');
+        for (uint32_t j = 0; j < f.valueLength; ++j) {
+            char c = v[j];
+            if (c == '"' || c == '\\') {
+                buf.append('\\');
+                buf.append(c);
+            } else if (c == '\n') {
+                buf.append("\\n", 2);
+            } else {
+                buf.append(c);
+            }
+        }
+        buf.append('"');
+    }
+}
 
 LogEventWrap::LogEventWrap(LogEvent::ptr e) : 
-    m_event(e) {
+    m_event(std::move(e)) {
+}
+
+LogEventWrap::LogEventWrap(LogEvent::ptr e, uint64_t suppressed) :
+    m_event(std::move(e)), m_suppressed(suppressed) {
 }
 
 LogEventWrap::~LogEventWrap() {
+    if (m_suppressed) {
+        m_event->getSS() << " [suppressed " << m_suppressed << " similar messages]";
+    }
     m_event->getLogger()->log(m_event->getLevel(), m_event);
 }
 
-LogEvent::ptr LogEventWrap::getEvent() const {
+void LogThrottle::writeReport(const Logger::ptr& logger, LogLevel::Level level, const char* file, int32_t line) const {
+    LogEventWrap(LogEvent::Create(logger, level, file, line, GetThreadId(), GetFiberId())).getSS()
+        << "[suppressed " << suppressed << " similar messages]";
+}
+
+const LogEvent::ptr& LogEventWrap::getEvent() const {
     return m_event;
 }
 
-std::stringstream& LogEventWrap::getSS() {
+std::ostream& LogEventWrap::getSS() {
     return m_event->getSS();
 }
 
@@ -291,94 +672,1839 @@ LogFormatter::ptr LogAppender::getFormatter() const {
 }
 
 void LogAppender::setLevel(LogLevel::Level level) {
-    m_level = level;
+    m_level.store(level, std::memory_order_relaxed);
 }
 
 LogLevel::Level LogAppender::getLevel() const {
-    return m_level;
+    return m_level.load(std::memory_order_relaxed);
 }
 
-void StdoutLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
-    if (level >= m_level) {
-        std::cout << m_formatter->format(logger, level, event);
+namespace {
+
+// 写完为止; fd 被别人设成了非阻塞时等到可写再继续. 只用异步信号安全的调用
+void WriteFull(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t rt = ::write(fd, data, len);
+        if (rt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            break;
+        }
+        data += rt;
+        len -= rt;
     }
 }
 
-FileLogAppender::FileLogAppender(const std::string& filename) 
-    : m_filename(filename) {
-    reopen();
+// 后台线程换出的缓冲区超过这个大小时释放, 不长期占用突发时的内存
+const size_t STDOUT_MAX_SPARE = 1024 * 1024;
+
+// 所有 StdoutLogAppender, fork 时逐个处理. 故意不释放, 静态析构阶段还可能有输出器析构
+struct StdoutAppenderRegistry {
+    std::mutex mutex;
+    std::set<StdoutLogAppender*> appenders;
+};
+
+StdoutAppenderRegistry& GetStdoutRegistry() {
+    static StdoutAppenderRegistry* s_registry = new StdoutAppenderRegistry;
+    return *s_registry;
 }
 
-void FileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
-    if (level >= m_level) {
-        m_filestream << m_formatter->format(logger, level, event);
+}
+
+const int StdoutLogAppender::FATAL_WAIT_MS;
+
+StdoutLogAppender::StdoutLogAppender(int fd, bool nonBlocking, size_t maxBacklog)
+    : m_fd(fd), m_nonBlocking(nonBlocking), m_maxBacklog(maxBacklog), m_atomicLines(false) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        m_atomicLines = S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+    }
+    static std::once_flag s_atfork;
+    std::call_once(s_atfork, []() {
+        pthread_atfork(&StdoutLogAppender::ForkPrepare, &StdoutLogAppender::ForkParent,
+                       &StdoutLogAppender::ForkChild);
+    });
+    {
+        StdoutAppenderRegistry& registry = GetStdoutRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.appenders.insert(this);
+    }
+    if (m_nonBlocking) {
+        m_thread.reset(new std::thread(&StdoutLogAppender::run, this));
+    } else {
+        m_stop = true;
     }
 }
 
-bool FileLogAppender::reopen() {
-    if (m_filestream) {
-        m_filestream.close();
+StdoutLogAppender::~StdoutLogAppender() {
+    {
+        StdoutAppenderRegistry& registry = GetStdoutRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.appenders.erase(this);
     }
-    m_filestream.open(m_filename, std::ios::app);
-    return !!m_filestream;
+    stop();
 }
 
+void StdoutLogAppender::ForkPrepare() {
+    // 持有全部锁再 fork, 子进程里的状态是一致的, 不会继承一把别的线程拿着的锁
+    StdoutAppenderRegistry& registry = GetStdoutRegistry();
+    registry.mutex.lock();
+    for (auto a : registry.appenders) {
+        a->m_mutex.lock();
+    }
+}
 
-LogFormatter::LogFormatter(const std::string& pattern)
-    : m_pattern(pattern) {
-    init();
+void StdoutLogAppender::ForkParent() {
+    StdoutAppenderRegistry& registry = GetStdoutRegistry();
+    for (auto a : registry.appenders) {
+        a->m_mutex.unlock();
+    }
+    registry.mutex.unlock();
 }
 
-std::string LogFormatter::format(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
-    std::stringstream ss;
-    for (auto& item : m_items) {
-        item->format(ss, logger, level, event);
+void StdoutLogAppender::ForkChild() {
+    StdoutAppenderRegistry& registry = GetStdoutRegistry();
+    for (auto a : registry.appenders) {
+        if (a->m_thread) {
+            // 子进程里这个线程不存在, 既不能 join 也不能 detach, 直接放弃这个对象
+            a->m_thread.release();
+            // 还没写出的内容由父进程负责, 子进程里丢掉, 避免重复输出
+            a->m_current.clear();
+            a->m_written = a->m_appended;
+            a->m_sleeping = false;
+            a->m_stop = true;
+        }
+        a->m_mutex.unlock();
     }
-    return ss.str();
+    registry.mutex.unlock();
 }
 
-void LogFormatter::init() {
-    // str, format, type
-    std::vector<std::tuple<std::string, std::string, int>> vec;
-    std::string nstr;
+void StdoutLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    ThreadLogBuffer buf;
+    m_formatter->format(buf.get(), logger, level, event);
+    const LogBuffer& line = buf.get();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_stop) {
+        // 在锁内写, 保持和其他线程的顺序
+        write(line.data(), line.size());
+        return;
+    }
+    while (m_appended - m_written + line.size() > m_maxBacklog && !m_stop && m_appended != m_written) {
+        if (m_nonBlocking) {
+            ++m_dropped;
+            return;
+        }
+        m_doneCond.wait(lock);
+    }
+    // 后台线程忙时只追加, 等它写完这一批自己来取; 空闲时才需要唤醒
+    bool wakeup = m_current.empty() && m_sleeping;
+    m_current.append(line.data(), line.size());
+    m_appended += line.size();
+    if (wakeup) {
+        m_cond.notify_one();
+    }
+    if (level >= LogLevel::FATAL) {
+        // FATAL 后面通常紧跟着 abort, 等它写出再返回; 采集端卡住时最多等 FATAL_WAIT_MS, 不会一直卡住调用线程
+        uint64_t target = m_appended;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FATAL_WAIT_MS);
+        while (m_written < target && !m_stop) {
+            if (m_doneCond.wait_until(lock, deadline) == std::cv_status::timeout) {
+                break;
+            }
+        }
+    }
+}
 
-    for (size_t i = 0; i < m_pattern.size(); ++i) {
-        if (m_pattern[i] != '%') {
-            nstr.append(1, m_pattern[i]);
-            continue;
+void StdoutLogAppender::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t target = m_appended;
+    while (m_written < target && !m_stop) {
+        m_doneCond.wait(lock);
+    }
+}
+
+void StdoutLogAppender::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
         }
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    m_doneCond.notify_all();
+    if (m_thread && m_thread->joinable()) {
+        m_thread->join();
+    }
+}
 
-        if ((i + 1) < m_pattern.size()) {
-            if (m_pattern[i + 1] == '%') {
-                nstr.append(1, '%');
-                continue;
+uint64_t StdoutLogAppender::getDropCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+}
+
+void StdoutLogAppender::run() {
+    std::string batch;
+    while (true) {
+        uint64_t dropped = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_current.empty() && m_dropped == m_reported && !m_stop) {
+                m_sleeping = true;
+                m_cond.wait(lock);
+                m_sleeping = false;
+            }
+            if (m_current.empty() && m_dropped == m_reported) {
+                break;
             }
+            batch.swap(m_current);
+            dropped = m_dropped - m_reported;
+            m_reported = m_dropped;
         }
 
-        size_t n = i + 1;
-        int fmt_status = 0;
-        size_t fmt_begin = 0;
-        std::string str;
-        std::string fmt;
+        if (dropped) {
+            std::string notice = "StdoutLogAppender: dropped " + std::to_string(dropped)
+                                 + " log lines, backlog exceeded " + std::to_string(m_maxBacklog) + " bytes\n";
+            write(notice.data(), notice.size());
+        }
+        write(batch.data(), batch.size());
 
-        while (n < m_pattern.size()) {
-            char ch = m_pattern[n];
-            if (!fmt_status && (!isalpha(ch) && ch != '{' && ch != '}')) {
-                str = m_pattern.substr(i + 1, n - i - 1);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_written += batch.size();
+        }
+        m_doneCond.notify_all();
+        if (batch.capacity() > STDOUT_MAX_SPARE) {
+            std::string().swap(batch);
+        } else {
+            batch.clear();
+        }
+    }
+}
+
+void StdoutLogAppender::write(const char* data, size_t len) {
+    if (!m_atomicLines) {
+        WriteFull(m_fd, data, len);
+        return;
+    }
+    // 管道/socket: 每次最多 PIPE_BUF 字节并在行尾切开, 用 writev 一次提交若干完整的行
+    const size_t MAX_IOV = 64;
+    struct iovec iov[MAX_IOV];
+    while (len > 0) {
+        size_t n = 0;
+        size_t total = 0;
+        const char* p = data;
+        const char* end = data + len;
+        while (p < end && n < MAX_IOV) {
+            const char* eol = (const char*)memchr(p, '\n', end - p);
+            size_t lineLen = eol ? eol - p + 1 : end - p;
+            if (total + lineLen > PIPE_BUF && total > 0) {
                 break;
             }
-
-            if (fmt_status == 0) {
-                if (ch == '{') {
-                    str = m_pattern.substr(i + 1, n - i - 1);
-                    fmt_status = 1;
-                    fmt_begin = n;
-                    ++n;
+            iov[n].iov_base = (void*)p;
+            iov[n].iov_len = lineLen;
+            ++n;
+            total += lineLen;
+            p += lineLen;
+            if (total >= PIPE_BUF) {
+                break;
+            }
+        }
+        if (n == 1 && total > PIPE_BUF) {
+            // 超长的行无法保证原子, 整行写完
+            WriteFull(m_fd, data, total);
+        } else {
+            ssize_t rt = ::writev(m_fd, iov, n);
+            if (rt < 0) {
+                if (errno == EINTR) {
                     continue;
                 }
-            } else if (fmt_status == 1) {
-                if (ch == '}') {
-                    fmt = m_pattern.substr(fmt_begin + 1, n - fmt_begin - 1);
+                if (errno != EAGAIN) {
+                    return;
+                }
+                struct pollfd pfd = {m_fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            if ((size_t)rt < total) {
+                // 不超过 PIPE_BUF 的写入不会只写一部分, 这里只是防御
+                WriteFull(m_fd, data + rt, total - rt);
+            }
+        }
+        data += total;
+        len -= total;
+    }
+}
+
+namespace {
+
+// 等待写入的缓冲区达到这个数目时前端等待后台线程, 限制内存占用
+const size_t FILE_MAX_PENDING = 16;
+// 后台线程最多保留的空闲缓冲区
+const size_t FILE_MAX_SPARE = 4;
+
+// 下一个整点或零点 (本地时间)
+time_t NextRollTime(time_t now, FileLogAppender::RollPeriod period) {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    if (period == FileLogAppender::ROLL_HOURLY) {
+        tm.tm_hour += 1;
+    } else {
+        tm.tm_hour = 0;
+        tm.tm_mday += 1;
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// 释放文件末尾预分配但没有用到的块 (截断到当前长度)
+bool ReleasePrealloc(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && ftruncate(fd, st.st_size) == 0;
+}
+
+bool FileExists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+// filename.年月日-时分秒, 同一秒内多次滚动时追加 .1 .2 ...
+std::string ArchiveName(const std::string& filename, time_t now) {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), ".%Y%m%d-%H%M%S", &tm);
+    std::string base = filename + buf;
+    std::string name = base;
+    for (int i = 1; FileExists(name) || FileExists(name + ".gz"); ++i) {
+        name = base + "." + std::to_string(i);
+    }
+    return name;
+}
+
+// 是否为 ArchiveName 生成的文件名
+bool IsArchiveName(const std::string& name, const std::string& prefix) {
+    if (name.size() < prefix.size() + 15 || name.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    const char* p = name.c_str() + prefix.size();
+    for (int i = 0; i < 15; ++i) {
+        if (i == 8 ? p[i] != '-' : !isdigit((unsigned char)p[i])) {
+            return false;
+        }
+    }
+    return name.find(".tmp", prefix.size()) == std::string::npos;
+}
+
+// 当前目录下已有的旧文件, 按时间从旧到新
+std::list<std::string> ListArchives(const std::string& filename) {
+    std::string dir = ".";
+    std::string prefix = filename + ".";
+    size_t pos = filename.rfind('/');
+    if (pos != std::string::npos) {
+        dir = pos ? filename.substr(0, pos) : "/";
+        prefix = filename.substr(pos + 1) + ".";
+    }
+    std::vector<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if (d) {
+        while (struct dirent* e = readdir(d)) {
+            if (IsArchiveName(e->d_name, prefix)) {
+                names.push_back(pos == std::string::npos ? e->d_name : dir + "/" + e->d_name);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+    return std::list<std::string>(names.begin(), names.end());
+}
+
+// 压缩成 path.gz 并删除原文件, 失败时保留原文件
+std::string CompressFile(const std::string& path) {
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return path;
+    }
+    std::string tmp = path + ".gz.tmp";
+    gzFile out = gzopen(tmp.c_str(), "wb6");
+    bool ok = out != nullptr;
+    char buf[64 * 1024];
+    while (ok) {
+        ssize_t n = ::read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        ok = gzwrite(out, buf, n) == n;
+    }
+    close(in);
+    if (out && gzclose(out) != Z_OK) {
+        ok = false;
+    }
+    if (!ok || rename(tmp.c_str(), (path + ".gz").c_str()) != 0) {
+        unlink(tmp.c_str());
+        return path;
+    }
+    unlink(path.c_str());
+    return path + ".gz";
+}
+
+}
+
+FileLogAppender::FileLogAppender(const std::string& filename) 
+    : m_filename(filename) {
+    reopen();
+    m_current.reserve(m_flushBytes);
+    m_thread = std::thread(std::bind(&FileLogAppender::run, this));
+}
+
+FileLogAppender::~FileLogAppender() {
+    stop();
+    if (m_fd >= 0) {
+        if (m_maxSize) {
+            ReleasePrealloc(m_fd);
+        }
+        close(m_fd);
+    }
+    if (m_nextFd >= 0) {
+        close(m_nextFd);
+        unlink((m_filename + ".next").c_str());
+    }
+}
+
+void FileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    ThreadLogBuffer buf;
+    m_formatter->format(buf.get(), logger, level, event);
+    const LogBuffer& data = buf.get();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_stop) {
+        lock.unlock();
+        std::lock_guard<std::mutex> fdLock(m_fdMutex);
+        if (m_fd >= 0) {
+            WriteFull(m_fd, data.data(), data.size());
+        }
+        return;
+    }
+
+    bool notify = false;
+    m_current.append(data.data(), data.size());
+    if (m_current.size() >= m_flushBytes) {
+        m_full.push_back(std::move(m_current));
+        m_current.clear();
+        if (!m_spare.empty()) {
+            m_current.swap(m_spare.back());
+            m_spare.pop_back();
+        } else {
+            m_current.reserve(m_flushBytes);
+        }
+        notify = true;
+        if (m_full.size() >= FILE_MAX_PENDING) {
+            m_cond.notify_one();
+            m_doneCond.wait(lock, [this]() {
+                return m_full.size() < FILE_MAX_PENDING || m_stop;
+            });
+        }
+    }
+    if (level >= m_flushLevel) {
+        m_urgent = true;
+        notify = true;
+    }
+    lock.unlock();
+    if (notify) {
+        m_cond.notify_one();
+    }
+}
+
+void FileLogAppender::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_stop) {
+        bool sync = m_fsyncPolicy != FSYNC_NONE;
+        lock.unlock();
+        std::lock_guard<std::mutex> fdLock(m_fdMutex);
+        if (sync && m_fd >= 0) {
+            fdatasync(m_fd);
+        }
+        return;
+    }
+    uint64_t req = ++m_flushReq;
+    m_cond.notify_one();
+    m_doneCond.wait(lock, [this, req]() {
+        return m_flushDone >= req;
+    });
+}
+
+void FileLogAppender::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_archiveMutex);
+        m_archiveStop = true;
+    }
+    m_archiveCond.notify_one();
+    if (m_archiveThread.joinable()) {
+        m_archiveThread.join();
+    }
+}
+
+bool FileLogAppender::reopen() {
+    int fd = ::open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    std::lock_guard<std::mutex> lock(m_fdMutex);
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    struct stat st;
+    m_fileSize = (fd >= 0 && fstat(fd, &st) == 0) ? st.st_size : 0;
+    return fd >= 0;
+}
+
+void FileLogAppender::setFlushBytes(size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_flushBytes = bytes ? bytes : 1;
+}
+
+void FileLogAppender::setFlushInterval(uint64_t ms) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_flushIntervalMs = ms ? ms : 1;
+    }
+    m_cond.notify_one();
+}
+
+void FileLogAppender::setFlushLevel(LogLevel::Level level) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_flushLevel = level;
+}
+
+void FileLogAppender::setFsyncPolicy(FsyncPolicy policy, uint64_t intervalMs) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fsyncPolicy = policy;
+    m_fsyncIntervalMs = intervalMs;
+}
+
+void FileLogAppender::setRolling(uint64_t maxSize, RollPeriod period, size_t maxFiles, bool compress) {
+    {
+        std::lock_guard<std::mutex> lock(m_archiveMutex);
+        m_maxFiles = maxFiles;
+        m_compress = compress;
+        if (!m_archiveThread.joinable() && !m_archiveStop) {
+            m_archiveThread = std::thread(std::bind(&FileLogAppender::archiveLoop, this));
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_fdMutex);
+    m_maxSize = maxSize;
+    m_rollPeriod = period;
+    m_nextRollTime = period == ROLL_NONE ? 0 : NextRollTime(time(0), period);
+    if (isRolling() && m_nextFd < 0) {
+        prepareNext();
+    }
+}
+
+void FileLogAppender::prepareNext() {
+    std::string path = m_filename + ".next";
+    m_nextFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_nextFd >= 0 && m_maxSize) {
+        // 预先分配磁盘块, 不改变文件长度, 之后的追加写不用再分配
+        fallocate(m_nextFd, FALLOC_FL_KEEP_SIZE, 0, m_maxSize);
+    }
+}
+
+void FileLogAppender::rollIfNeeded(size_t incoming) {
+    if (!incoming || !isRolling() || m_fileSize == 0) {
+        return;
+    }
+    time_t now = 0;
+    bool roll = m_maxSize && m_fileSize + incoming > m_maxSize;
+    if (!roll && m_rollPeriod != ROLL_NONE) {
+        now = time(0);
+        roll = now >= m_nextRollTime;
+    }
+    if (!roll) {
+        return;
+    }
+    if (!now) {
+        now = time(0);
+    }
+    if (m_rollPeriod != ROLL_NONE) {
+        m_nextRollTime = NextRollTime(now, m_rollPeriod);
+    }
+
+    if (m_nextFd < 0) {
+        prepareNext();
+        if (m_nextFd < 0) {
+            return;
+        }
+    }
+    std::string archived = ArchiveName(m_filename, now);
+    if (rename(m_filename.c_str(), archived.c_str()) != 0) {
+        return;
+    }
+    if (rename((m_filename + ".next").c_str(), m_filename.c_str()) != 0) {
+        // 原文件已改名, 直接新建
+        close(m_nextFd);
+        m_nextFd = ::open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (m_fd >= 0) {
+        if (m_maxSize) {
+            ReleasePrealloc(m_fd);
+        }
+        close(m_fd);
+    }
+    m_fd = m_nextFd;
+    m_nextFd = -1;
+    m_fileSize = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(m_archiveMutex);
+        m_archiveQueue.push_back(archived);
+    }
+    m_archiveCond.notify_one();
+}
+
+void FileLogAppender::archiveLoop() {
+    std::list<std::string> archives = ListArchives(m_filename);
+    while (true) {
+        std::string path;
+        size_t maxFiles;
+        bool compress;
+        {
+            std::unique_lock<std::mutex> lock(m_archiveMutex);
+            m_archiveCond.wait(lock, [this]() {
+                return !m_archiveQueue.empty() || m_archiveStop;
+            });
+            if (m_archiveQueue.empty()) {
+                break;
+            }
+            path = m_archiveQueue.front();
+            m_archiveQueue.pop_front();
+            maxFiles = m_maxFiles;
+            compress = m_compress;
+        }
+        archives.push_back(compress ? CompressFile(path) : path);
+        while (maxFiles && archives.size() > maxFiles) {
+            unlink(archives.front().c_str());
+            archives.pop_front();
+        }
+    }
+}
+
+size_t FileLogAppender::writeBuffers(const BufferList& buffers) {
+    if (m_fd < 0) {
+        return 0;
+    }
+    std::vector<struct iovec> iov;
+    iov.reserve(buffers.size());
+    for (auto& b : buffers) {
+        if (!b.empty()) {
+            struct iovec v;
+            v.iov_base = (void*)b.data();
+            v.iov_len = b.size();
+            iov.push_back(v);
+        }
+    }
+    size_t idx = 0;
+    size_t written = 0;
+    while (idx < iov.size()) {
+        int cnt = (int)std::min(iov.size() - idx, (size_t)IOV_MAX);
+        ssize_t rt = ::writev(m_fd, &iov[idx], cnt);
+        if (rt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += rt;
+        // 处理部分写入
+        size_t n = rt;
+        while (idx < iov.size() && n >= iov[idx].iov_len) {
+            n -= iov[idx].iov_len;
+            ++idx;
+        }
+        if (n) {
+            iov[idx].iov_base = (char*)iov[idx].iov_base + n;
+            iov[idx].iov_len -= n;
+        }
+    }
+    return written;
+}
+
+void FileLogAppender::run() {
+    BufferList buffers;
+    bool dirty = false;     // 已写入但还没有 fsync
+    uint64_t lastReq = 0;
+    auto lastSync = std::chrono::steady_clock::now();
+    while (true) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_full.empty() && !m_urgent && m_flushReq == m_flushDone && !m_stop) {
+            m_cond.wait_for(lock, std::chrono::milliseconds(m_flushIntervalMs));
+        }
+        // 不管是被唤醒还是到了刷新间隔, 当前缓冲区都一起写出
+        if (!m_current.empty()) {
+            m_full.push_back(std::move(m_current));
+            m_current.clear();
+            if (!m_spare.empty()) {
+                m_current.swap(m_spare.back());
+                m_spare.pop_back();
+            }
+        }
+        buffers.swap(m_full);
+        m_urgent = false;
+        uint64_t req = m_flushReq;
+        bool stop = m_stop;
+        FsyncPolicy policy = m_fsyncPolicy;
+        auto fsyncInterval = std::chrono::milliseconds(m_fsyncIntervalMs);
+        // 先拿到文件锁再放开 m_mutex, 保证 stop 之后的同步写入排在最后一批之后
+        std::unique_lock<std::mutex> fdLock(m_fdMutex);
+        lock.unlock();
+        m_doneCond.notify_all();
+
+        if (!buffers.empty()) {
+            size_t bytes = 0;
+            for (auto& b : buffers) {
+                bytes += b.size();
+            }
+            rollIfNeeded(bytes);
+            m_fileSize += writeBuffers(buffers);
+            dirty = true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (dirty && policy != FSYNC_NONE && m_fd >= 0) {
+            if (policy == FSYNC_EVERY_BATCH || req != lastReq || stop
+                    || now - lastSync >= fsyncInterval) {
+                fdatasync(m_fd);
+                dirty = false;
+                lastSync = now;
+            }
+        }
+        if (isRolling() && m_nextFd < 0) {
+            prepareNext();
+        }
+        fdLock.unlock();
+        lastReq = req;
+
+        lock.lock();
+        for (auto& b : buffers) {
+            if (m_spare.size() < FILE_MAX_SPARE) {
+                b.clear();
+                m_spare.push_back(std::move(b));
+            }
+        }
+        buffers.clear();
+        m_flushDone = req;
+        lock.unlock();
+        m_doneCond.notify_all();
+        if (stop) {
+            break;
+        }
+    }
+}
+
+
+MmapFileLogAppender::MmapFileLogAppender(const std::string& filename, size_t segmentSize)
+    : m_filename(filename), m_current(nullptr), m_dropped(0) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    m_segmentSize = (std::max(segmentSize, page) + page - 1) / page * page;
+
+    // 从第一个不存在的序号开始, 不覆盖之前的段
+    char suffix[16];
+    do {
+        snprintf(suffix, sizeof(suffix), ".%06u", ++m_index);
+    } while (access((m_filename + suffix).c_str(), F_OK) == 0);
+    --m_index;
+
+    m_segments.emplace_back(new Segment);
+    Segment* seg = m_segments.back().get();
+    if (openSegment(seg, ++m_index)) {
+        m_current.store(seg, std::memory_order_release);
+    } else {
+        m_free.push_back(seg);
+    }
+    m_thread = std::thread(std::bind(&MmapFileLogAppender::run, this));
+}
+
+MmapFileLogAppender::~MmapFileLogAppender() {
+    stop();
+}
+
+MmapFileLogAppender::Segment* MmapFileLogAppender::enter() {
+    while (true) {
+        Segment* seg = m_current.load(std::memory_order_seq_cst);
+        if (!seg) {
+            return nullptr;
+        }
+        // 先登记再确认仍是当前段, 与 switchSegment 中先换段再由后台线程检查 writers 配对
+        seg->writers.fetch_add(1, std::memory_order_seq_cst);
+        if (m_current.load(std::memory_order_seq_cst) == seg) {
+            return seg;
+        }
+        seg->writers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void MmapFileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    ThreadLogBuffer buf;
+    m_formatter->format(buf.get(), logger, level, event);
+    const char* data = buf.get().data();
+    size_t n = std::min(buf.get().size(), m_segmentSize);
+    if (!n) {
+        return;
+    }
+
+    while (true) {
+        Segment* seg = enter();
+        if (!seg) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        uint64_t offset = seg->cursor.fetch_add(n, std::memory_order_relaxed);
+        if (offset + n <= seg->size) {
+            memcpy(seg->data + offset, data, n);
+            seg->writers.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        seg->writers.fetch_sub(1, std::memory_order_release);
+        if (offset <= seg->size) {
+            // 恰好跨过段尾的写入只有一个, 由它记录有效长度并切换
+            seg->end = offset;
+            switchSegment(seg);
+        } else {
+            while (m_current.load(std::memory_order_acquire) == seg) {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+void MmapFileLogAppender::switchSegment(Segment* seg) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_current.load(std::memory_order_relaxed) != seg) {
+        // 已经被 stop 换下
+        return;
+    }
+    if (!m_next && !m_stop) {
+        m_cond.notify_one();
+        m_nextCond.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+            return m_next || m_stop;
+        });
+    }
+    // 仍然没有下一段时 (比如磁盘满) 暂时丢弃日志, 后台线程映射成功后再恢复
+    Segment* next = m_stop ? nullptr : m_next;
+    m_next = nullptr;
+    m_retired.push_back(seg);
+    m_current.store(next, std::memory_order_seq_cst);
+    lock.unlock();
+    m_cond.notify_one();
+}
+
+void MmapFileLogAppender::flush() {
+    Segment* seg = enter();
+    if (!seg) {
+        return;
+    }
+    uint64_t end = std::min<uint64_t>(seg->cursor.load(std::memory_order_relaxed), seg->size);
+    if (end) {
+        msync(seg->data, end, MS_SYNC);
+    }
+    seg->writers.fetch_sub(1, std::memory_order_release);
+}
+
+void MmapFileLogAppender::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+        Segment* seg = m_current.exchange(nullptr, std::memory_order_seq_cst);
+        if (seg) {
+            m_retired.push_back(seg);
+        }
+    }
+    m_cond.notify_one();
+    m_nextCond.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+bool MmapFileLogAppender::openSegment(Segment* seg, uint32_t index) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%06u", index);
+    seg->path = m_filename + suffix;
+    seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0) {
+        return false;
+    }
+    // 真正分配磁盘块, 避免写映射内存时因为磁盘满收到 SIGBUS
+    if (fallocate(seg->fd, 0, 0, m_segmentSize) != 0
+            && ftruncate(seg->fd, m_segmentSize) != 0) {
+        closeSegment(seg, 0);
+        unlink(seg->path.c_str());
+        return false;
+    }
+    void* data = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+    if (data == MAP_FAILED) {
+        closeSegment(seg, 0);
+        unlink(seg->path.c_str());
+        return false;
+    }
+    seg->data = (char*)data;
+    seg->size = m_segmentSize;
+    seg->end = UINT64_MAX;
+    seg->cursor.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void MmapFileLogAppender::closeSegment(Segment* seg, uint64_t end) {
+    if (seg->data) {
+        munmap(seg->data, seg->size);
+        seg->data = nullptr;
+    }
+    if (seg->fd >= 0) {
+        if (ftruncate(seg->fd, end) != 0) {
+            std::cerr << "MmapFileLogAppender truncate " << seg->path << " failed" << std::endl;
+        }
+        close(seg->fd);
+        seg->fd = -1;
+    }
+    seg->size = 0;
+}
+
+void MmapFileLogAppender::run() {
+    while (true) {
+        std::vector<Segment*> retired;
+        bool stop;
+        bool needNext;
+        uint32_t index = 0;
+        Segment* seg = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_retired.empty() && m_next && !m_stop) {
+                m_cond.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            retired.swap(m_retired);
+            stop = m_stop;
+            needNext = !m_next && !stop;
+            if (needNext) {
+                if (m_free.empty()) {
+                    m_segments.emplace_back(new Segment);
+                    m_free.push_back(m_segments.back().get());
+                }
+                seg = m_free.back();
+                m_free.pop_back();
+                index = ++m_index;
+            }
+        }
+
+        for (auto s : retired) {
+            while (s->writers.load(std::memory_order_acquire) > 0) {
+                std::this_thread::yield();
+            }
+            uint64_t end = s->end;
+            if (end == UINT64_MAX) {
+                // stop 时的当前段, 有效长度就是已分配的部分
+                end = std::min<uint64_t>(s->cursor.load(std::memory_order_relaxed), s->size);
+            }
+            closeSegment(s, end);
+        }
+
+        bool opened = seg && openSegment(seg, index);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto s : retired) {
+                m_free.push_back(s);
+            }
+            if (opened) {
+                if (!m_current.load(std::memory_order_relaxed) && !m_stop) {
+                    m_current.store(seg, std::memory_order_seq_cst);
+                } else {
+                    m_next = seg;
+                }
+            } else if (seg) {
+                --m_index;
+                m_free.push_back(seg);
+            }
+        }
+        m_nextCond.notify_all();
+
+        if (stop) {
+            break;
+        }
+        if (seg && !opened) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // 预先映射但没用到的段直接删除
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_next) {
+        closeSegment(m_next, 0);
+        unlink(m_next->path.c_str());
+        m_free.push_back(m_next);
+        m_next = nullptr;
+    }
+}
+
+
+AsyncLogAppender::AsyncLogAppender(LogAppender::ptr appender, size_t capacity, OverflowPolicy policy)
+    : m_appender(appender), m_policy(policy), m_queue(capacity),
+      m_sleeping(false), m_stop(false), m_waiters(0), m_producers(0), m_dropped(0), m_flushReq(0) {
+    m_formatter = appender->getFormatter();
+    m_thread = std::thread(std::bind(&AsyncLogAppender::run, this));
+}
+
+AsyncLogAppender::~AsyncLogAppender() {
+    stop();
+}
+
+void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    // 先登记再检查 m_stop: 要么这里看到已经停止, 要么后台线程看到有生产者并等它放完再最后 drain
+    m_producers.fetch_add(1, std::memory_order_seq_cst);
+    if (m_stop.load(std::memory_order_seq_cst)) {
+        m_producers.fetch_sub(1, std::memory_order_release);
+        m_appender->log(logger, level, event);
+        return;
+    }
+
+    Item item;
+    item.logger = std::move(logger);
+    item.level = level;
+    item.event = std::move(event);
+
+    if (!m_queue.tryPush(std::move(item))) {
+        switch (m_policy) {
+        case DROP_NEWEST:
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            m_producers.fetch_sub(1, std::memory_order_release);
+            return;
+        case DROP_OLDEST: {
+            Item old;
+            while (!m_queue.tryPush(std::move(item))) {
+                if (m_queue.tryPop(old)) {
+                    m_dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            break;
+        }
+        case BLOCK:
+        default:
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            while (!m_queue.tryPush(std::move(item))) {
+                wakeup();
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_doneCond.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    // 与 run() 中设置 m_sleeping 后的检查配对, 保证不会丢失唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed)) {
+        wakeup();
+    }
+    m_producers.fetch_sub(1, std::memory_order_release);
+}
+
+void AsyncLogAppender::flush() {
+    if (m_stop.load(std::memory_order_acquire)) {
+        m_appender->flush();
+        return;
+    }
+    uint64_t req = m_flushReq.fetch_add(1) + 1;
+    wakeup();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCond.wait(lock, [this, req]() {
+        return m_flushDone >= req || m_stop.load(std::memory_order_acquire);
+    });
+}
+
+void AsyncLogAppender::setFormatter(LogFormatter::ptr formatter) {
+    LogAppender::setFormatter(formatter);
+    m_appender->setFormatter(formatter);
+}
+
+void AsyncLogAppender::stop() {
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    wakeup();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    m_doneCond.notify_all();
+}
+
+uint64_t AsyncLogAppender::getDropCount() const {
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+size_t AsyncLogAppender::getQueueSize() const {
+    return m_queue.size();
+}
+
+AsyncLogAppender::OverflowPolicy AsyncLogAppender::getPolicy() const {
+    return m_policy;
+}
+
+void AsyncLogAppender::wakeup() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cond.notify_one();
+}
+
+size_t AsyncLogAppender::drain() {
+    size_t n = 0;
+    Item item;
+    while (m_queue.tryPop(item)) {
+        m_appender->log(item.logger, item.level, item.event);
+        item = Item();
+        ++n;
+        if ((n & 63) == 0 && m_waiters.load(std::memory_order_relaxed) > 0) {
+            m_doneCond.notify_all();
+        }
+    }
+    if (n && m_waiters.load(std::memory_order_relaxed) > 0) {
+        m_doneCond.notify_all();
+    }
+    return n;
+}
+
+void AsyncLogAppender::run() {
+    while (true) {
+        size_t n = drain();
+
+        uint64_t req = m_flushReq.load(std::memory_order_acquire);
+        if (req != m_flushDone) {
+            drain();
+            m_appender->flush();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_flushDone = req;
+            }
+            m_doneCond.notify_all();
+            continue;
+        }
+
+        if (n) {
+            continue;
+        }
+
+        if (m_stop.load(std::memory_order_seq_cst)) {
+            // 已经过了 m_stop 检查的生产者还会入队, 阻塞的生产者也要靠这里腾出空位
+            while (m_producers.load(std::memory_order_seq_cst) > 0) {
+                if (!drain()) {
+                    std::this_thread::yield();
+                }
+            }
+            drain();
+            m_appender->flush();
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_queue.empty() && !m_stop.load(std::memory_order_acquire)
+                && m_flushReq.load(std::memory_order_acquire) == m_flushDone) {
+            m_cond.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+
+namespace {
+
+// 写入固定大小的缓冲区, 超出部分丢弃; 只用异步信号安全的操作
+struct SafeWriter {
+    char* p;
+    char* end;
+
+    SafeWriter(char* buf, size_t size) : p(buf), end(buf + size) {}
+
+    void append(const char* s, size_t n) {
+        n = std::min(n, (size_t)(end - p));
+        memcpy(p, s, n);
+        p += n;
+    }
+    void append(const char* s) { append(s, strlen(s)); }
+    void append(char c) {
+        if (p < end) {
+            *p++ = c;
+        }
+    }
+    // width 不足时左侧补 fill
+    void appendUInt(uint64_t v, int width = 0, char fill = '0') {
+        char tmp[24];
+        int n = 0;
+        do {
+            tmp[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        while (n < width && n < (int)sizeof(tmp)) {
+            tmp[n++] = fill;
+        }
+        while (n > 0) {
+            append(tmp[--n]);
+        }
+    }
+    void appendInt(int64_t v) {
+        if (v < 0) {
+            append('-');
+            appendUInt(-(uint64_t)v);
+        } else {
+            appendUInt(v);
+        }
+    }
+};
+
+const size_t RECORDER_MAX_INSTANCES = 16;
+// 信号处理函数不能加锁, 存活的飞行记录器登记在固定大小的数组里
+std::atomic<FlightRecorderAppender*> s_recorders[RECORDER_MAX_INSTANCES];
+std::atomic<uint32_t> s_recorder_id{0};
+
+const int s_crash_signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+struct sigaction s_old_actions[NSIG];
+std::atomic<bool> s_crashing{false};
+
+void CrashSignalHandler(int sig) {
+    if (!s_crashing.exchange(true)) {
+        char buf[64];
+        SafeWriter w(buf, sizeof(buf));
+        w.append("==== caught signal ");
+        w.appendInt(sig);
+        w.append(", dumping flight recorder ====\n");
+        WriteFull(STDERR_FILENO, buf, w.p - buf);
+        FlightRecorderAppender::DumpAll();
+    }
+    // 恢复原来的处理方式, 返回后信号重新投递 (处理期间该信号被屏蔽)
+    sigaction(sig, &s_old_actions[sig], nullptr);
+    raise(sig);
+}
+
+}
+
+thread_local FlightRecorderAppender::ThreadRings FlightRecorderAppender::t_rings;
+
+FlightRecorderAppender::ThreadRings::~ThreadRings() {
+    for (auto& ring : rings) {
+        if (ring) {
+            ring->inUse.store(false, std::memory_order_release);
+        }
+    }
+}
+
+FlightRecorderAppender::FlightRecorderAppender(size_t eventsPerThread, size_t messageSize, const std::string& dumpPath)
+    : m_id(s_recorder_id.fetch_add(1, std::memory_order_relaxed)),
+      m_capacity(1),
+      m_messageSize(std::min<size_t>(messageSize, UINT16_MAX)),
+      m_fd(STDERR_FILENO),
+      m_ownFd(false),
+      m_tzOffset(0),
+      m_rings(nullptr),
+      m_dumping(false) {
+    while (m_capacity < eventsPerThread) {
+        m_capacity <<= 1;
+    }
+    m_stride = (sizeof(Record) + m_messageSize + 7) & ~(size_t)7;
+    m_lineSize = m_messageSize + 1024;
+    m_line.reset(new char[m_lineSize]);
+
+    if (!dumpPath.empty()) {
+        int fd = ::open(dumpPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            m_fd = fd;
+            m_ownFd = true;
+        } else {
+            std::cout << "FlightRecorderAppender open " << dumpPath << " failed, errno=" << errno
+                      << ", dump to stderr" << std::endl;
+        }
+    }
+
+    // 信号处理函数里不能调用 localtime, 时区偏移在这里算好 (之后的夏令时切换不跟随)
+    struct tm tm;
+    time_t now = time(0);
+    if (localtime_r(&now, &tm)) {
+        m_tzOffset = tm.tm_gmtoff;
+    }
+
+    for (auto& slot : s_recorders) {
+        FlightRecorderAppender* expected = nullptr;
+        if (slot.compare_exchange_strong(expected, this)) {
+            break;
+        }
+    }
+}
+
+FlightRecorderAppender::~FlightRecorderAppender() {
+    for (auto& slot : s_recorders) {
+        FlightRecorderAppender* expected = this;
+        slot.compare_exchange_strong(expected, nullptr);
+    }
+    // 等待正在进行的 dump 结束
+    bool expected = false;
+    while (!m_dumping.compare_exchange_weak(expected, true)) {
+        expected = false;
+        std::this_thread::yield();
+    }
+    if (m_ownFd) {
+        ::close(m_fd);
+    }
+}
+
+FlightRecorderAppender::Ring* FlightRecorderAppender::getRing() {
+    std::vector<std::shared_ptr<Ring>>& rings = t_rings.rings;
+    if (m_id < rings.size() && rings[m_id]) {
+        return rings[m_id].get();
+    }
+    if (m_id >= rings.size()) {
+        rings.resize(m_id + 1);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& ring : m_owners) {
+        bool expected = false;
+        if (!ring->inUse.load(std::memory_order_relaxed)
+                && ring->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            // 复用退出线程的环, 它留下的事件仍可以输出, 只是归到新线程名下
+            ring->threadId = GetThreadId();
+            rings[m_id] = ring;
+            return ring.get();
+        }
+    }
+    std::shared_ptr<Ring> ring(new Ring);
+    ring->data.reset(new char[m_capacity * m_stride]);
+    ring->threadId = GetThreadId();
+    ring->next = m_rings.load(std::memory_order_relaxed);
+    m_rings.store(ring.get(), std::memory_order_release);
+    m_owners.push_back(ring);
+    rings[m_id] = ring;
+    return ring.get();
+}
+
+void FlightRecorderAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    // 输出期间停止记录, 避免覆盖正在读的槽位
+    if (level < m_level || m_dumping.load(std::memory_order_relaxed)) {
+        return;
+    }
+    Ring* ring = getRing();
+    uint64_t seq = ring->head.load(std::memory_order_relaxed);
+    Record* r = at(ring, seq);
+    r->time = event->getTime();
+    r->nsec = event->getNanoSecond();
+    r->elapse = event->getElapse();
+    r->threadId = event->getThreadId();
+    r->fiberId = event->getFiberId();
+    r->file = event->getFile();
+    r->line = event->getLine();
+    r->level = level;
+    const std::string& name = logger->getName();
+    size_t n = std::min(name.size(), NAME_SIZE - 1);
+    memcpy(r->name, name.data(), n);
+    r->name[n] = '\0';
+    const LogBuffer& msg = event->getMessage();
+    r->length = std::min(msg.size(), m_messageSize);
+    memcpy((char*)(r + 1), msg.data(), r->length);
+    ring->head.store(seq + 1, std::memory_order_release);
+
+    if (level >= LogLevel::FATAL) {
+        dump();
+    }
+}
+
+void FlightRecorderAppender::dump() {
+    bool expected = false;
+    if (!m_dumping.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return;
+    }
+    LogFormatter* fmt = m_formatter.get();
+    char* line = m_line.get();
+    for (Ring* ring = m_rings.load(std::memory_order_acquire); fmt && ring; ring = ring->next) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = std::max(ring->dumped, head > m_capacity ? head - m_capacity : 0);
+        if (begin >= head) {
+            continue;
+        }
+        SafeWriter w(line, m_lineSize);
+        w.append("==== flight recorder: thread ");
+        w.appendUInt(ring->threadId);
+        w.append(", ");
+        w.appendUInt(head - begin);
+        w.append(" events ====\n");
+        WriteFull(m_fd, line, w.p - line);
+
+        for (uint64_t seq = begin; seq < head; ++seq) {
+            const Record* r = at(ring, seq);
+            LogRecordView view;
+            view.name = r->name;
+            view.level = (LogLevel::Level)r->level;
+            view.file = r->file;
+            view.line = r->line;
+            view.elapse = r->elapse;
+            view.threadId = r->threadId;
+            view.fiberId = r->fiberId;
+            view.time = r->time;
+            view.nsec = r->nsec;
+            view.message = (const char*)(r + 1);
+            view.length = r->length;
+            size_t n = fmt->formatSafe(line, m_lineSize, view, m_tzOffset);
+            if (n == m_lineSize) {
+                line[n - 1] = '\n';
+            }
+            WriteFull(m_fd, line, n);
+        }
+        ring->dumped = head;
+    }
+    m_dumping.store(false, std::memory_order_release);
+}
+
+void FlightRecorderAppender::DumpAll() {
+    for (auto& slot : s_recorders) {
+        FlightRecorderAppender* recorder = slot.load(std::memory_order_acquire);
+        if (recorder) {
+            recorder->dump();
+        }
+    }
+}
+
+void FlightRecorderAppender::InstallCrashHandler() {
+    static std::once_flag s_once;
+    std::call_once(s_once, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = CrashSignalHandler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_ONSTACK;
+        for (int sig : s_crash_signals) {
+            sigaction(sig, &sa, &s_old_actions[sig]);
+        }
+    });
+}
+
+LogFormatter::LogFormatter(const std::string& pattern)
+    : m_pattern(pattern) {
+    init();
+}
+
+std::string LogFormatter::format(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    LogBuffer buf;
+    format(buf, logger, level, event);
+    return buf.toString();
+}
+
+void LogFormatter::format(LogBuffer& buf, const Logger::ptr& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+    for (const Op& op : m_ops) {
+        switch (op.code) {
+        case OP_STRING:
+            buf.append(m_text.data() + op.offset, op.length);
+            break;
+        case OP_MESSAGE: {
+            const LogBuffer& msg = event->getMessage();
+            buf.append(msg.data(), msg.size());
+            if (event->getFieldCount()) {
+                event->appendFields(buf);
+            }
+            break;
+        }
+        case OP_LEVEL:
+            buf.append(LogLevel::toString(level));
+            break;
+        case OP_ELAPSE:
+            buf.appendUInt(event->getElapse());
+            break;
+        case OP_NAME:
+            buf.append(logger->getName());
+            break;
+        case OP_THREAD_ID:
+            buf.appendUInt(event->getThreadId());
+            break;
+        case OP_FIBER_ID:
+            buf.appendUInt(event->getFiberId());
+            break;
+        case OP_DATETIME:
+            FormatDate(buf, m_dates[op.offset], event->getTime(), event->getNanoSecond());
+            break;
+        case OP_FILENAME:
+            buf.append(event->getFile());
+            break;
+        case OP_LINE:
+            buf.appendInt(event->getLine());
+            break;
+        case OP_NEWLINE:
+            buf.append('\n');
+            break;
+        case OP_TAB:
+            buf.append('\t');
+            break;
+        case OP_CUSTOM: {
+            LogStreamBuf sb(&buf);
+            std::ostream os(&sb);
+            m_custom[op.offset]->format(os, logger, level, event);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+namespace {
+
+struct DateCacheEntry {
+    static const size_t MAX_FIELDS = 8;
+    static const size_t MAX_TEXT = 128;
+
+    uint64_t id = 0;
+    uint64_t sec = 0;
+    uint32_t len = 0;
+    uint32_t nfields = 0;
+    struct {
+        uint8_t offset;
+        uint8_t digits;
+    } fields[MAX_FIELDS];
+    char text[MAX_TEXT];
+};
+
+// 按 DateFormat::id 直接映射的每线程缓存, 无需加锁
+thread_local DateCacheEntry t_date_cache[8];
+
+std::atomic<uint64_t> s_date_format_id(0);
+
+const uint32_t s_pow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+void WriteSubSecond(char* p, uint32_t nsec, int digits) {
+    uint32_t v = nsec / s_pow10[9 - digits];
+    for (int i = digits - 1; i >= 0; --i) {
+        p[i] = '0' + v % 10;
+        v /= 10;
+    }
+}
+
+// 渲染一整秒的文本, 亚秒字段先用 0 占位; 超出缓存大小时返回 false
+bool RenderDate(DateCacheEntry& entry, const std::vector<LogFormatter::DateFormat::Part>& parts, uint64_t sec) {
+    struct tm tm;
+    time_t t = sec;
+    localtime_r(&t, &tm);
+
+    entry.len = 0;
+    entry.nfields = 0;
+    for (auto& part : parts) {
+        if (!part.strf.empty()) {
+            size_t n = strftime(entry.text + entry.len, DateCacheEntry::MAX_TEXT - entry.len, part.strf.c_str(), &tm);
+            if (n == 0) {
+                return false;
+            }
+            entry.len += n;
+        }
+        if (part.digits) {
+            if (entry.len + part.digits > DateCacheEntry::MAX_TEXT || entry.nfields == DateCacheEntry::MAX_FIELDS) {
+                return false;
+            }
+            entry.fields[entry.nfields].offset = entry.len;
+            entry.fields[entry.nfields].digits = part.digits;
+            ++entry.nfields;
+            memset(entry.text + entry.len, '0', part.digits);
+            entry.len += part.digits;
+        }
+    }
+    return true;
+}
+
+}
+
+void LogFormatter::CompileDate(DateFormat& df, const std::string& fmt) {
+    df.id = ++s_date_format_id;
+    std::string cur;
+    for (size_t i = 0; i < fmt.size(); ++i) {
+        if (fmt[i] != '%' || i + 1 >= fmt.size()) {
+            cur.append(1, fmt[i]);
+            continue;
+        }
+        char ch = fmt[i + 1];
+        int digits = 0;
+        size_t skip = 1;
+        if (ch == 'L') {
+            digits = 3;
+        } else if (ch == 'N') {
+            digits = 9;
+        } else if ((ch == '3' || ch == '6' || ch == '9') && i + 2 < fmt.size() && fmt[i + 2] == 'N') {
+            digits = ch - '0';
+            skip = 2;
+        }
+
+        if (digits) {
+            df.parts.push_back({cur, digits});
+            cur.clear();
+        } else {
+            // 包括 %%, 原样交给 strftime
+            cur.append(fmt, i, 2);
+            skip = 1;
+        }
+        i += skip;
+    }
+    if (!cur.empty() || df.parts.empty()) {
+        df.parts.push_back({cur, 0});
+    }
+}
+
+void LogFormatter::FormatDate(LogBuffer& buf, const DateFormat& df, uint64_t sec, uint32_t nsec) {
+    DateCacheEntry& entry = t_date_cache[df.id & 7];
+    if (entry.id != df.id || entry.sec != sec) {
+        if (!RenderDate(entry, df.parts, sec)) {
+            entry.id = 0;
+            // 渲染结果太长, 不缓存, 逐段输出
+            struct tm tm;
+            time_t t = sec;
+            localtime_r(&t, &tm);
+            for (auto& part : df.parts) {
+                if (!part.strf.empty()) {
+                    char* p = buf.reserve(256);
+                    buf.commit(strftime(p, 256, part.strf.c_str(), &tm));
+                }
+                if (part.digits) {
+                    WriteSubSecond(buf.reserve(part.digits), nsec, part.digits);
+                    buf.commit(part.digits);
+                }
+            }
+            return;
+        }
+        entry.id = df.id;
+        entry.sec = sec;
+    }
+
+    char* p = buf.reserve(entry.len);
+    memcpy(p, entry.text, entry.len);
+    for (uint32_t i = 0; i < entry.nfields; ++i) {
+        WriteSubSecond(p + entry.fields[i].offset, nsec, entry.fields[i].digits);
+    }
+    buf.commit(entry.len);
+}
+
+namespace {
+
+// 按固定时区偏移渲染日期, 只处理数字字段, 不认识的字段原样输出
+void FormatDateSafe(SafeWriter& w, const LogFormatter::DateFormat& df, uint64_t sec, uint32_t nsec, long tzOffset) {
+    int64_t t = (int64_t)sec + tzOffset;
+    int64_t days = t / 86400;
+    int64_t rem = t % 86400;
+    if (rem < 0) {
+        rem += 86400;
+        --days;
+    }
+    // 公历换算, 见 Howard Hinnant 的 civil_from_days
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int day = doy - (153 * mp + 2) / 5 + 1;
+    int month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = yoe + era * 400 + (month <= 2);
+    int hour = rem / 3600;
+    int minute = rem % 3600 / 60;
+    int second = rem % 60;
+
+    for (auto& part : df.parts) {
+        const char* f = part.strf.c_str();
+        for (; *f; ++f) {
+            if (*f != '%' || !f[1]) {
+                w.append(*f);
+                continue;
+            }
+            switch (*++f) {
+            case 'Y': w.appendInt(year); break;
+            case 'y': w.appendUInt((year % 100 + 100) % 100, 2); break;
+            case 'm': w.appendUInt(month, 2); break;
+            case 'd': w.appendUInt(day, 2); break;
+            case 'e': w.appendUInt(day, 2, ' '); break;
+            case 'H': w.appendUInt(hour, 2); break;
+            case 'M': w.appendUInt(minute, 2); break;
+            case 'S': w.appendUInt(second, 2); break;
+            case 's': w.appendInt(sec); break;
+            case 'F':
+                w.appendInt(year);
+                w.append('-');
+                w.appendUInt(month, 2);
+                w.append('-');
+                w.appendUInt(day, 2);
+                break;
+            case 'T':
+                w.appendUInt(hour, 2);
+                w.append(':');
+                w.appendUInt(minute, 2);
+                w.append(':');
+                w.appendUInt(second, 2);
+                break;
+            case '%': w.append('%'); break;
+            default:
+                w.append('%');
+                w.append(*f);
+                break;
+            }
+        }
+        if (part.digits) {
+            w.appendUInt(nsec / s_pow10[9 - part.digits], part.digits);
+        }
+    }
+}
+
+}
+
+size_t LogFormatter::formatSafe(char* buf, size_t size, const LogRecordView& rec, long tzOffset) const {
+    SafeWriter w(buf, size);
+    for (const Op& op : m_ops) {
+        switch (op.code) {
+        case OP_STRING:
+            w.append(m_text.data() + op.offset, op.length);
+            break;
+        case OP_MESSAGE:
+            w.append(rec.message, rec.length);
+            break;
+        case OP_LEVEL:
+            w.append(LogLevel::toString(rec.level));
+            break;
+        case OP_ELAPSE:
+            w.appendUInt(rec.elapse);
+            break;
+        case OP_NAME:
+            w.append(rec.name);
+            break;
+        case OP_THREAD_ID:
+            w.appendUInt(rec.threadId);
+            break;
+        case OP_FIBER_ID:
+            w.appendUInt(rec.fiberId);
+            break;
+        case OP_DATETIME:
+            FormatDateSafe(w, m_dates[op.offset], rec.time, rec.nsec, tzOffset);
+            break;
+        case OP_FILENAME:
+            w.append(rec.file ? rec.file : "");
+            break;
+        case OP_LINE:
+            w.appendInt(rec.line);
+            break;
+        case OP_NEWLINE:
+            w.append('\n');
+            break;
+        case OP_TAB:
+            w.append('\t');
+            break;
+        default:
+            break;
+        }
+    }
+    return w.p - buf;
+}
+
+const std::string& LogFormatter::getPattern() const {
+    return m_pattern;
+}
+
+static std::map<std::string, LogFormatter::ItemCreator>& GetCustomItems() {
+    static std::map<std::string, LogFormatter::ItemCreator> s_items;
+    return s_items;
+}
+
+static std::mutex& GetCustomItemsMutex() {
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+void LogFormatter::RegisterItem(const std::string& name, ItemCreator creator) {
+    std::lock_guard<std::mutex> lock(GetCustomItemsMutex());
+    GetCustomItems()[name] = creator;
+}
+
+void LogFormatter::addText(const std::string& str) {
+    if (!m_ops.empty() && m_ops.back().code == OP_STRING
+            && m_ops.back().offset + m_ops.back().length == m_text.size()) {
+        m_ops.back().length += str.size();
+    } else {
+        m_ops.push_back({OP_STRING, (uint32_t)m_text.size(), (uint32_t)str.size()});
+    }
+    m_text.append(str);
+}
+
+void LogFormatter::init() {
+    // str, format, type
+    std::vector<std::tuple<std::string, std::string, int>> vec;
+    std::string nstr;
+
+    for (size_t i = 0; i < m_pattern.size(); ++i) {
+        if (m_pattern[i] != '%') {
+            nstr.append(1, m_pattern[i]);
+            continue;
+        }
+
+        if ((i + 1) < m_pattern.size()) {
+            if (m_pattern[i + 1] == '%') {
+                nstr.append(1, '%');
+                continue;
+            }
+        }
+
+        size_t n = i + 1;
+        int fmt_status = 0;
+        size_t fmt_begin = 0;
+        std::string str;
+        std::string fmt;
+
+        while (n < m_pattern.size()) {
+            char ch = m_pattern[n];
+            if (!fmt_status && (!isalpha(ch) && ch != '{' && ch != '}')) {
+                str = m_pattern.substr(i + 1, n - i - 1);
+                break;
+            }
+
+            if (fmt_status == 0) {
+                if (ch == '{') {
+                    str = m_pattern.substr(i + 1, n - i - 1);
+                    fmt_status = 1;
+                    fmt_begin = n;
+                    ++n;
+                    continue;
+                }
+            } else if (fmt_status == 1) {
+                if (ch == '}') {
+                    fmt = m_pattern.substr(fmt_begin + 1, n - fmt_begin - 1);
                     fmt_status = 0;
                     ++n;
                     break;
@@ -411,49 +2537,108 @@ void LogFormatter::init() {
         vec.push_back({nstr, "", 0});
     }
 
-    static std::map<std::string, std::function<FormatItem::ptr(const std::string& str)>> s_format_items = {
+    static std::map<std::string, OpCode> s_format_ops = {
 #define XX(str, C) \
-    {#str, [](const std::string& fmt) { return FormatItem::ptr(new C(fmt)); }}
-
-    XX(m, MessageFormatItem),
-    XX(p, LevelFormatItem),
-    XX(r, ElapseFormatItem),
-    XX(c, NameFormatItem),
-    XX(t, ThreadIdFormatItem),
-    XX(F, FiberIdFormatItem),
-    XX(d, DateTimeFormatItem),
-    XX(f, FilenameFormatItem),
-    XX(l, LineFormatItem),
-    XX(n, NewLineFormatItem),
-    XX(T, TabFormatItem),
+    {#str, C}
+
+    XX(m, OP_MESSAGE),
+    XX(p, OP_LEVEL),
+    XX(r, OP_ELAPSE),
+    XX(c, OP_NAME),
+    XX(t, OP_THREAD_ID),
+    XX(F, OP_FIBER_ID),
+    XX(d, OP_DATETIME),
+    XX(f, OP_FILENAME),
+    XX(l, OP_LINE),
+    XX(n, OP_NEWLINE),
+    XX(T, OP_TAB),
 #undef XX
     };
 
-    for (auto v : vec) {
+    std::map<std::string, ItemCreator> custom_items;
+    {
+        std::lock_guard<std::mutex> lock(GetCustomItemsMutex());
+        custom_items = GetCustomItems();
+    }
+
+    for (auto& v : vec) {
         if (std::get<2>(v) == 0) {
-            m_items.push_back(FormatItem::ptr(new StringFormatItem(std::get<0>(v))));
-        } else {
-            auto it = s_format_items.find(std::get<0>(v));
-            if (it == s_format_items.end()) {
-                m_items.push_back(FormatItem::ptr(new StringFormatItem("<<error_format %" + std::get<0>(v) + ">>")));
-            } else {
-                m_items.push_back(it->second(std::get<1>(v)));
-            }
+            addText(std::get<0>(v));
+            continue;
+        }
+
+        auto cit = custom_items.find(std::get<0>(v));
+        if (cit != custom_items.end()) {
+            m_ops.push_back({OP_CUSTOM, (uint32_t)m_custom.size(), 0});
+            m_custom.push_back(cit->second(std::get<1>(v)));
+            continue;
         }
 
-        // std::cout << std::get<0>(v) << " - " << std::get<1>(v) << " - " << std::get<2>(v) << std::endl;
+        auto it = s_format_ops.find(std::get<0>(v));
+        if (it == s_format_ops.end()) {
+            addText("<<error_format %" + std::get<0>(v) + ">>");
+        } else if (it->second == OP_DATETIME) {
+            m_ops.push_back({OP_DATETIME, (uint32_t)m_dates.size(), 0});
+            m_dates.push_back(DateFormat());
+            CompileDate(m_dates.back(), std::get<1>(v).empty() ? "%Y-%m-%d %H:%M:%S" : std::get<1>(v));
+        } else {
+            m_ops.push_back({(uint8_t)it->second, 0, 0});
+        }
     }
 }
 
 
-LoggerManager::LoggerManager() {
+LoggerManager::LoggerManager()
+    : m_loggers(new LoggerMap) {
     m_root.reset(new Logger);
+    init();
+}
+
+LoggerManager::~LoggerManager() {
+    delete m_loggers.load(std::memory_order_relaxed);
+}
+
+void LoggerManager::init() {
+    m_root->clearAppenders();
+    m_root->setLevel(LogLevel::DEBUG);
     m_root->addAppender(LogAppender::ptr(new StdoutLogAppender));
 }
 
 Logger::ptr LoggerManager::getLogger(const std::string& name) {
-    auto it = m_loggers.find(name);
-    return it == m_loggers.end() ? m_root : it->second;
+    if (name.empty() || name == m_root->getName()) {
+        return m_root;
+    }
+    {
+        RcuReadGuard guard;
+        const LoggerMap* loggers = m_loggers.load(std::memory_order_seq_cst);
+        auto it = loggers->find(name);
+        if (it != loggers->end()) {
+            return it->second;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const LoggerMap* old = m_loggers.load(std::memory_order_relaxed);
+    LoggerMap* loggers = new LoggerMap(*old);
+    Logger::ptr logger = create(name, *loggers);
+    m_loggers.store(loggers, std::memory_order_seq_cst);
+    Rcu::Retire(old);
+    return logger;
+}
+
+Logger::ptr LoggerManager::create(const std::string& name, LoggerMap& loggers) {
+    auto it = loggers.find(name);
+    if (it != loggers.end()) {
+        return it->second;
+    }
+    size_t pos = name.rfind('.');
+    Logger::ptr parent = (pos == std::string::npos || pos == 0)
+        ? m_root : create(name.substr(0, pos), loggers);
+    Logger::ptr logger(new Logger(name));
+    logger->m_parent = parent;
+    logger->setLevel(parent->getLevel());
+    loggers[name] = logger;
+    return logger;
 }
 
 Logger::ptr LoggerManager::getRoot() const {
@@ -10,12 +10,61 @@
 #include <vector>
 #include <stdarg.h>
 #include <map>
+#include <unordered_map>
+#include <functional>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <time.h>
+#include <unistd.h>
 #include "singleton.h"
+#include "ring_queue.h"
+#include "util.h"
+#include "rcu.h"
 
 
+/**
+ * 编译期日志级别下限 (对应 LogLevel::Level 的数值), 低于它的日志语句条件恒为假, 会被编译器整体删除.
+ * 例如 release 构建加 -DSYLAR_LOG_ACTIVE_LEVEL=2 去掉所有 DEBUG 日志; 运行期仍可用 Logger::setLevel 在此之上调整
+ */
+#ifndef SYLAR_LOG_ACTIVE_LEVEL
+#define SYLAR_LOG_ACTIVE_LEVEL 0
+#endif
+
+#define SYLAR_LOG_ENABLED(logger, level) \
+    ((int)(level) >= SYLAR_LOG_ACTIVE_LEVEL && logger->isEnabled(level))
+
 #define SYLAR_LOG_LEVEL(logger, level) \
-    if (logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, __FILE__, __LINE__, 0, syscall(SYS_gettid), 0, time(0)))).getSS()
+    if (SYLAR_LOG_ENABLED(logger, level)) \
+        sylar::LogEventWrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId()))
+
+/**
+ * 限流/采样版本, 在创建 LogEvent 之前判定, 被压制的调用只有几次原子操作的开销.
+ * 被压制的条数附加在下一条通过的日志末尾; 一直被压制时, 超过 LOG_THROTTLE_REPORT_NS 后
+ * 由第一次被压制的调用单独输出一条 "[suppressed N similar messages]".
+ * 每个调用点有自己的静态状态, rate/burst/n 需为常量表达式
+ */
+#define SYLAR_LOG_THROTTLE(logger, level, type, ...) \
+    if (SYLAR_LOG_ENABLED(logger, level)) \
+        if (sylar::LogThrottle sylar_throttle = []() -> type& { \
+                static type s_throttle(__VA_ARGS__); \
+                return s_throttle; \
+            }().tryAcquire().flush(logger, level, __FILE__, __LINE__)) \
+            sylar::LogEventWrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId()), \
+                                sylar_throttle.suppressed)
+
+// 每秒最多 rate 条, 允许突发 burst 条
+#define SYLAR_LOG_LIMIT(logger, level, rate, burst) \
+    SYLAR_LOG_THROTTLE(logger, level, sylar::LogRateLimiter, rate, burst)
+
+// 每 n 条输出 1 条
+#define SYLAR_LOG_SAMPLE(logger, level, n) \
+    SYLAR_LOG_THROTTLE(logger, level, sylar::LogSampler, n)
+
+#define SYLAR_LOG_ROOT() sylar::LoggerMgr::getInstance()->getRoot()
+#define SYLAR_LOG_NAME(name) sylar::LoggerMgr::getInstance()->getLogger(name)
 
 #define SYLAR_LOG_DEBUG(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::DEBUG)
 #define SYLAR_LOG_INFO(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::INFO)
@@ -23,9 +72,44 @@
 #define SYLAR_LOG_ERROR(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::ERROR)
 #define SYLAR_LOG_FATAL(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::FATAL)
 
+/**
+ * 日志器设置了 BinLogWriter 时走二进制日志: 只记录调用点 id 和原始参数, 格式化推迟到 sylar-logdecode.
+ * 格式串不是字符串字面量时每次可能不同, 不能按调用点登记, 仍然走文本日志
+ */
 #define SYLAR_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if (logger->getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, __FILE__, __LINE__, 0, syscall(SYS_gettid), 0, time(0)))).getEvent()->format(fmt, __VA_ARGS__)
+    do { \
+        if (SYLAR_LOG_ENABLED(logger, level)) { \
+            sylar::BinLogWriter* sylar_binlog = SYLAR_BINLOG_LITERAL(fmt) ? logger->getBinLog() : nullptr; \
+            if (sylar_binlog) { \
+                SYLAR_BINLOG_SITE(fmt); \
+                sylar_binlog->log(sylar_binlog_site, level, __VA_ARGS__); \
+            } else { \
+                sylar::LogEventWrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId())).getEvent()->format(fmt, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define SYLAR_LOG_FMT_LIMIT(logger, level, rate, burst, fmt, ...) \
+    do { \
+        if (SYLAR_LOG_ENABLED(logger, level)) { \
+            static sylar::LogRateLimiter sylar_limiter(rate, burst); \
+            if (sylar::LogThrottle sylar_throttle = sylar_limiter.tryAcquire().flush(logger, level, __FILE__, __LINE__)) { \
+                sylar::LogEventWrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId()), \
+                                    sylar_throttle.suppressed).getEvent()->format(fmt, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define SYLAR_LOG_FMT_SAMPLE(logger, level, n, fmt, ...) \
+    do { \
+        if (SYLAR_LOG_ENABLED(logger, level)) { \
+            static sylar::LogSampler sylar_sampler(n); \
+            if (sylar::LogThrottle sylar_throttle = sylar_sampler.tryAcquire().flush(logger, level, __FILE__, __LINE__)) { \
+                sylar::LogEventWrap(sylar::LogEvent::Create(logger, level, __FILE__, __LINE__, sylar::GetThreadId(), sylar::GetFiberId()), \
+                                    sylar_throttle.suppressed).getEvent()->format(fmt, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
 
 #define SYLAR_LOG_FMT_DEBUG(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define SYLAR_LOG_FMT_INFO(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -37,6 +121,7 @@
 namespace sylar {
 
 class Logger;
+class BinLogWriter;
 
 
 class LogLevel {
@@ -54,22 +139,129 @@ public:
 };
 
 
+/**
+ * 日志格式化缓冲区, 可重复使用; 内容不超过 INLINE_SIZE 时不分配堆内存
+ */
+class LogBuffer {
+public:
+    static const size_t INLINE_SIZE = 512;
+private:
+    char* m_data;
+    size_t m_size;
+    size_t m_capacity;
+    char m_inline[INLINE_SIZE];
+public:
+    LogBuffer();
+    ~LogBuffer();
+    LogBuffer(const LogBuffer&) = delete;
+    LogBuffer& operator=(const LogBuffer&) = delete;
+
+    void append(const char* data, size_t len) {
+        if (m_size + len > m_capacity) {
+            grow(m_size + len);
+        }
+        memcpy(m_data + m_size, data, len);
+        m_size += len;
+    }
+    void append(const char* str) { append(str, strlen(str)); }
+    void append(const std::string& str) { append(str.data(), str.size()); }
+    void append(char c) {
+        if (m_size == m_capacity) {
+            grow(m_size + 1);
+        }
+        m_data[m_size++] = c;
+    }
+    void appendUInt(uint64_t v);
+    void appendInt(int64_t v);
+
+    // 返回至少 n 字节的可写空间, 写完后用 commit 提交实际长度
+    char* reserve(size_t n) {
+        if (m_size + n > m_capacity) {
+            grow(m_size + n);
+        }
+        return m_data + m_size;
+    }
+    void commit(size_t n) { m_size += n; }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+    void clear() { m_size = 0; }
+    std::string toString() const { return std::string(m_data, m_size); }
+    // 释放超过 max 字节的堆内存, 避免偶尔的超长日志长期占用内存
+    void shrink(size_t max);
+private:
+    void grow(size_t need);
+};
+
+
+/**
+ * 把 std::ostream 的输出写入 LogBuffer
+ */
+class LogStreamBuf : public std::streambuf {
+private:
+    LogBuffer* m_buf;
+public:
+    LogStreamBuf(LogBuffer* buf) : m_buf(buf) {}
+    void setBuffer(LogBuffer* buf) { m_buf = buf; }
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            m_buf->append((char)c);
+        }
+        return c;
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        m_buf->append(s, n);
+        return n;
+    }
+};
+
+
+class LogEventPool;
+
+/**
+ * 结构化字段, 键和值的文本都存放在事件的字段缓冲区里, 这里只记位置.
+ * quoted 为 false 的值是数字或布尔, JSON 中原样输出
+ */
+struct LogField {
+    uint32_t keyOffset;
+    uint32_t valueOffset;
+    uint32_t valueLength;
+    uint16_t keyLength;
+    bool quoted;
+};
+
 class LogEvent {
 private:
     std::shared_ptr<Logger> m_logger;
-    LogLevel::Level m_level;
+    LogLevel::Level m_level = LogLevel::UNKNOW;
     const char* m_file = nullptr;
     int32_t m_line = 0;
     uint32_t m_elapse = 0;
     uint32_t m_threadId = 0;
     uint32_t m_fiberId = 0;
     uint64_t m_time = 0;
-    std::stringstream m_ss;
+    uint32_t m_nsec = 0;
+    LogBuffer m_buffer;
+    LogStreamBuf m_streambuf;
+    std::ostream m_ss;
+    // 前 INLINE_FIELDS 个字段放在事件内部, 更多的放进 m_moreFields; 事件回收复用, 容量保留
+    static const size_t INLINE_FIELDS = 8;
+    LogField m_fields[INLINE_FIELDS];
+    uint32_t m_fieldCount = 0;
+    std::vector<LogField> m_moreFields;
+    LogBuffer m_fieldText;
 public:
     typedef std::shared_ptr<LogEvent> ptr;
-    LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t time);
+    LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t time, uint32_t nsec = 0);
 
-    std::shared_ptr<Logger> getLogger() const;
+    // 从当前线程的事件池取一个事件, 最后一个引用释放后事件连同消息缓冲区一起回收;
+    // 时间取自高精度时钟, elapse 为进程启动以来的毫秒数 (单调时钟)
+    static LogEvent::ptr Create(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t threadId, uint32_t fiberId);
+
+    const std::shared_ptr<Logger>& getLogger() const;
     LogLevel::Level getLevel() const;
     const char* getFile() const;
     int32_t getLine() const;
@@ -77,21 +269,193 @@ public:
     uint32_t getThreadId() const;
     uint32_t getFiberId() const;
     uint64_t getTime() const;
+    // 秒以下的纳秒部分
+    uint32_t getNanoSecond() const;
     std::string getContent() const;
-    std::stringstream& getSS();
+    // 直接读取消息内容, 不拷贝
+    const LogBuffer& getMessage() const;
+    // 消息缓冲区, {} 格式化直接写入这里
+    LogBuffer& getBuffer() { return m_buffer; }
+    std::ostream& getSS();
     void format(const char* fmt, ...);
     void format(const char* fmt, va_list al);
+
+    /**
+     * 添加一个字段: beginField 写入键并返回字段缓冲区, 调用方把值的文本追加进去, 再调用 endField.
+     * 一般通过 LogEventWrap::kv 使用
+     */
+    LogBuffer& beginField(const char* key, size_t keyLength);
+    void endField(bool quoted);
+    size_t getFieldCount() const { return m_fieldCount; }
+    const LogField& getField(size_t i) const {
+        return i < INLINE_FIELDS ? m_fields[i] : m_moreFields[i - INLINE_FIELDS];
+    }
+    const char* getFieldKey(const LogField& f) const { return m_fieldText.data() + f.keyOffset; }
+    const char* getFieldValue(const LogField& f) const { return m_fieldText.data() + f.valueOffset; }
+    // 以 " k=v k2=v2" 的形式追加所有字段, 值含空格、引号或 '=' 时加引号转义
+    void appendFields(LogBuffer& buf) const;
+
+    // Create 改用粗粒度时钟, 时间精度降为一个时钟节拍 (通常 1~4ms)
+    static void SetCoarseClock(bool v);
+    static bool IsCoarseClock();
+private:
+    static std::atomic<bool> s_coarse_clock;
+
+    friend class LogEventPool;
+    LogEvent();
+    void reset(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file, int32_t line, uint32_t elapse, uint32_t threadId, uint32_t fiberId, uint64_t timeNs);
+    void recycle();
+};
+
+
+/**
+ * 限流/采样的判定结果
+ */
+struct LogThrottle {
+    bool pass;
+    uint64_t suppressed;    // 上一条通过或上次报告以来被压制的条数
+    bool report;            // 未通过, 但距上次输出已超过报告间隔, 需要单独报告压制条数
+
+    explicit operator bool() const { return pass; }
+
+    // report 为真时输出一条独立的 "[suppressed N similar messages]" 日志, 返回自身供宏判定
+    const LogThrottle& flush(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file, int32_t line) const {
+        if (report) {
+            writeReport(logger, level, file, line);
+        }
+        return *this;
+    }
+    void writeReport(const std::shared_ptr<Logger>& logger, LogLevel::Level level, const char* file, int32_t line) const;
+};
+
+// 一直被压制的调用点至少每隔这么久报告一次压制条数, 纳秒
+static const uint64_t LOG_THROTTLE_REPORT_NS = 1000000000ull;
+
+// 被压制时调用: 距上次输出超过报告间隔且有压制计数时, 抢到报告权的线程取走计数并单独报告
+inline LogThrottle LogThrottleReportDue(std::atomic<uint64_t>& lastReport, std::atomic<uint64_t>& suppressed, uint64_t now) {
+    uint64_t last = lastReport.load(std::memory_order_relaxed);
+    if (now < last + LOG_THROTTLE_REPORT_NS
+            || !lastReport.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+        return LogThrottle{false, 0, false};
+    }
+    uint64_t n = suppressed.exchange(0, std::memory_order_relaxed);
+    return LogThrottle{false, n, n > 0};
+}
+
+
+/**
+ * 调用点限流, GCRA 形式的令牌桶: 平均每秒 rate 条, 最多连续突发 burst 条.
+ * 状态只有一个理论到达时间, 通过时 CAS 一次, 被拒绝时只做一次读和一次计数
+ */
+class LogRateLimiter {
+private:
+    uint64_t m_interval;                // 每条日志占用的时间, 纳秒
+    uint64_t m_tolerance;               // 允许提前的时间 = 间隔 * (burst - 1)
+    std::atomic<uint64_t> m_tat;
+    std::atomic<uint64_t> m_suppressed;
+    std::atomic<uint64_t> m_lastReport;     // 上次输出 (通过或单独报告) 的时间
+public:
+    LogRateLimiter(uint32_t rate, uint32_t burst = 1)
+        : m_interval(1000000000ull / (rate ? rate : 1)),
+          m_tolerance(m_interval * (burst ? burst - 1 : 0)),
+          m_tat(0), m_suppressed(0), m_lastReport(GetCurrentCoarseNS()) {
+    }
+
+    LogThrottle tryAcquire() {
+        uint64_t now = GetCurrentCoarseNS();
+        uint64_t tat = m_tat.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t base = tat > now ? tat : now;
+            if (base - now > m_tolerance) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return LogThrottleReportDue(m_lastReport, m_suppressed, now);
+            }
+            if (m_tat.compare_exchange_weak(tat, base + m_interval, std::memory_order_relaxed)) {
+                m_lastReport.store(now, std::memory_order_relaxed);
+                return LogThrottle{true, m_suppressed.exchange(0, std::memory_order_relaxed), false};
+            }
+        }
+    }
+};
+
+
+/**
+ * 调用点采样: 每 n 条输出 1 条
+ */
+class LogSampler {
+private:
+    uint32_t m_n;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_suppressed;
+    std::atomic<uint64_t> m_lastReport;
+public:
+    LogSampler(uint32_t n)
+        : m_n(n ? n : 1), m_count(0), m_suppressed(0), m_lastReport(GetCurrentCoarseNS()) {
+    }
+
+    LogThrottle tryAcquire() {
+        uint64_t c = m_count.fetch_add(1, std::memory_order_relaxed);
+        if (c % m_n) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return LogThrottleReportDue(m_lastReport, m_suppressed, GetCurrentCoarseNS());
+        }
+        m_lastReport.store(GetCurrentCoarseNS(), std::memory_order_relaxed);
+        return LogThrottle{true, m_suppressed.exchange(0, std::memory_order_relaxed), false};
+    }
 };
 
 
 class LogEventWrap {
 private:
     LogEvent::ptr m_event;
+    uint64_t m_suppressed = 0;
 public:
     LogEventWrap(LogEvent::ptr e);
+    // suppressed > 0 时在消息末尾追加 "[suppressed N similar messages]"
+    LogEventWrap(LogEvent::ptr e, uint64_t suppressed);
     ~LogEventWrap();
-    LogEvent::ptr getEvent() const;
-    std::stringstream& getSS();
+    const LogEvent::ptr& getEvent() const;
+    std::ostream& getSS();
+
+    // 日志宏返回 LogEventWrap 本身, 既可以流式输出消息, 也可以附加字段:
+    //   SYLAR_LOG_INFO(logger).kv("user", id).kv("lat_us", t) << "login";
+    template<class T>
+    LogEventWrap& operator<<(const T& v) {
+        m_event->getSS() << v;
+        return *this;
+    }
+    LogEventWrap& operator<<(std::ostream& (*manip)(std::ostream&)) {
+        m_event->getSS() << manip;
+        return *this;
+    }
+    LogEventWrap& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
+        m_event->getSS() << manip;
+        return *this;
+    }
+
+    // 值的格式与 {} 格式化相同, 定义在 format.h
+    template<class T>
+    LogEventWrap& kv(const char* key, const T& value);
+    template<class T>
+    LogEventWrap& kv(const std::string& key, const T& value);
+};
+
+
+/**
+ * 未格式化的日志记录, 各字段由调用方提供, 供 LogFormatter::formatSafe 使用
+ */
+struct LogRecordView {
+    const char* name;
+    LogLevel::Level level;
+    const char* file;
+    int32_t line;
+    uint32_t elapse;
+    uint32_t threadId;
+    uint32_t fiberId;
+    uint64_t time;
+    uint32_t nsec;
+    const char* message;
+    size_t length;
 };
 
 
@@ -103,30 +467,90 @@ public:
         virtual ~FormatItem() {}
         virtual void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
     };
+    typedef std::function<FormatItem::ptr(const std::string& fmt)> ItemCreator;
+
+    /**
+     * %d{...} 的日期格式, 在 strftime 语法之外支持亚秒字段:
+     * %L 毫秒, %N 纳秒, %3N/%6N/%9N 分别为 3/6/9 位小数
+     * 每个线程按秒缓存渲染结果, 同一秒内只需拷贝并填入亚秒数字
+     */
+    struct DateFormat {
+        struct Part {
+            std::string strf;   // 交给 strftime 的片段
+            int digits;         // 片段之后的亚秒位数, 0 表示没有
+        };
+        uint64_t id;
+        std::vector<Part> parts;
+    };
 private:
+    // 内置格式项被编译成操作码, 格式化时直接写入缓冲区, 只有自定义项走虚函数
+    enum OpCode {
+        OP_STRING = 0,
+        OP_MESSAGE,
+        OP_LEVEL,
+        OP_ELAPSE,
+        OP_NAME,
+        OP_THREAD_ID,
+        OP_FIBER_ID,
+        OP_DATETIME,
+        OP_FILENAME,
+        OP_LINE,
+        OP_NEWLINE,
+        OP_TAB,
+        OP_CUSTOM,
+    };
+
+    struct Op {
+        uint8_t code;
+        uint32_t offset;    // OP_STRING: 在 m_text 中的位置; OP_DATETIME: m_dates 下标; OP_CUSTOM: m_custom 下标
+        uint32_t length;
+    };
+
     std::string m_pattern;
-    std::vector<FormatItem::ptr> m_items;
+    std::vector<Op> m_ops;
+    std::string m_text;
+    std::vector<DateFormat> m_dates;
+    std::vector<FormatItem::ptr> m_custom;
 public:
     typedef std::shared_ptr<LogFormatter> ptr;
 
     LogFormatter(const std::string& pattern);
+    virtual ~LogFormatter() {}
     std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    // 追加到调用方提供的缓冲区, 内置格式项不会分配内存; 消息之后以 " k=v" 追加结构化字段
+    virtual void format(LogBuffer& buf, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
+
+    /**
+     * 异步信号安全的格式化, 可以在信号处理函数里调用: 不分配内存也不加锁, 结果截断到 size 字节, 返回写入长度.
+     * 日期按固定的时区偏移 tzOffset (秒) 计算, 只支持数字类的 strftime 字段; 自定义格式项不输出
+     */
+    size_t formatSafe(char* buf, size_t size, const LogRecordView& rec, long tzOffset) const;
+
+    const std::string& getPattern() const;
+
+    // 注册自定义格式项 %name, 对之后创建的 LogFormatter 生效
+    static void RegisterItem(const std::string& name, ItemCreator creator);
+protected:
+    static void CompileDate(DateFormat& df, const std::string& fmt);
+    static void FormatDate(LogBuffer& buf, const DateFormat& df, uint64_t sec, uint32_t nsec);
 private:
     void init();
+    void addText(const std::string& str);
 };
 
 
 class LogAppender {
 protected:
-    LogLevel::Level m_level = LogLevel::DEBUG;
+    std::atomic<LogLevel::Level> m_level{LogLevel::DEBUG};
     LogFormatter::ptr m_formatter;
 public:
     typedef std::shared_ptr<LogAppender> ptr;
     virtual ~LogAppender() {}
 
     virtual void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
+    virtual void flush() {}
 
-    void setFormatter(LogFormatter::ptr formatter);
+    virtual void setFormatter(LogFormatter::ptr formatter);
     LogFormatter::ptr getFormatter() const;
     void setLevel(LogLevel::Level level);
     LogLevel::Level getLevel() const;
@@ -134,15 +558,25 @@ public:
 
 
 class Logger : public std::enable_shared_from_this<Logger> {
+friend class LoggerManager;
+public:
+    typedef std::shared_ptr<Logger> ptr;
+    typedef std::vector<LogAppender::ptr> AppenderList;
 private:
     std::string m_name;
-    LogLevel::Level m_level;
-    std::list<LogAppender::ptr> m_appenders;
+    std::atomic<LogLevel::Level> m_level;
+    // 写时复制的 appender 列表, 读者在 RCU 临界区内无锁遍历, 修改时发布新列表并延迟释放旧列表
+    std::atomic<const AppenderList*> m_appenders;
+    // 没有自己的 appender 时交给上级日志器的 appender 输出 (a.b.c -> a.b -> a -> root)
+    Logger::ptr m_parent;
     LogFormatter::ptr m_formatter;
+    std::mutex m_mutex;
+    std::atomic<BinLogWriter*> m_binlog;
+    // 换下来的 BinLogWriter 可能还有线程在用, 保留到 Logger 析构
+    std::vector<std::shared_ptr<BinLogWriter>> m_binlogs;
 public:
-    typedef std::shared_ptr<Logger> ptr;
-    
     Logger(const std::string& name = "root");
+    ~Logger();
     void log(LogLevel::Level level, LogEvent::ptr event);
 
     void debug(LogEvent::ptr event);
@@ -153,47 +587,402 @@ public:
 
     void addAppender(LogAppender::ptr appender);
     void delAppender(LogAppender::ptr appender);
+    void clearAppenders();
+    // 当前 appender 列表的副本
+    AppenderList getAppenders() const;
+    const Logger::ptr& getParent() const { return m_parent; }
     LogLevel::Level getLevel() const;
     void setLevel(LogLevel::Level level);
     const std::string& getName() const;
+
+    // 设置后该日志器进入二进制模式: FMT 宏写调用点+参数, 其余事件以文本记录写入, 不再经过 appender
+    void setBinLog(std::shared_ptr<BinLogWriter> writer);
+    BinLogWriter* getBinLog() const {
+        return m_binlog.load(std::memory_order_acquire);
+    }
+
+    // 日志宏的运行期级别判断, 一次 relaxed 原子读, 可以和 setLevel 并发
+    bool isEnabled(LogLevel::Level level) const {
+        return level >= m_level.load(std::memory_order_relaxed);
+    }
 };
 
 
+/**
+ * 标准输出/标准错误日志输出器: 直接写 fd, 不经过 std::cout.
+ * 默认在调用线程同步写入, fork 出的子进程和紧接着 abort 的 FATAL 日志都不会丢.
+ * 非阻塞模式下调用线程把格式化结果追加到共享缓冲区, 后台线程整块换出后批量写入;
+ * 积压超过 maxBacklog 字节时丢弃并计数, 采集端再慢也不会卡住业务线程, 丢弃的条数会在恢复后以一行提示写出.
+ * 非阻塞模式下 FATAL 日志会等待写出后才返回, 最多等 FATAL_WAIT_MS 毫秒; 其他级别从不等待.
+ * fork 后子进程里没有后台线程, 子进程中的输出器自动切换为同步写入.
+ * fd 是管道或 socket 时每次写入不超过 PIPE_BUF 字节且在行尾切分, 不超过 PIPE_BUF 的行不会和其他进程的输出交错
+ */
 class StdoutLogAppender : public LogAppender {
 public:
     typedef std::shared_ptr<StdoutLogAppender> ptr;
+    static const int FATAL_WAIT_MS = 1000;
+private:
+    int m_fd;
+    bool m_nonBlocking;
+    size_t m_maxBacklog;
+    bool m_atomicLines;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;         // 唤醒后台线程
+    std::condition_variable m_doneCond;     // 通知 flush 和等待积压下降的调用线程
+    std::string m_current;
+    uint64_t m_appended = 0;                // 累计追加的字节数
+    uint64_t m_written = 0;                 // 累计写出的字节数
+    uint64_t m_dropped = 0;
+    uint64_t m_reported = 0;                // 已经提示过的丢弃条数
+    bool m_sleeping = false;
+    bool m_stop = false;                    // 没有后台线程, 同步写入
+    std::unique_ptr<std::thread> m_thread;
+public:
+    StdoutLogAppender(int fd = STDOUT_FILENO, bool nonBlocking = false, size_t maxBacklog = 4 * 1024 * 1024);
+    ~StdoutLogAppender();
 
     void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    // 等待调用之前的日志全部写出
+    void flush() override;
+    // 写完剩余日志并结束后台线程, 之后的日志同步写入
+    void stop();
+
+    uint64_t getDropCount();
+private:
+    void run();
+    // fork 前后加锁/解锁, 子进程中丢掉后台线程改为同步写入
+    static void ForkPrepare();
+    static void ForkParent();
+    static void ForkChild();
+    void write(const char* data, size_t len);
 };
 
 
+/**
+ * 文件日志输出器 (双缓冲): 调用线程把格式化结果追加到当前缓冲区,
+ * 写满或到达刷新条件时交给后台线程, 后台线程用 writev 批量写入文件
+ */
 class FileLogAppender : public LogAppender {
-private:
-    std::string m_filename;
-    std::ofstream m_filestream;
 public:
     typedef std::shared_ptr<FileLogAppender> ptr;
 
+    enum FsyncPolicy {
+        FSYNC_NONE = 0,         // 只写入内核, 由操作系统决定何时落盘
+        FSYNC_PERIODIC = 1,     // 距上次 fsync 超过间隔时同步一次
+        FSYNC_EVERY_BATCH = 2,  // 每批写入后同步
+    };
+
+    enum RollPeriod {
+        ROLL_NONE = 0,
+        ROLL_HOURLY = 1,        // 跨过整点时切换文件
+        ROLL_DAILY = 2,         // 跨过零点时切换文件
+    };
+private:
+    typedef std::vector<std::string> BufferList;
+
+    std::string m_filename;
+    int m_fd = -1;
+    std::mutex m_fdMutex;       // 保护 m_fd, 后台写入和 reopen 互斥
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_doneCond;
+    std::string m_current;      // 前端正在追加的缓冲区
+    BufferList m_full;          // 等待写入的缓冲区
+    BufferList m_spare;         // 写完回收的缓冲区
+    bool m_urgent = false;
+    uint64_t m_flushReq = 0;
+    uint64_t m_flushDone = 0;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    size_t m_flushBytes = 64 * 1024;
+    uint64_t m_flushIntervalMs = 1000;
+    LogLevel::Level m_flushLevel = LogLevel::ERROR;
+    FsyncPolicy m_fsyncPolicy = FSYNC_NONE;
+    uint64_t m_fsyncIntervalMs = 1000;
+
+    // 滚动状态, 由 m_fdMutex 保护, 只在后台线程中切换文件
+    uint64_t m_fileSize = 0;
+    uint64_t m_maxSize = 0;
+    RollPeriod m_rollPeriod = ROLL_NONE;
+    time_t m_nextRollTime = 0;
+    int m_nextFd = -1;          // 预先创建好的下一个文件 (filename.next)
+
+    // 切下来的旧文件交给归档线程压缩和清理
+    std::mutex m_archiveMutex;
+    std::condition_variable m_archiveCond;
+    std::list<std::string> m_archiveQueue;
+    size_t m_maxFiles = 0;
+    bool m_compress = false;
+    bool m_archiveStop = false;
+    std::thread m_archiveThread;
+public:
     FileLogAppender(const std::string& filename);
+    ~FileLogAppender();
+
     void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    // 写出调用之前的所有日志, fsync 策略不是 FSYNC_NONE 时同时落盘
+    void flush() override;
+    // 写完剩余日志并结束后台线程, 之后的日志同步写入
+    void stop();
 
+    // 重新打开文件 (配合 logrotate 之类的外部切割)
     bool reopen();
+
+    // 当前缓冲区累计超过 bytes 字节时交给后台线程写入
+    void setFlushBytes(size_t bytes);
+    // 后台线程至少每隔 ms 毫秒写一次
+    void setFlushInterval(uint64_t ms);
+    // 不低于 level 的日志立即唤醒后台线程写入
+    void setFlushLevel(LogLevel::Level level);
+    void setFsyncPolicy(FsyncPolicy policy, uint64_t intervalMs = 1000);
+
+    /**
+     * 滚动策略: 文件超过 maxSize 字节 (0 不限制) 或跨过 period 边界时切换到新文件,
+     * 旧文件改名为 filename.年月日-时分秒, 最多保留 maxFiles 个 (0 不限制), compress 为 true 时压缩成 .gz
+     */
+    void setRolling(uint64_t maxSize, RollPeriod period = ROLL_NONE, size_t maxFiles = 0, bool compress = false);
+
+    const std::string& getFilename() const { return m_filename; }
+private:
+    void run();
+    size_t writeBuffers(const BufferList& buffers);
+    bool isRolling() const { return m_maxSize || m_rollPeriod != ROLL_NONE; }
+    void rollIfNeeded(size_t incoming);
+    void prepareNext();
+    void archiveLoop();
+};
+
+
+/**
+ * 内存映射文件日志输出器: 日志直接拷贝进预先分配并映射好的段文件 filename.000001, filename.000002 ...,
+ * 写入位置由原子游标推进, 不需要 write 系统调用; 进程崩溃时已写入的内容仍在页缓存中.
+ * 当前段写满时切换到后台线程提前映射好的下一段, 正常退出时把最后一段截断到实际长度
+ */
+class MmapFileLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<MmapFileLogAppender> ptr;
+private:
+    struct Segment {
+        std::string path;
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+        std::atomic<uint64_t> cursor{0};    // 下一次分配的位置, 写满后会超过 size
+        std::atomic<int> writers{0};        // 正在访问映射内存的线程数
+        uint64_t end = UINT64_MAX;          // 有效数据长度, 切换时确定
+    };
+
+    std::string m_filename;
+    size_t m_segmentSize;
+    uint32_t m_index = 0;                   // 最近一个段的序号
+    std::atomic<Segment*> m_current;
+    std::atomic<uint64_t> m_dropped;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;         // 唤醒后台线程
+    std::condition_variable m_nextCond;     // 下一段已映射好
+    Segment* m_next = nullptr;
+    std::vector<Segment*> m_retired;        // 等待写入结束后截断和解除映射
+    std::vector<Segment*> m_free;
+    // Segment 结构体可能还被刚读到旧指针的线程访问, 只回收复用, 析构时才释放
+    std::vector<std::unique_ptr<Segment> > m_segments;
+    bool m_stop = false;
+    std::thread m_thread;
+public:
+    MmapFileLogAppender(const std::string& filename, size_t segmentSize = 64 * 1024 * 1024);
+    ~MmapFileLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    // 把当前段已写入的内容同步到磁盘
+    void flush() override;
+    // 截断并关闭所有段, 之后的日志被丢弃
+    void stop();
+
+    // 没有可用的段 (映射失败或已停止) 而丢弃的日志条数
+    uint64_t getDropCount() const { return m_dropped.load(std::memory_order_relaxed); }
+private:
+    // 进入当前段, 返回 nullptr 表示没有可用的段
+    Segment* enter();
+    void switchSegment(Segment* seg);
+    bool openSegment(Segment* seg, uint32_t index);
+    void closeSegment(Segment* seg, uint64_t end);
+    void run();
+};
+
+
+/**
+ * 异步日志输出器: 调用线程只把事件放进无锁有界队列,
+ * 由后台线程调用被包装的 appender 完成格式化和写入
+ */
+class AsyncLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+
+    enum OverflowPolicy {
+        BLOCK = 0,          // 队列满时阻塞, 直到后台线程腾出空位
+        DROP_NEWEST = 1,    // 丢弃当前事件
+        DROP_OLDEST = 2,    // 丢弃队列中最旧的事件
+    };
+private:
+    struct Item {
+        Logger::ptr logger;
+        LogLevel::Level level = LogLevel::UNKNOW;
+        LogEvent::ptr event;
+    };
+
+    LogAppender::ptr m_appender;
+    OverflowPolicy m_policy;
+    RingQueue<Item> m_queue;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;         // 唤醒后台线程
+    std::condition_variable m_doneCond;     // 通知 flush 和阻塞中的生产者
+    std::atomic<bool> m_sleeping;
+    std::atomic<bool> m_stop;
+    std::atomic<int> m_waiters;
+    std::atomic<int> m_producers;           // 正在 log() 里的线程数, 后台线程退出前等它归零
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_flushReq;
+    uint64_t m_flushDone = 0;
+public:
+    AsyncLogAppender(LogAppender::ptr appender, size_t capacity = 8192, OverflowPolicy policy = BLOCK);
+    ~AsyncLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    // 等待调用之前提交的事件全部写出, 并 flush 被包装的 appender
+    void flush() override;
+    void setFormatter(LogFormatter::ptr formatter) override;
+    // 写完队列中剩余的事件并结束后台线程, 之后的事件同步写入
+    void stop();
+
+    uint64_t getDropCount() const;
+    size_t getQueueSize() const;
+    OverflowPolicy getPolicy() const;
+private:
+    void run();
+    void wakeup();
+    size_t drain();
 };
 
 
+/**
+ * 飞行记录器: 每个线程一个固定大小的环形缓冲区, 只保存最近 N 条未格式化的事件 (消息超长时截断),
+ * 平时不做格式化和 I/O, 可以一直挂在 DEBUG 级别上. 记录到 FATAL, 或者安装了 InstallCrashHandler
+ * 后进程收到致命信号时, 按 formatter 的格式把各线程缓冲区里还没输出过的事件写到 fd,
+ * 输出过程只使用异步信号安全的调用
+ */
+class FlightRecorderAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<FlightRecorderAppender> ptr;
+    static const size_t NAME_SIZE = 32;
+private:
+    struct Record {
+        uint64_t time;
+        uint32_t nsec;
+        uint32_t elapse;
+        uint32_t threadId;
+        uint32_t fiberId;
+        const char* file;
+        int32_t line;
+        uint16_t level;
+        uint16_t length;
+        char name[NAME_SIZE];
+        // 之后紧跟 m_messageSize 字节的消息
+    };
+
+    struct Ring {
+        std::unique_ptr<char[]> data;
+        std::atomic<uint64_t> head{0};      // 下一条的序号, 只有所属线程写
+        uint64_t dumped = 0;                // 已经输出到这里, 只有 dump 访问
+        uint32_t threadId = 0;
+        std::atomic<bool> inUse{true};      // 所属线程退出后可以交给新线程
+        Ring* next = nullptr;
+    };
+
+    // 当前线程在各记录器上的环, 按记录器 id 下标
+    struct ThreadRings {
+        std::vector<std::shared_ptr<Ring>> rings;
+        ~ThreadRings();
+    };
+    static thread_local ThreadRings t_rings;
+
+    uint32_t m_id;
+    size_t m_capacity;                      // 每个线程的条数, 2 的幂
+    size_t m_messageSize;
+    size_t m_stride;
+    int m_fd;
+    bool m_ownFd;
+    long m_tzOffset;
+    // 信号处理函数只沿链表读, 链表只增不减; 所有权在 m_owners
+    std::atomic<Ring*> m_rings;
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<Ring>> m_owners;
+    std::atomic<bool> m_dumping;
+    std::unique_ptr<char[]> m_line;         // dump 用的行缓冲区, 预先分配
+    size_t m_lineSize;
+public:
+    /**
+     * eventsPerThread 向上取到 2 的幂, 消息超过 messageSize 字节截断;
+     * dumpPath 为空时输出到标准错误
+     */
+    FlightRecorderAppender(size_t eventsPerThread = 1024, size_t messageSize = 256, const std::string& dumpPath = "");
+    ~FlightRecorderAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+    // 输出所有线程上次 dump 之后的事件, 异步信号安全; 已经有线程在输出时直接返回
+    void dump();
+
+    /**
+     * 为 SIGSEGV SIGABRT SIGBUS SIGFPE SIGILL 安装处理函数: 依次 dump 所有存活的飞行记录器,
+     * 然后恢复原来的处理方式重新触发信号. 重复调用只安装一次
+     */
+    static void InstallCrashHandler();
+    static void DumpAll();
+private:
+    Ring* getRing();
+    Ring* acquireRing();
+    Record* at(Ring* ring, uint64_t seq) const {
+        return (Record*)(ring->data.get() + (seq & (m_capacity - 1)) * m_stride);
+    }
+};
+
+
+/**
+ * 日志器注册表. 名字按 '.' 分级, getLogger("a.b.c") 会依次创建 a, a.b, a.b.c,
+ * 新日志器继承上级的级别, 没有 appender 时使用上级的 appender.
+ * 已发布的名字表只读, 查找在 RCU 临界区内进行不加锁; 创建时在锁内复制一份新表再发布
+ */
 class LoggerManager {
+public:
+    typedef std::unordered_map<std::string, Logger::ptr> LoggerMap;
 private:
-    std::map<std::string, Logger::ptr> m_loggers;
+    std::mutex m_mutex;
+    std::atomic<const LoggerMap*> m_loggers;
     Logger::ptr m_root;
 public:
     LoggerManager();
+    ~LoggerManager();
+    // name 为空或 "root" 时返回 root, 不存在时创建
     Logger::ptr getLogger(const std::string& name);
     Logger::ptr getRoot() const;
+    // 把 root 恢复为默认配置: DEBUG 级别, 只输出到标准输出
     void init();
+private:
+    Logger::ptr create(const std::string& name, LoggerMap& loggers);
 };
 
 typedef sylar::Singleton<LoggerManager> LoggerMgr;
 
 }
 
+#include "binlog.h"
+#include "format.h"
+#include "scope_timer.h"
+#include "socket_appender.h"
+#include "json_formatter.h"
+
 #endif
@@ -0,0 +1,119 @@
+#include "rcu.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+
+namespace sylar {
+
+namespace {
+
+struct RcuRecord {
+    std::atomic<uint64_t> epoch{0};     // 0 表示不在读临界区
+    std::atomic<bool> inUse{true};
+    RcuRecord* next = nullptr;
+};
+
+// 初始为 1, 读者登记的 epoch 总是非 0
+std::atomic<uint64_t> s_epoch{1};
+// 只增不减的记录链表, 线程退出后记录留给新线程复用
+std::atomic<RcuRecord*> s_records{nullptr};
+
+std::mutex& GetRetireMutex() {
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+std::vector<std::function<void()> >& GetDeferred() {
+    static std::vector<std::function<void()> > s_deferred;
+    return s_deferred;
+}
+
+RcuRecord* AcquireRecord() {
+    for (RcuRecord* rec = s_records.load(std::memory_order_acquire); rec; rec = rec->next) {
+        bool expected = false;
+        if (!rec->inUse.load(std::memory_order_relaxed)
+                && rec->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return rec;
+        }
+    }
+    RcuRecord* rec = new RcuRecord;
+    RcuRecord* head = s_records.load(std::memory_order_relaxed);
+    do {
+        rec->next = head;
+    } while (!s_records.compare_exchange_weak(head, rec, std::memory_order_release, std::memory_order_relaxed));
+    return rec;
+}
+
+struct ThreadRecord {
+    RcuRecord* rec = nullptr;
+    uint32_t nesting = 0;
+
+    ~ThreadRecord() {
+        if (rec) {
+            rec->epoch.store(0, std::memory_order_release);
+            rec->inUse.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadRecord t_record;
+
+}
+
+void Rcu::ReadLock() {
+    ThreadRecord& tr = t_record;
+    if (tr.nesting++ == 0) {
+        if (!tr.rec) {
+            tr.rec = AcquireRecord();
+        }
+        // seq_cst: 登记必须先于之后对受保护指针的读取被写者看到
+        tr.rec->epoch.store(s_epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+    }
+}
+
+void Rcu::ReadUnlock() {
+    ThreadRecord& tr = t_record;
+    if (--tr.nesting == 0) {
+        tr.rec->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void Rcu::Synchronize() {
+    RcuRecord* self = t_record.nesting ? t_record.rec : nullptr;
+    uint64_t epoch = s_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    for (RcuRecord* rec = s_records.load(std::memory_order_acquire); rec; rec = rec->next) {
+        if (rec == self) {
+            continue;
+        }
+        while (true) {
+            uint64_t e = rec->epoch.load(std::memory_order_seq_cst);
+            if (e == 0 || e >= epoch) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Rcu::Retire(std::function<void()> fn) {
+    if (t_record.nesting) {
+        std::lock_guard<std::mutex> lock(GetRetireMutex());
+        GetDeferred().push_back(std::move(fn));
+        return;
+    }
+    std::vector<std::function<void()> > deferred;
+    {
+        std::lock_guard<std::mutex> lock(GetRetireMutex());
+        deferred.swap(GetDeferred());
+    }
+    Synchronize();
+    fn();
+    for (auto& f : deferred) {
+        f();
+    }
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef _SYLAR_RCU_H_
+#define _SYLAR_RCU_H_
+
+#include <functional>
+
+
+namespace sylar {
+
+/**
+ * 基于 epoch 的 RCU
+ * 读者进入临界区时在线程私有记录里登记当前 epoch, 不加锁, 可以嵌套;
+ * 写者发布新版本后调用 Synchronize 推进 epoch, 等待所有在旧 epoch 进入的读者退出, 之后旧版本可以释放.
+ * 被保护的指针需要用 seq_cst 读取 (x86 上就是普通的 mov)
+ */
+class Rcu {
+public:
+    static void ReadLock();
+    static void ReadUnlock();
+
+    // 等待此前进入的读者全部退出; 在读临界区内调用时忽略当前线程自己
+    static void Synchronize();
+
+    // 宽限期结束后执行 fn (一般是释放旧版本); 在读临界区内调用时推迟到下一次 Retire
+    static void Retire(std::function<void()> fn);
+
+    template<class T>
+    static void Retire(const T* p) {
+        if (p) {
+            Retire([p]() { delete p; });
+        }
+    }
+};
+
+
+class RcuReadGuard {
+public:
+    RcuReadGuard() { Rcu::ReadLock(); }
+    ~RcuReadGuard() { Rcu::ReadUnlock(); }
+
+    RcuReadGuard(const RcuReadGuard&) = delete;
+    RcuReadGuard& operator=(const RcuReadGuard&) = delete;
+};
+
+}
+
+#endif
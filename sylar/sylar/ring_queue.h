@@ -0,0 +1,125 @@
+#ifndef _SYLAR_RING_QUEUE_H_
+#define _SYLAR_RING_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <new>
+#include <utility>
+
+
+namespace sylar {
+
+/**
+ * 有界无锁多生产者队列 (Dmitry Vyukov 的 bounded MPMC 算法)
+ * 每个槽位带一个序号, 生产者/消费者只在 head/tail 上做一次 CAS,
+ * 容量会被向上取整为 2 的幂
+ */
+template<class T>
+class RingQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    static const size_t CACHELINE = 64;
+
+    Cell* m_cells;
+    size_t m_mask;
+    char m_pad0[CACHELINE];
+    std::atomic<size_t> m_tail;     // 生产者写入位置
+    char m_pad1[CACHELINE];
+    std::atomic<size_t> m_head;     // 消费者读取位置
+    char m_pad2[CACHELINE];
+public:
+    RingQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_cells = new Cell[size];
+        for (size_t i = 0; i < size; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_tail.store(0, std::memory_order_relaxed);
+        m_head.store(0, std::memory_order_relaxed);
+    }
+
+    ~RingQueue() {
+        T tmp;
+        while (tryPop(tmp)) {
+        }
+        delete[] m_cells;
+    }
+
+    RingQueue(const RingQueue&) = delete;
+    RingQueue& operator=(const RingQueue&) = delete;
+
+    template<class U>
+    bool tryPush(U&& value) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;   // 队列已满
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (&cell->storage) T(std::forward<U>(value));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;   // 队列为空
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        T* p = reinterpret_cast<T*>(&cell->storage);
+        value = std::move(*p);
+        p->~T();
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return m_mask + 1;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "scheduler.h"
+#include "log.h"
+#include "hook.h"
+#include <assert.h>
+
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+namespace {
+
+thread_local Scheduler* t_scheduler = nullptr;
+thread_local Fiber* t_scheduler_fiber = nullptr;
+
+}
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name, bool hook)
+    : m_name(name), m_hook(hook) {
+    assert(threads > 0);
+    if (use_caller) {
+        Fiber::GetThis();
+        --threads;
+        assert(GetThis() == nullptr);
+        t_scheduler = this;
+        m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this)));
+        m_rootThread = GetThreadId();
+        m_threadIds.push_back(m_rootThread);
+    }
+    m_threadCount = threads;
+}
+
+Scheduler::~Scheduler() {
+    assert(m_stopping);
+    if (GetThis() == this) {
+        t_scheduler = nullptr;
+    }
+}
+
+Scheduler* Scheduler::GetThis() {
+    return t_scheduler;
+}
+
+Fiber* Scheduler::GetMainFiber() {
+    return t_scheduler_fiber;
+}
+
+void Scheduler::setThis() {
+    t_scheduler = this;
+}
+
+void Scheduler::start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_stopping) {
+        return;
+    }
+    m_stopping = false;
+    assert(m_threads.empty());
+    for (size_t i = 0; i < m_threadCount; ++i) {
+        m_threads.emplace_back(&Scheduler::run, this);
+    }
+}
+
+void Scheduler::stop() {
+    if (m_rootFiber) {
+        assert(GetThis() == this);
+    } else {
+        assert(GetThis() != this);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    for (size_t i = 0; i < m_threadCount; ++i) {
+        tickle();
+    }
+    if (m_rootFiber) {
+        tickle();
+        if (m_rootFiber->getState() == Fiber::INIT) {
+            m_rootFiber->resume();
+        }
+    }
+
+    for (auto& t : m_threads) {
+        t.join();
+    }
+    m_threads.clear();
+}
+
+bool Scheduler::hasTaskFor(pid_t thread) const {
+    for (auto& t : m_tasks) {
+        if (t.thread == -1 || t.thread == thread) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::tickle() {
+    // 有指定线程的任务时被唤醒的必须是那个线程, 所以全部唤醒
+    m_cond.notify_all();
+}
+
+void Scheduler::idle() {
+    pid_t me = GetThreadId();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this, me]() {
+        return hasTaskFor(me) || (m_stopping && m_tasks.empty() && m_activeThreadCount == 0);
+    });
+}
+
+bool Scheduler::stopping() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+}
+
+void Scheduler::run() {
+    // use_caller 时调用线程在 stop() 里运行调度循环, 结束后恢复它原来的设置
+    bool hooked = is_hook_enable();
+    if (m_hook) {
+        set_hook_enable(true);
+    }
+    setThis();
+    t_scheduler_fiber = Fiber::GetThis().get();
+    pid_t me = GetThreadId();
+    if (me != m_rootThread) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_threadIds.push_back(me);
+    }
+
+    Fiber::ptr cb_fiber;
+    while (true) {
+        Task task;
+        bool tickle_me = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+                if (it->thread != -1 && it->thread != me) {
+                    tickle_me = true;
+                    continue;
+                }
+                task = std::move(*it);
+                m_tasks.erase(it);
+                ++m_activeThreadCount;
+                break;
+            }
+            if (task.fiber || task.cb) {
+                tickle_me = tickle_me || !m_tasks.empty();
+            } else {
+                // 在锁内登记空闲, schedule() 据此决定是否 tickle, 不会漏掉唤醒
+                ++m_idleThreadCount;
+            }
+        }
+        if (tickle_me && hasIdleThreads()) {
+            tickle();
+        }
+
+        if (task.fiber) {
+            Fiber::State state = task.fiber->resume();
+            if (state == Fiber::READY) {
+                schedule(std::move(task.fiber));
+            }
+        } else if (task.cb) {
+            if (cb_fiber) {
+                cb_fiber->reset(std::move(task.cb));
+            } else {
+                cb_fiber.reset(new Fiber(std::move(task.cb)));
+            }
+            Fiber::State state = cb_fiber->resume();
+            if (state == Fiber::READY) {
+                schedule(std::move(cb_fiber));
+                cb_fiber.reset();
+            } else if (state == Fiber::HOLD) {
+                // 由持有者负责再次调度, 下一个回调用新的协程
+                cb_fiber.reset();
+            }
+        } else {
+            if (stopping()) {
+                --m_idleThreadCount;
+                // 让下一个空闲线程也醒来检查是否可以退出
+                tickle();
+                break;
+            }
+            idle();
+            --m_idleThreadCount;
+            continue;
+        }
+
+        bool stop = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_activeThreadCount;
+            stop = m_stopping;
+        }
+        if (stop) {
+            // 可能是最后一个任务, 让在等待的线程重新检查是否可以退出
+            tickle();
+        }
+    }
+    set_hook_enable(hooked);
+    SYLAR_LOG_DEBUG(g_logger) << "scheduler " << m_name << " thread " << me << " exit";
+}
+
+}
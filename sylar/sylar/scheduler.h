@@ -0,0 +1,126 @@
+#ifndef _SYLAR_SCHEDULER_H_
+#define _SYLAR_SCHEDULER_H_
+
+#include "fiber.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+
+namespace sylar {
+
+/**
+ * N 个线程运行 M 个协程的调度器. 任务是协程或回调, 放在一个共享队列里, 空闲的线程取出来切进去运行:
+ *   协程 YieldToReady 后马上重新排队, YieldToHold 后要由别人再 schedule 一次;
+ *   回调在线程复用的协程里运行, 结束后栈留给下一个回调.
+ * use_caller 为 true 时构造调度器的线程也算一个工作线程, 它在 stop() 里参与调度直到任务全部完成.
+ * 没有任务时线程在 idle() 里等待, 子类 (IOManager) 可以改成等待 IO 事件.
+ * hook 为 true 时调度线程上打开 hook (见 hook.h), 阻塞的 socket 调用和 sleep 只挂起协程
+ */
+class Scheduler {
+public:
+    typedef std::shared_ptr<Scheduler> ptr;
+
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "", bool hook = false);
+    virtual ~Scheduler();
+
+    const std::string& getName() const { return m_name; }
+    bool isHookEnable() const { return m_hook; }
+
+    void start();
+    // 等队列里的任务和正在运行的协程全部结束后返回
+    void stop();
+
+    /**
+     * 添加任务, fc 为 Fiber::ptr 或 std::function<void()>.
+     * thread 为线程 id (GetThreadId()) 时只在该线程上运行, -1 表示任意线程
+     */
+    template<class FiberOrCb>
+    void schedule(FiberOrCb fc, pid_t thread = -1) {
+        bool need_tickle = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            need_tickle = scheduleNoLock(std::move(fc), thread);
+        }
+        if (need_tickle) {
+            tickle();
+        }
+    }
+
+    template<class InputIterator>
+    void schedule(InputIterator begin, InputIterator end) {
+        bool need_tickle = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            while (begin != end) {
+                need_tickle = scheduleNoLock(*begin, -1) || need_tickle;
+                ++begin;
+            }
+        }
+        if (need_tickle) {
+            tickle();
+        }
+    }
+
+    // 当前线程所属的调度器
+    static Scheduler* GetThis();
+    // 当前线程上运行调度循环的协程
+    static Fiber* GetMainFiber();
+protected:
+    // 唤醒一个空闲线程
+    virtual void tickle();
+    // 没有任务时调用, 返回后重新取任务; 默认等到有新任务或开始停止
+    virtual void idle();
+    // 可以结束调度循环
+    virtual bool stopping();
+
+    void run();
+    void setThis();
+    bool hasIdleThreads() const { return m_idleThreadCount.load(std::memory_order_relaxed) > 0; }
+private:
+    struct Task {
+        Fiber::ptr fiber;
+        std::function<void()> cb;
+        pid_t thread = -1;
+
+        Task() {}
+        Task(Fiber::ptr f, pid_t thr) : fiber(std::move(f)), thread(thr) {}
+        Task(std::function<void()> f, pid_t thr) : cb(std::move(f)), thread(thr) {}
+    };
+
+    template<class FiberOrCb>
+    bool scheduleNoLock(FiberOrCb fc, pid_t thread) {
+        bool need_tickle = m_tasks.empty() || thread != -1;
+        Task task(std::move(fc), thread);
+        if (task.fiber || task.cb) {
+            m_tasks.push_back(std::move(task));
+        }
+        return need_tickle && hasIdleThreads();
+    }
+
+    // 调用时持有 m_mutex
+    bool hasTaskFor(pid_t thread) const;
+protected:
+    std::vector<pid_t> m_threadIds;
+    size_t m_threadCount = 0;
+    std::atomic<size_t> m_activeThreadCount{0};
+    std::atomic<size_t> m_idleThreadCount{0};
+    bool m_stopping = true;
+    pid_t m_rootThread = -1;
+private:
+    std::string m_name;
+    bool m_hook;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<std::thread> m_threads;
+    std::list<Task> m_tasks;
+    Fiber::ptr m_rootFiber;     // use_caller 时在调用线程上运行 run() 的协程
+};
+
+}
+
+#endif
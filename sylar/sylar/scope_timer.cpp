@@ -0,0 +1,183 @@
+#include "scope_timer.h"
+#include <stdio.h>
+#include <algorithm>
+
+
+namespace sylar {
+
+namespace {
+
+std::atomic<uint64_t> s_report_interval{10000000000ull};
+std::atomic<uint32_t> s_site_id{0};
+
+// 当前线程在各调用点上的分片, 按调用点 id 下标; 线程退出时分片交还给调用点复用, 累计值保留
+struct ThreadShards {
+    std::vector<ScopeTimerSite::Shard*> shards;
+
+    ~ThreadShards() {
+        for (auto s : shards) {
+            if (s) {
+                s->inUse.store(false, std::memory_order_release);
+            }
+        }
+    }
+};
+
+thread_local ThreadShards t_shards;
+
+void AppendDuration(std::ostream& os, const char* name, uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), " %s=%lluns", name, (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), " %s=%.1fus", name, ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, sizeof(buf), " %s=%.1fms", name, ns / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), " %s=%.2fs", name, ns / 1e9);
+    }
+    os << buf;
+}
+
+}
+
+ScopeTimerSite::Shard::Shard()
+    : sum(0), max(0), inUse(true) {
+    for (auto& b : buckets) {
+        b.store(0, std::memory_order_relaxed);
+    }
+}
+
+ScopeTimerSite::ScopeTimerSite(Logger::ptr logger, const char* name, const char* file, int32_t line)
+    : m_logger(logger), m_name(name), m_file(file), m_line(line),
+      m_id(s_site_id.fetch_add(1, std::memory_order_relaxed)),
+      m_nextReport(GetMonotonicNS() + GetReportInterval()),
+      m_reporting(false),
+      m_lastBuckets(BUCKETS, 0), m_lastSum(0) {
+}
+
+int ScopeTimerSite::BucketIndex(uint64_t ns) {
+    if (ns < (uint64_t)LINEAR_BUCKETS) {
+        return (int)ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (e - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+    return LINEAR_BUCKETS + ((e - 4) << SUB_BUCKET_BITS) + sub;
+}
+
+uint64_t ScopeTimerSite::BucketValue(int idx) {
+    if (idx < LINEAR_BUCKETS) {
+        return idx;
+    }
+    int e = ((idx - LINEAR_BUCKETS) >> SUB_BUCKET_BITS) + 4;
+    uint64_t sub = (idx - LINEAR_BUCKETS) & ((1 << SUB_BUCKET_BITS) - 1);
+    uint64_t width = 1ull << (e - SUB_BUCKET_BITS);
+    return ((1ull << SUB_BUCKET_BITS) + sub) * width + width / 2;
+}
+
+void ScopeTimerSite::SetReportInterval(uint64_t ms) {
+    s_report_interval.store(ms * 1000000ull, std::memory_order_relaxed);
+}
+
+uint64_t ScopeTimerSite::GetReportInterval() {
+    return s_report_interval.load(std::memory_order_relaxed);
+}
+
+ScopeTimerSite::Shard* ScopeTimerSite::getShard() {
+    std::vector<Shard*>& shards = t_shards.shards;
+    if (m_id < shards.size() && shards[m_id]) {
+        return shards[m_id];
+    }
+    if (m_id >= shards.size()) {
+        shards.resize(m_id + 1, nullptr);
+    }
+    shards[m_id] = acquireShard();
+    return shards[m_id];
+}
+
+ScopeTimerSite::Shard* ScopeTimerSite::acquireShard() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& s : m_shards) {
+        bool expected = false;
+        if (s->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return s.get();
+        }
+    }
+    m_shards.emplace_back(new Shard);
+    return m_shards.back().get();
+}
+
+void ScopeTimerSite::record(uint64_t ns, uint64_t now) {
+    // 分片只有当前线程写, 用 load + store 代替带锁前缀的 fetch_add
+    Shard* s = getShard();
+    std::atomic<uint64_t>& b = s->buckets[BucketIndex(ns)];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    s->sum.store(s->sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if (ns > s->max.load(std::memory_order_relaxed)) {
+        s->max.store(ns, std::memory_order_relaxed);
+    }
+
+    if (now >= m_nextReport.load(std::memory_order_relaxed)) {
+        report();
+    }
+}
+
+void ScopeTimerSite::report() {
+    bool expected = false;
+    if (m_reporting.load(std::memory_order_relaxed)
+            || !m_reporting.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return;
+    }
+    m_nextReport.store(GetMonotonicNS() + GetReportInterval(), std::memory_order_relaxed);
+
+    std::vector<uint64_t> buckets(BUCKETS, 0);
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& s : m_shards) {
+            for (int i = 0; i < BUCKETS; ++i) {
+                buckets[i] += s->buckets[i].load(std::memory_order_relaxed);
+            }
+            sum += s->sum.load(std::memory_order_relaxed);
+            // 最大值按周期统计, 与写线程的竞争最多让一次最大值计入下个周期
+            max = std::max(max, s->max.exchange(0, std::memory_order_relaxed));
+        }
+    }
+
+    // 和上次的累计值相减得到本周期的分布
+    uint64_t n = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        uint64_t cur = buckets[i];
+        buckets[i] = cur - m_lastBuckets[i];
+        m_lastBuckets[i] = cur;
+        n += buckets[i];
+    }
+    uint64_t periodSum = sum - m_lastSum;
+    m_lastSum = sum;
+
+    if (n && m_logger && m_logger->getLevel() <= LogLevel::INFO) {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        static const char* names[] = {"p50", "p90", "p99", "p999"};
+        LogEvent::ptr event = LogEvent::Create(m_logger, LogLevel::INFO, m_file, m_line, GetThreadId(), GetFiberId());
+        std::ostream& os = event->getSS();
+        os << "scope " << m_name << " count=" << n;
+        AppendDuration(os, "avg", periodSum / n);
+        uint64_t seen = 0;
+        int q = 0;
+        for (int i = 0; i < BUCKETS && q < 4; ++i) {
+            seen += buckets[i];
+            while (q < 4 && seen >= (uint64_t)(quantiles[q] * n + 0.999999)) {
+                // 桶中点可能超过实际最大值
+                AppendDuration(os, names[q], max ? std::min(BucketValue(i), max) : BucketValue(i));
+                ++q;
+            }
+        }
+        AppendDuration(os, "max", max);
+        m_logger->log(LogLevel::INFO, event);
+    }
+
+    m_reporting.store(false, std::memory_order_release);
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef _SYLAR_SCOPE_TIMER_H_
+#define _SYLAR_SCOPE_TIMER_H_
+
+#include "log.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+#define SYLAR_SCOPE_TIMER_CAT2(a, b) a##b
+#define SYLAR_SCOPE_TIMER_CAT(a, b) SYLAR_SCOPE_TIMER_CAT2(a, b)
+
+/**
+ * 统计所在作用域的耗时, 每个调用点一个直方图, 周期性地以 INFO 级别输出分位数:
+ *   SYLAR_LOG_SCOPE_TIMER(g_logger, "db.query");
+ *   => scope db.query count=1024 avg=35.2us p50=31.0us p90=52.0us p99=88.0us p999=120.0us max=131.1us
+ * 计时和记录不加锁, 日志器级别高于 INFO 时仍然计时但不输出
+ */
+#define SYLAR_LOG_SCOPE_TIMER(logger, name) \
+    static sylar::ScopeTimerSite SYLAR_SCOPE_TIMER_CAT(sylar_timer_site_, __LINE__)(logger, name, __FILE__, __LINE__); \
+    sylar::ScopeTimer SYLAR_SCOPE_TIMER_CAT(sylar_timer_, __LINE__)(SYLAR_SCOPE_TIMER_CAT(sylar_timer_site_, __LINE__))
+
+
+namespace sylar {
+
+/**
+ * 一个计时调用点. 每个线程写自己的分片 (对数线性分桶的直方图), 汇总时才读所有分片;
+ * 记录时发现到了输出时间, 抢到输出权的线程负责汇总并打印这一周期的分位数
+ */
+class ScopeTimerSite {
+public:
+    // 小于 16ns 每纳秒一个桶, 之后每个 2 的幂区间分 8 个桶, 相对误差不超过 12.5%
+    static const int SUB_BUCKET_BITS = 3;
+    static const int LINEAR_BUCKETS = 16;
+    static const int BUCKETS = LINEAR_BUCKETS + (64 - 4) * (1 << SUB_BUCKET_BITS);
+
+    struct Shard {
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<bool> inUse;
+
+        Shard();
+    };
+private:
+    Logger::ptr m_logger;
+    const char* m_name;
+    const char* m_file;
+    int32_t m_line;
+    uint32_t m_id;
+    std::atomic<uint64_t> m_nextReport;
+    std::atomic<bool> m_reporting;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    // 上一次输出时的累计值, 只有输出线程访问
+    std::vector<uint64_t> m_lastBuckets;
+    uint64_t m_lastSum;
+public:
+    ScopeTimerSite(Logger::ptr logger, const char* name, const char* file, int32_t line);
+
+    ScopeTimerSite(const ScopeTimerSite&) = delete;
+    ScopeTimerSite& operator=(const ScopeTimerSite&) = delete;
+
+    void record(uint64_t ns, uint64_t now);
+
+    // 立即输出上次输出以来的统计, 没有新数据时不输出
+    void report();
+
+    static int BucketIndex(uint64_t ns);
+    // 桶所覆盖区间的中点
+    static uint64_t BucketValue(int idx);
+
+    // 所有调用点的输出周期, 默认 10 秒
+    static void SetReportInterval(uint64_t ms);
+    static uint64_t GetReportInterval();
+private:
+    Shard* getShard();
+    Shard* acquireShard();
+};
+
+
+class ScopeTimer {
+private:
+    ScopeTimerSite& m_site;
+    uint64_t m_start;
+public:
+    explicit ScopeTimer(ScopeTimerSite& site)
+        : m_site(site), m_start(GetMonotonicNS()) {
+    }
+
+    ~ScopeTimer() {
+        uint64_t now = GetMonotonicNS();
+        m_site.record(now - m_start, now);
+    }
+
+    ScopeTimer(const ScopeTimer&) = delete;
+    ScopeTimer& operator=(const ScopeTimer&) = delete;
+};
+
+}
+
+#endif
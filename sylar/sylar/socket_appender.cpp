@@ -0,0 +1,383 @@
+#include "socket_appender.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+
+
+namespace sylar {
+
+namespace {
+
+// sendmmsg 一次最多提交的数据报
+const size_t MAX_BATCH_DATAGRAMS = 64;
+// 重连退避间隔, 毫秒
+const uint64_t RECONNECT_MIN_MS = 100;
+const uint64_t RECONNECT_MAX_MS = 5000;
+
+int SyslogSeverity(LogLevel::Level level) {
+    switch (level) {
+    case LogLevel::DEBUG: return 7;
+    case LogLevel::INFO: return 6;
+    case LogLevel::WARN: return 4;
+    case LogLevel::ERROR: return 3;
+    case LogLevel::FATAL: return 2;
+    default: return 5;
+    }
+}
+
+// 同一秒内的 RFC3339 时间前缀 (UTC) 每线程缓存
+struct TimestampCache {
+    uint64_t sec = UINT64_MAX;
+    char text[32];
+    size_t len = 0;
+};
+
+thread_local TimestampCache t_timestamp;
+
+}
+
+SocketLogAppender::SocketLogAppender(Transport transport, const std::string& address, Framing framing, size_t maxSpill)
+    : m_transport(transport), m_address(address), m_framing(framing), m_maxSpill(maxSpill),
+      m_maxDatagram(transport == UDP ? 8192 : 32768) {
+    char host[256];
+    if (gethostname(host, sizeof(host)) == 0) {
+        host[sizeof(host) - 1] = '\0';
+        m_hostname = host;
+    }
+    if (m_hostname.empty()) {
+        m_hostname = "-";
+    }
+    m_appName = program_invocation_short_name;
+    m_thread = std::thread(&SocketLogAppender::run, this);
+}
+
+SocketLogAppender::~SocketLogAppender() {
+    stop();
+}
+
+size_t SocketLogAppender::formatHeader(char* buf, size_t size, LogLevel::Level level, const LogEvent::ptr& event) {
+    TimestampCache& ts = t_timestamp;
+    if (ts.sec != event->getTime()) {
+        struct tm tm;
+        time_t t = event->getTime();
+        gmtime_r(&t, &tm);
+        ts.len = strftime(ts.text, sizeof(ts.text), "%Y-%m-%dT%H:%M:%S", &tm);
+        ts.sec = event->getTime();
+    }
+    int n = snprintf(buf, size, "<%d>1 %.*s.%06uZ %s %s %d - - ", m_facility * 8 + SyslogSeverity(level),
+                     (int)ts.len, ts.text, event->getNanoSecond() / 1000, m_hostname.c_str(),
+                     m_appName.c_str(), (int)getpid());
+    return n < 0 ? 0 : std::min((size_t)n, size - 1);
+}
+
+void SocketLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    LogBuffer buf;
+    m_formatter->format(buf, logger, level, event);
+    size_t len = buf.size();
+    bool newline = len && buf.data()[len - 1] == '\n';
+    char header[512];
+    size_t headerLen = 0;
+    if (m_framing == RFC5424) {
+        if (newline) {
+            --len;
+        }
+        headerLen = formatHeader(header, sizeof(header), level, event);
+    } else if (!newline) {
+        buf.append('\n');
+        ++len;
+    }
+    char prefix[24];
+    size_t prefixLen = 0;
+    if (m_framing == RFC5424 && m_transport == UNIX_STREAM) {
+        prefixLen = snprintf(prefix, sizeof(prefix), "%zu ", headerLen + len);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_stop || m_pending.size() + prefixLen + headerLen + len > m_maxSpill) {
+        ++m_dropped;
+        return;
+    }
+    bool wakeup = m_pending.empty() && m_sleeping;
+    m_pending.append(prefix, prefixLen);
+    m_pending.append(header, headerLen);
+    m_pending.append(buf.data(), len);
+    m_ends.push_back(m_pending.size());
+    ++m_appended;
+    if (wakeup) {
+        m_cond.notify_one();
+    }
+}
+
+bool SocketLogAppender::flush(uint64_t timeoutMs) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t target = m_appended;
+    return m_doneCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, target]() {
+        return m_sent >= target || m_stop;
+    }) && m_sent >= target;
+}
+
+void SocketLogAppender::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dropped += m_appended - m_sent;
+    m_sent = m_appended;
+    m_pending.clear();
+    m_ends.clear();
+    m_doneCond.notify_all();
+}
+
+void SocketLogAppender::setMaxDatagram(size_t size) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxDatagram = std::max<size_t>(size, 64);
+}
+
+void SocketLogAppender::setFacility(int facility) {
+    m_facility = facility;
+}
+
+void SocketLogAppender::setAppName(const std::string& name) {
+    m_appName = name.empty() ? "-" : name;
+}
+
+bool SocketLogAppender::isConnected() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_connected;
+}
+
+uint64_t SocketLogAppender::getDropCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+}
+
+bool SocketLogAppender::connect() {
+    int type = m_transport == UNIX_STREAM ? SOCK_STREAM : SOCK_DGRAM;
+    struct sockaddr_storage addr;
+    socklen_t addrLen = 0;
+    memset(&addr, 0, sizeof(addr));
+    if (m_transport == UDP) {
+        size_t pos = m_address.rfind(':');
+        std::string host = m_address.substr(0, pos);
+        int port = pos == std::string::npos ? 514 : atoi(m_address.c_str() + pos + 1);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        struct sockaddr_in* in4 = (struct sockaddr_in*)&addr;
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        if (inet_pton(AF_INET, host.c_str(), &in4->sin_addr) == 1) {
+            in4->sin_family = AF_INET;
+            in4->sin_port = htons(port);
+            addrLen = sizeof(*in4);
+        } else if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            addrLen = sizeof(*in6);
+        } else {
+            return false;
+        }
+    } else {
+        struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+        if (m_address.size() >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, m_address.c_str(), m_address.size());
+        addrLen = offsetof(struct sockaddr_un, sun_path) + m_address.size() + 1;
+    }
+
+    int fd = socket(addr.ss_family, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (::connect(fd, (struct sockaddr*)&addr, addrLen) != 0) {
+        ::close(fd);
+        return false;
+    }
+    // agent 卡住时发送最多阻塞 1 秒, 让 stop 能够退出
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    m_fd = fd;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_connected = true;
+    return true;
+}
+
+void SocketLogAppender::disconnect() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_connected = false;
+}
+
+size_t SocketLogAppender::send(const std::string& batch, const std::vector<uint32_t>& ends) {
+    return m_transport == UNIX_STREAM ? sendStream(batch, ends) : sendDatagrams(batch, ends);
+}
+
+size_t SocketLogAppender::sendStream(const std::string& batch, const std::vector<uint32_t>& ends) {
+    size_t offset = 0;
+    while (offset < batch.size()) {
+        ssize_t rt = ::send(m_fd, batch.data() + offset, batch.size() - offset, MSG_NOSIGNAL);
+        if (rt > 0) {
+            offset += rt;
+            continue;
+        }
+        if (rt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rt < 0 && errno == EAGAIN) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_stop) {
+                continue;
+            }
+        }
+        // 连接断开; 写了一半的记录重连后整条重发
+        disconnect();
+        break;
+    }
+    return std::upper_bound(ends.begin(), ends.end(), offset) - ends.begin();
+}
+
+size_t SocketLogAppender::sendDatagrams(const std::string& batch, const std::vector<uint32_t>& ends) {
+    size_t maxDatagram;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        maxDatagram = m_maxDatagram;
+    }
+    struct mmsghdr msgs[MAX_BATCH_DATAGRAMS];
+    struct iovec iovs[MAX_BATCH_DATAGRAMS];
+    size_t groupEnd[MAX_BATCH_DATAGRAMS];
+    size_t sent = 0;
+    while (sent < ends.size()) {
+        size_t n = 0;
+        size_t rec = sent;
+        while (rec < ends.size() && n < MAX_BATCH_DATAGRAMS) {
+            size_t start = rec ? ends[rec - 1] : 0;
+            size_t end = ends[rec++];
+            if (m_framing == NEWLINE) {
+                // 按行分帧时尽量把后面的记录拼进同一个数据报
+                while (rec < ends.size() && ends[rec] - start <= maxDatagram) {
+                    end = ends[rec++];
+                }
+            }
+            iovs[n].iov_base = (void*)(batch.data() + start);
+            iovs[n].iov_len = std::min(end - start, maxDatagram);
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            groupEnd[n] = rec;
+            ++n;
+        }
+        int rt = sendmmsg(m_fd, msgs, n, MSG_NOSIGNAL);
+        if (rt > 0) {
+            sent = groupEnd[rt - 1];
+            continue;
+        }
+        if (rt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rt < 0 && errno == EAGAIN) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_stop) {
+                continue;
+            }
+        }
+        // ECONNREFUSED 等: agent 不在, 断开后按退避间隔重连
+        disconnect();
+        break;
+    }
+    return sent;
+}
+
+void SocketLogAppender::run() {
+    std::string batch;
+    std::vector<uint32_t> ends;
+    uint64_t backoff = RECONNECT_MIN_MS;
+    // 连接或发送失败后等待一个退避间隔; 停止时返回 false
+    auto retryLater = [this, &backoff]() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return false;
+        }
+        m_cond.wait_for(lock, std::chrono::milliseconds(backoff));
+        backoff = std::min(backoff * 2, RECONNECT_MAX_MS);
+        return true;
+    };
+    while (true) {
+        if (m_fd < 0 && !connect()) {
+            if (!retryLater()) {
+                break;
+            }
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_pending.empty() && !m_stop) {
+                m_sleeping = true;
+                m_cond.wait(lock);
+                m_sleeping = false;
+            }
+            if (m_pending.empty()) {
+                break;
+            }
+            batch.swap(m_pending);
+            ends.swap(m_ends);
+        }
+
+        size_t n = send(batch, ends);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_sent += n;
+            if (n < ends.size()) {
+                // 没发出去的记录放回缓冲区最前面, 等重连后再发
+                uint32_t offset = n ? ends[n - 1] : 0;
+                uint32_t restLen = batch.size() - offset;
+                for (auto& e : m_ends) {
+                    e += restLen;
+                }
+                for (size_t i = n; i < ends.size(); ++i) {
+                    ends[i] -= offset;
+                }
+                m_ends.insert(m_ends.begin(), ends.begin() + n, ends.end());
+                m_pending.insert(0, batch, offset, restLen);
+            }
+        }
+        m_doneCond.notify_all();
+        batch.clear();
+        ends.clear();
+
+        // UDP 的 connect 总是成功, 退避只在发送成功后重置, 避免对端不可达时空转
+        if (m_fd >= 0) {
+            backoff = RECONNECT_MIN_MS;
+        } else if (!retryLater()) {
+            break;
+        }
+    }
+    disconnect();
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef _SYLAR_SOCKET_APPENDER_H_
+#define _SYLAR_SOCKET_APPENDER_H_
+
+#include "log.h"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+
+namespace sylar {
+
+/**
+ * 把日志发给本机的采集 agent (unix 域 socket 或 UDP syslog).
+ * 调用线程只把格式化并加好分帧的记录追加到待发送缓冲区, 连接、重连和发送都在后台线程:
+ *   流式 socket 一次 send 发出整批记录;
+ *   数据报按行分帧时把多条记录拼进一个数据报, RFC5424 分帧时每条一个数据报, 用 sendmmsg 批量发送.
+ * agent 不可用时记录留在缓冲区 (最多 maxSpill 字节, 超出的丢弃并计数), 后台按退避间隔重连, 调用线程从不阻塞
+ */
+class SocketLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<SocketLogAppender> ptr;
+
+    enum Transport {
+        UNIX_STREAM = 0,    // address 为 socket 路径
+        UNIX_DGRAM = 1,
+        UDP = 2,            // address 为 ip:port
+    };
+
+    enum Framing {
+        NEWLINE = 0,        // formatter 的输出, 缺少结尾换行时补上
+        RFC5424 = 1,        // <PRI>1 时间 主机 程序 pid - - 消息; 流式 socket 上再加 "长度 " 前缀 (RFC6587 octet counting)
+    };
+private:
+    Transport m_transport;
+    std::string m_address;
+    Framing m_framing;
+    size_t m_maxSpill;
+    size_t m_maxDatagram;
+    int m_facility = 1;     // user
+    std::string m_hostname;
+    std::string m_appName;
+
+    int m_fd = -1;          // 只有后台线程访问
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_doneCond;
+    std::string m_pending;              // 待发送的记录, 首尾相接
+    std::vector<uint32_t> m_ends;       // 每条记录在 m_pending 中的结束位置
+    uint64_t m_appended = 0;            // 累计追加的记录条数
+    uint64_t m_sent = 0;                // 累计发出的记录条数
+    uint64_t m_dropped = 0;
+    bool m_connected = false;
+    bool m_sleeping = false;
+    bool m_stop = false;
+    std::thread m_thread;
+public:
+    SocketLogAppender(Transport transport, const std::string& address, Framing framing = NEWLINE,
+                      size_t maxSpill = 4 * 1024 * 1024);
+    ~SocketLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    // 等待之前的记录发出, 未连接时最多等 timeoutMs 毫秒, 返回是否全部发出
+    bool flush(uint64_t timeoutMs);
+    void flush() override { flush(1000); }
+    // 连接正常时发完剩余记录, 然后结束后台线程; 没发出的和之后的日志计入丢弃
+    void stop();
+
+    // 数据报的最大长度, 默认 unix 32KB, UDP 8KB; 超长的单条记录被截断
+    void setMaxDatagram(size_t size);
+    // RFC5424 的 facility (默认 1 user) 和 APP-NAME (默认程序名), 需要在开始写日志前设置
+    void setFacility(int facility);
+    void setAppName(const std::string& name);
+
+    bool isConnected();
+    // 缓冲区满或停止后丢弃的记录条数
+    uint64_t getDropCount();
+private:
+    void run();
+    bool connect();
+    void disconnect();
+    // 发出 batch 的前若干条记录, 返回发出的条数; 出错时断开连接
+    size_t send(const std::string& batch, const std::vector<uint32_t>& ends);
+    size_t sendStream(const std::string& batch, const std::vector<uint32_t>& ends);
+    size_t sendDatagrams(const std::string& batch, const std::vector<uint32_t>& ends);
+    // RFC5424 的头部 (到 MSG 之前), 返回长度
+    size_t formatHeader(char* buf, size_t size, LogLevel::Level level, const LogEvent::ptr& event);
+};
+
+}
+
+#endif
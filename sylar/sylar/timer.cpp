@@ -0,0 +1,189 @@
+#include "timer.h"
+#include "util.h"
+
+
+namespace sylar {
+
+static const size_t npos = (size_t)-1;
+
+static uint64_t NowMS() {
+    return GetMonotonicNS() / 1000000ull;
+}
+
+Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager)
+    : m_recurring(recurring), m_ms(ms), m_next(NowMS() + ms), m_index(npos),
+      m_cb(std::move(cb)), m_manager(manager) {
+}
+
+bool Timer::cancel() {
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (!m_cb) {
+        return false;
+    }
+    m_cb = nullptr;
+    if (m_index != npos) {
+        m_manager->removeNoLock(this);
+    }
+    return true;
+}
+
+bool Timer::refresh() {
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (!m_cb || m_index == npos) {
+        return false;
+    }
+    // 只会往后推, 下沉即可
+    m_next = NowMS() + m_ms;
+    m_manager->siftDown(m_index);
+    return true;
+}
+
+bool Timer::reset(uint64_t ms, bool from_now) {
+    if (ms == m_ms && !from_now) {
+        return true;
+    }
+    bool at_front = false;
+    {
+        std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+        if (!m_cb || m_index == npos) {
+            return false;
+        }
+        m_manager->removeNoLock(this);
+        uint64_t start = from_now ? NowMS() : m_next - m_ms;
+        m_ms = ms;
+        m_next = start + m_ms;
+        at_front = m_manager->pushNoLock(shared_from_this());
+    }
+    if (at_front) {
+        m_manager->onTimerInsertedAtFront();
+    }
+    return true;
+}
+
+TimerManager::TimerManager() {
+}
+
+TimerManager::~TimerManager() {
+}
+
+Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
+    Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
+    bool at_front = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        at_front = pushNoLock(timer);
+    }
+    if (at_front) {
+        onTimerInsertedAtFront();
+    }
+    return timer;
+}
+
+static void OnTimer(std::weak_ptr<void> weak_cond, const std::function<void()>& cb) {
+    std::shared_ptr<void> tmp = weak_cond.lock();
+    if (tmp) {
+        cb();
+    }
+}
+
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb,
+                                           std::weak_ptr<void> cond, bool recurring) {
+    return addTimer(ms, std::bind(&OnTimer, cond, std::move(cb)), recurring);
+}
+
+uint64_t TimerManager::getNextTimer() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tickled = false;
+    if (m_heap.empty()) {
+        return ~0ull;
+    }
+    uint64_t now = NowMS();
+    uint64_t next = m_heap[0]->m_next;
+    return now >= next ? 0 : next - now;
+}
+
+void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
+    uint64_t now = NowMS();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_heap.empty() && m_heap[0]->m_next <= now) {
+        Timer::ptr timer = m_heap[0];
+        removeNoLock(timer.get());
+        if (timer->m_recurring) {
+            cbs.push_back(timer->m_cb);
+            timer->m_next = now + timer->m_ms;
+            pushNoLock(timer);
+        } else {
+            cbs.push_back(std::move(timer->m_cb));
+            timer->m_cb = nullptr;
+        }
+    }
+}
+
+bool TimerManager::hasTimer() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_heap.empty();
+}
+
+bool TimerManager::pushNoLock(const Timer::ptr& timer) {
+    timer->m_index = m_heap.size();
+    m_heap.push_back(timer);
+    siftUp(timer->m_index);
+    bool at_front = timer->m_index == 0 && !m_tickled;
+    if (at_front) {
+        m_tickled = true;
+    }
+    return at_front;
+}
+
+void TimerManager::removeNoLock(Timer* timer) {
+    size_t i = timer->m_index;
+    size_t last = m_heap.size() - 1;
+    if (i != last) {
+        swapAt(i, last);
+    }
+    m_heap.back()->m_index = npos;
+    m_heap.pop_back();
+    if (i < m_heap.size()) {
+        siftDown(i);
+        siftUp(i);
+    }
+}
+
+void TimerManager::swapAt(size_t a, size_t b) {
+    std::swap(m_heap[a], m_heap[b]);
+    m_heap[a]->m_index = a;
+    m_heap[b]->m_index = b;
+}
+
+void TimerManager::siftUp(size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (m_heap[parent]->m_next <= m_heap[i]->m_next) {
+            break;
+        }
+        swapAt(i, parent);
+        i = parent;
+    }
+}
+
+void TimerManager::siftDown(size_t i) {
+    size_t n = m_heap.size();
+    while (true) {
+        size_t smallest = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        if (l < n && m_heap[l]->m_next < m_heap[smallest]->m_next) {
+            smallest = l;
+        }
+        if (r < n && m_heap[r]->m_next < m_heap[smallest]->m_next) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            break;
+        }
+        swapAt(i, smallest);
+        i = smallest;
+    }
+}
+
+}
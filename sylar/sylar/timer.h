@@ -0,0 +1,76 @@
+#ifndef _SYLAR_TIMER_H_
+#define _SYLAR_TIMER_H_
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+
+
+namespace sylar {
+
+class TimerManager;
+
+class Timer : public std::enable_shared_from_this<Timer> {
+friend class TimerManager;
+public:
+    typedef std::shared_ptr<Timer> ptr;
+
+    // 从管理器中移除, 回调不再执行
+    bool cancel();
+    // 从现在起重新计时
+    bool refresh();
+    // 改成 ms 毫秒, from_now 为 false 时从原来的起点算
+    bool reset(uint64_t ms, bool from_now);
+private:
+    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+private:
+    bool m_recurring = false;
+    uint64_t m_ms = 0;
+    uint64_t m_next = 0;        // 到期时间, 单调时钟毫秒
+    size_t m_index = 0;         // 在堆中的下标, 不在堆中时为 npos
+    std::function<void()> m_cb;
+    TimerManager* m_manager = nullptr;
+};
+
+/**
+ * 定时器管理器. 定时器放在按到期时间排序的二叉小顶堆里, 每个定时器记着自己的下标,
+ * 添加/取消/重置都是 O(log n), 取最近的到期时间 O(1). 时间用单调时钟, 不受系统时间调整影响
+ */
+class TimerManager {
+friend class Timer;
+public:
+    TimerManager();
+    virtual ~TimerManager();
+
+    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    // cond 失效 (对象已经析构) 时到期也不执行回调
+    Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
+                                 std::weak_ptr<void> cond, bool recurring = false);
+
+    // 距离最近一个定时器到期的毫秒数, 没有定时器时返回 ~0ull
+    uint64_t getNextTimer();
+    // 取出所有到期定时器的回调, 循环定时器重新入堆
+    void listExpiredCb(std::vector<std::function<void()>>& cbs);
+    bool hasTimer();
+protected:
+    // 新定时器成了最早到期的那个, 需要唤醒正在等待的线程重新计算超时
+    virtual void onTimerInsertedAtFront() = 0;
+private:
+    // 以下调用时持有 m_mutex, 返回是否插到了堆顶
+    bool pushNoLock(const Timer::ptr& timer);
+    void removeNoLock(Timer* timer);
+    void siftUp(size_t i);
+    void siftDown(size_t i);
+    void swapAt(size_t a, size_t b);
+private:
+    std::mutex m_mutex;
+    std::vector<Timer::ptr> m_heap;
+    // 上次通知过之后还没有人取过最近到期时间, 不用再通知
+    bool m_tickled = false;
+};
+
+}
+
+#endif
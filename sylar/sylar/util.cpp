@@ -0,0 +1,131 @@
+#include "util.h"
+#include "fiber.h"
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+
+namespace sylar {
+
+static thread_local pid_t t_thread_id = 0;
+
+namespace {
+
+struct ThreadIdForkReset {
+    ThreadIdForkReset() {
+        // fork 出的子进程里调用线程的 tid 变了, 需要重新获取
+        pthread_atfork(nullptr, nullptr, []() { t_thread_id = 0; });
+    }
+};
+
+ThreadIdForkReset s_thread_id_fork_reset;
+
+}
+
+pid_t GetThreadId() {
+    if (t_thread_id == 0) {
+        t_thread_id = syscall(SYS_gettid);
+    }
+    return t_thread_id;
+}
+
+uint32_t GetFiberId() {
+    return Fiber::GetFiberId();
+}
+
+uint64_t GetCurrentNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t GetCurrentCoarseNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+namespace {
+
+uint64_t MonotonicRawNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * ns = base_ns + (tsc - base_tsc) * mult >> 32
+ */
+struct TscClock {
+    bool useTsc = false;
+    uint64_t baseTsc = 0;
+    uint64_t baseNs = 0;
+    uint64_t mult = 0;
+
+    TscClock() {
+        baseNs = MonotonicRawNS();
+#if defined(__x86_64__)
+        unsigned int a, b, c, d;
+        // CPUID.80000007H:EDX[8] 不变 TSC, 频率不受变频和休眠影响
+        if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1u << 8))) {
+            return;
+        }
+        // 校准窗口 5ms, clock_gettime 的读数误差折合约 10ppm
+        uint64_t t0 = __rdtsc();
+        uint64_t n0 = MonotonicRawNS();
+        uint64_t n1;
+        uint64_t t1;
+        do {
+            t1 = __rdtsc();
+            n1 = MonotonicRawNS();
+        } while (n1 - n0 < 5000000);
+        if (t1 <= t0) {
+            return;
+        }
+        mult = (uint64_t)(((unsigned __int128)(n1 - n0) << 32) / (t1 - t0));
+        baseTsc = t1;
+        baseNs = n1;
+        useTsc = mult != 0;
+#endif
+    }
+
+    uint64_t now() const {
+#if defined(__x86_64__)
+        if (useTsc) {
+            // 各核 TSC 有极小偏差, 不让结果早于校准点
+            int64_t delta = (int64_t)(__rdtsc() - baseTsc);
+            return baseNs + (delta > 0 ? (uint64_t)(((unsigned __int128)delta * mult) >> 32) : 0);
+        }
+#endif
+        return MonotonicRawNS();
+    }
+};
+
+const TscClock& GetTscClock() {
+    static TscClock s_clock;
+    return s_clock;
+}
+
+// 库加载时完成校准并记下起点
+const uint64_t s_process_start = GetTscClock().now();
+
+}
+
+uint64_t GetMonotonicNS() {
+    return GetTscClock().now() - s_process_start;
+}
+
+uint64_t GetElapsedMS() {
+    return GetMonotonicNS() / 1000000;
+}
+
+bool IsTscClock() {
+    return GetTscClock().useTsc;
+}
+
+}
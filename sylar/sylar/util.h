@@ -0,0 +1,36 @@
+#ifndef _SYLAR_UTIL_H_
+#define _SYLAR_UTIL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+namespace sylar {
+
+// 当前线程的内核线程 id, 首次调用后缓存在线程局部变量里
+pid_t GetThreadId();
+
+// 当前协程 id, 不在协程中时为 0
+uint32_t GetFiberId();
+
+// 墙上时间, 纳秒
+uint64_t GetCurrentNS();
+
+// 粗粒度墙上时间 (CLOCK_REALTIME_COARSE), 精度为一个时钟节拍, 读取开销更低
+uint64_t GetCurrentCoarseNS();
+
+/**
+ * 单调时钟, 纳秒, 从进程启动 (库加载) 时开始计.
+ * x86 上 CPU 支持不变 TSC 时直接读 rdtsc, 按启动时对 CLOCK_MONOTONIC_RAW 的校准换算; 否则读 CLOCK_MONOTONIC_RAW
+ */
+uint64_t GetMonotonicNS();
+
+// 进程启动以来的毫秒数
+uint64_t GetElapsedMS();
+
+// 单调时钟是否使用 TSC
+bool IsTscClock();
+
+}
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <atomic>
+#include <string>
+
+#include "sylar/log.h"
+#include "sylar/iomanager.h"
+#include "sylar/fd_manager.h"
+#include "sylar/hook.h"
+
+/**
+ * 回环上的 echo 服务压测. 服务端和客户端各在一个进程里 (各自受 fd 上限约束), 都是 IOManager + 同步写法的协程:
+ *   服务端每个连接一个协程 read/write 回显, 客户端每个连接一个协程发 messages 条消息并等回显.
+ * 用法: bench_echo [线程数=4] [连接数=10000] [每个连接的消息数=100] [消息字节数=64]
+ */
+
+namespace {
+
+int s_threads = 4;
+int s_connections = 10000;
+int s_messages = 100;
+int s_size = 64;
+
+void RaiseFdLimit(int need) {
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)need) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)need ? rl.rlim_max : need;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < (rlim_t)need) {
+        fprintf(stderr, "fd limit %llu is less than %d, lower the connection count\n",
+                (unsigned long long)rl.rlim_cur, need);
+    }
+}
+
+bool ReadFull(int fd, char* buf, size_t len) {
+    while (len) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool WriteFull(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+void HandleClient(int fd) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0 || !WriteFull(fd, buf, n)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+void RunServer(int listen_fd) {
+    sylar::IOManager iom(s_threads, false, "server", true);
+    iom.schedule([listen_fd]() {
+        sylar::FdMgr::getInstance()->get(listen_fd, true);
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    fprintf(stderr, "server accept: %s\n", strerror(errno));
+                    usleep(10000);
+                    continue;
+                }
+                break;
+            }
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            sylar::IOManager::GetThis()->schedule(std::bind(&HandleClient, fd));
+        }
+    });
+    // 等客户端进程结束后关闭监听 socket, accept 返回错误, 所有连接也已经被对端关闭
+    iom.schedule([listen_fd]() {
+        while (true) {
+            int status = 0;
+            pid_t pid = waitpid(-1, &status, WNOHANG);
+            if (pid > 0 || (pid < 0 && errno == ECHILD)) {
+                break;
+            }
+            usleep(50000);
+        }
+        close(listen_fd);
+    });
+}
+
+void RunClient(int port) {
+    std::atomic<int> connected{0};
+    std::atomic<int> failed{0};
+    std::atomic<uint64_t> echoed{0};
+    uint64_t connect_done = 0;
+    uint64_t start = sylar::GetMonotonicNS();
+    {
+        sylar::IOManager iom(s_threads, false, "client", true);
+        for (int i = 0; i < s_connections; ++i) {
+            iom.schedule([&, i]() {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+                    ++failed;
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    return;
+                }
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                if (++connected == s_connections) {
+                    connect_done = sylar::GetMonotonicNS();
+                }
+                // 等所有连接建立后再一起收发, 同时在线的连接数才是 connections
+                while (connected + failed < s_connections) {
+                    usleep(10000);
+                }
+                std::string msg(s_size, 'a' + i % 26);
+                std::string back(s_size, 0);
+                for (int m = 0; m < s_messages; ++m) {
+                    if (!WriteFull(fd, msg.data(), msg.size()) || !ReadFull(fd, &back[0], back.size())
+                            || back != msg) {
+                        ++failed;
+                        break;
+                    }
+                    ++echoed;
+                }
+                close(fd);
+            });
+        }
+    }
+    uint64_t end = sylar::GetMonotonicNS();
+    if (!connect_done) {
+        connect_done = end;
+    }
+    double connect_sec = (connect_done - start) / 1e9;
+    double echo_sec = (end - connect_done) / 1e9;
+    printf("threads=%d connections=%d established=%d failed=%d\n",
+           s_threads, s_connections, connected.load(), failed.load());
+    printf("connect: %.3fs, echo: %llu messages of %d bytes in %.3fs, %.0f msg/s, %.1f MB/s\n",
+           connect_sec, (unsigned long long)echoed.load(), s_size, echo_sec,
+           echoed / echo_sec, echoed * (double)s_size * 2 / echo_sec / 1e6);
+}
+
+}
+
+int main(int argc, char** argv) {
+    // 客户端进程: bench_echo --client 端口 线程数 连接数 消息数 消息字节数
+    bool client = argc > 1 && strcmp(argv[1], "--client") == 0;
+    int arg = client ? 3 : 1;
+    if (argc > arg) s_threads = atoi(argv[arg]);
+    if (argc > arg + 1) s_connections = atoi(argv[arg + 1]);
+    if (argc > arg + 2) s_messages = atoi(argv[arg + 2]);
+    if (argc > arg + 3) s_size = atoi(argv[arg + 3]);
+    signal(SIGPIPE, SIG_IGN);
+    RaiseFdLimit(s_connections + 64);
+    SYLAR_LOG_ROOT()->setLevel(sylar::LogLevel::INFO);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+    if (client) {
+        RunClient(atoi(argv[2]));
+        return 0;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 65535)) {
+        perror("bind/listen");
+        return 1;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr*)&addr, &len);
+    int port = ntohs(addr.sin_port);
+
+    // 日志库在 main 之前已经起了后台线程, fork 后马上 exec 自己作为客户端
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listen_fd);
+        std::string args[] = {std::to_string(port), std::to_string(s_threads), std::to_string(s_connections),
+                              std::to_string(s_messages), std::to_string(s_size)};
+        execl("/proc/self/exe", argv[0], "--client", args[0].c_str(), args[1].c_str(), args[2].c_str(),
+              args[3].c_str(), args[4].c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    RunServer(listen_fd);
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sylar/log.h"
+
+/**
+ * 日志性能测试, 结果以 JSON 输出到标准输出, 便于发布流程比较回归
+ * 用法: bench_log [最大线程数] [每线程次数]
+ * 每个用例跑两遍: 第一遍整体计时得到 ns/op, 第二遍逐条计时得到 p50/p99/p999
+ */
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+    std::string name;
+    int threads;
+    uint64_t ops;
+    double nsPerOp;         // 每个线程平均每条耗时
+    double opsPerSec;       // 所有线程合计吞吐
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+// 格式化后丢弃, 用来单独测量前端开销
+class NullLogAppender : public sylar::LogAppender {
+public:
+    void log(sylar::Logger::ptr logger, sylar::LogLevel::Level level, sylar::LogEvent::ptr event) override {
+        static thread_local sylar::LogBuffer buf;
+        buf.clear();
+        m_formatter->format(buf, logger, level, event);
+    }
+};
+
+std::vector<Result> s_results;
+int s_maxThreads = 4;
+uint64_t s_iterations = 200000;
+
+uint64_t Percentile(std::vector<uint64_t>& samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t idx = std::min(samples.size() - 1, (size_t)(samples.size() * p));
+    std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+    return samples[idx];
+}
+
+/**
+ * threads 个线程同时执行 op(线程号, 序号)
+ */
+void Run(const std::string& name, int threads, const std::function<void(int, uint64_t)>& op,
+         const std::function<void()>& finish = nullptr) {
+    uint64_t iters = s_iterations;
+    uint64_t samplesPerThread = std::min<uint64_t>(iters, 100000);
+    std::vector<uint64_t> elapsed(threads);
+    std::vector<std::vector<uint64_t> > samples(threads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+
+    std::vector<std::thread> ths;
+    for (int t = 0; t < threads; ++t) {
+        ths.emplace_back([&, t]() {
+            samples[t].resize(samplesPerThread);
+            ++ready;
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < iters; ++i) {
+                op(t, i);
+            }
+            elapsed[t] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+            for (uint64_t i = 0; i < samplesPerThread; ++i) {
+                auto s = Clock::now();
+                op(t, i);
+                samples[t][i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - s).count();
+            }
+        });
+    }
+    while (ready.load() < threads) {
+        std::this_thread::yield();
+    }
+    go.store(true, std::memory_order_release);
+    for (auto& th : ths) {
+        th.join();
+    }
+    if (finish) {
+        finish();
+    }
+
+    uint64_t total = 0;
+    uint64_t wall = 1;
+    for (auto e : elapsed) {
+        total += e;
+        wall = std::max(wall, e);
+    }
+    std::vector<uint64_t> all;
+    all.reserve(samplesPerThread * threads);
+    for (auto& s : samples) {
+        all.insert(all.end(), s.begin(), s.end());
+    }
+    Result r;
+    r.name = name;
+    r.threads = threads;
+    r.ops = iters * threads;
+    r.nsPerOp = (double)total / r.ops;
+    r.opsPerSec = r.ops * 1e9 / wall;
+    r.p50 = Percentile(all, 0.50);
+    r.p99 = Percentile(all, 0.99);
+    r.p999 = Percentile(all, 0.999);
+    s_results.push_back(r);
+    fprintf(stderr, "%-20s threads=%-3d %10.1f ns/op %12.0f ops/s  p50=%llu p99=%llu p999=%llu\n", name.c_str(), threads,
+            r.nsPerOp, r.opsPerSec, (unsigned long long)r.p50, (unsigned long long)r.p99, (unsigned long long)r.p999);
+}
+
+std::vector<int> ThreadCounts() {
+    std::vector<int> counts;
+    for (int t = 1; t < s_maxThreads; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(s_maxThreads);
+    return counts;
+}
+
+sylar::Logger::ptr MakeLogger(const std::string& name, sylar::LogAppender::ptr appender) {
+    sylar::Logger::ptr logger(new sylar::Logger(name));
+    if (appender) {
+        logger->addAppender(appender);
+    }
+    return logger;
+}
+
+void BenchMacros() {
+    sylar::Logger::ptr disabled = MakeLogger("disabled", sylar::LogAppender::ptr(new NullLogAppender));
+    disabled->setLevel(sylar::LogLevel::ERROR);
+    sylar::Logger::ptr null = MakeLogger("null", sylar::LogAppender::ptr(new NullLogAppender));
+
+    for (int t : ThreadCounts()) {
+        Run("disabled_level", t, [&](int, uint64_t i) {
+            SYLAR_LOG_DEBUG(disabled) << "value=" << i;
+        });
+        Run("stream_macro", t, [&](int, uint64_t i) {
+            SYLAR_LOG_INFO(null) << "value=" << i << " name=" << "bench";
+        });
+        Run("fmt_macro", t, [&](int, uint64_t i) {
+            SYLAR_LOG_FMT_INFO(null, "value=%llu name=%s", (unsigned long long)i, "bench");
+        });
+        Run("format_macro", t, [&](int, uint64_t i) {
+            SYLAR_LOG_FORMAT_INFO(null, "value={} name={}", i, "bench");
+        });
+    }
+}
+
+void BenchFormatItems() {
+    static const char* patterns[][2] = {
+        {"format_m", "%m"},
+        {"format_p", "%p"},
+        {"format_r", "%r"},
+        {"format_c", "%c"},
+        {"format_t", "%t"},
+        {"format_F", "%F"},
+        {"format_d", "%d"},
+        {"format_d_usec", "%d{%H:%M:%S.%6N}"},
+        {"format_f", "%f"},
+        {"format_l", "%l"},
+        {"format_T", "%T"},
+        {"format_n", "%n"},
+        {"format_default", "%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"},
+    };
+    sylar::Logger::ptr logger = MakeLogger("format", nullptr);
+    sylar::LogEvent::ptr event = sylar::LogEvent::Create(logger, sylar::LogLevel::INFO, __FILE__, __LINE__,
+                                                         sylar::GetThreadId(), 0);
+    event->getSS() << "value=12345 name=bench";
+
+    for (auto& p : patterns) {
+        sylar::LogFormatter::ptr fmt(new sylar::LogFormatter(p[1]));
+        sylar::LogBuffer buf;
+        Run(p[0], 1, [&](int, uint64_t) {
+            buf.clear();
+            fmt->format(buf, logger, sylar::LogLevel::INFO, event);
+        });
+    }
+}
+
+void BenchAppenders() {
+    // 标准输出重定向到 /dev/null, JSON 结果写到原来的标准输出
+    sylar::StdoutLogAppender::ptr out(new sylar::StdoutLogAppender);
+    sylar::Logger::ptr stdoutLogger = MakeLogger("stdout", out);
+    for (int t : ThreadCounts()) {
+        Run("stdout_devnull", t, [&](int, uint64_t i) {
+            SYLAR_LOG_INFO(stdoutLogger) << "value=" << i << " name=" << "bench";
+        }, [&]() {
+            out->flush();
+        });
+    }
+
+    std::string dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    std::string path = dir + "/sylar_bench_" + std::to_string(getpid()) + ".log";
+    for (int t : ThreadCounts()) {
+        sylar::FileLogAppender::ptr file(new sylar::FileLogAppender(path));
+        sylar::Logger::ptr fileLogger = MakeLogger("file", file);
+        Run("file_tmpfs", t, [&](int, uint64_t i) {
+            SYLAR_LOG_INFO(fileLogger) << "value=" << i << " name=" << "bench";
+        }, [&]() {
+            file->flush();
+        });
+        file->stop();
+        unlink(path.c_str());
+    }
+}
+
+void PrintJson(FILE* fp) {
+    fprintf(fp, "{\n  \"benchmark\": \"sylar-log\",\n  \"max_threads\": %d,\n  \"iterations\": %llu,\n  \"results\": [\n",
+            s_maxThreads, (unsigned long long)s_iterations);
+    for (size_t i = 0; i < s_results.size(); ++i) {
+        const Result& r = s_results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"threads\": %d, \"ops\": %llu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, "
+                "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}%s\n",
+                r.name.c_str(), r.threads, (unsigned long long)r.ops, r.nsPerOp, r.opsPerSec,
+                (unsigned long long)r.p50, (unsigned long long)r.p99, (unsigned long long)r.p999,
+                i + 1 < s_results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fflush(fp);
+}
+
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        s_maxThreads = std::max(1, atoi(argv[1]));
+    } else {
+        s_maxThreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    }
+    if (argc > 2) {
+        s_iterations = std::max(1ll, atoll(argv[2]));
+    }
+
+    fflush(stdout);
+    int jsonFd = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (jsonFd < 0 || devnull < 0 || dup2(devnull, STDOUT_FILENO) < 0) {
+        perror("redirect stdout");
+        return 1;
+    }
+    close(devnull);
+    FILE* json = fdopen(jsonFd, "w");
+
+    BenchMacros();
+    BenchFormatItems();
+    BenchAppenders();
+
+    PrintJson(json);
+    fclose(json);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _SYLAR_TESTS_CHECK_H_
+#define _SYLAR_TESTS_CHECK_H_
+
+#include <stdio.h>
+
+/**
+ * 测试共用的检查宏: CHECK 失败时打印位置并计数, 不中断测试;
+ * main 最后 return CheckResult(), 有失败时返回 1
+ */
+static int s_failed = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++s_failed; \
+        } \
+    } while (0)
+
+static inline int CheckResult() {
+    if (s_failed) {
+        fprintf(stderr, "%d checks failed\n", s_failed);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
+
+#endif
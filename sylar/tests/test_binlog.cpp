@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "sylar/log.h"
+#include "sylar/binlog.h"
+#include "check.h"
+
+/**
+ * 二进制日志的往返测试: 同一组调用点分别走普通格式化和 BinLogWriter,
+ * 后者用 sylar-logdecode 解码, 两边输出的文本必须一致.
+ * 覆盖整数, 浮点, 字符串, %*d / %.*s (含没有结尾 '\0' 的缓冲区) 和流式宏的文本记录
+ */
+
+namespace {
+
+const char* PATTERN = "%p %c %f:%l %m%n";
+
+class StringLogAppender : public sylar::LogAppender {
+public:
+    typedef std::shared_ptr<StringLogAppender> ptr;
+    void log(sylar::Logger::ptr logger, sylar::LogLevel::Level level, sylar::LogEvent::ptr event) override {
+        m_text += m_formatter->format(logger, level, event);
+    }
+    const std::string& getText() const { return m_text; }
+private:
+    std::string m_text;
+};
+
+// 两次调用走的是同一组调用点, 文件名和行号相同
+void Emit(sylar::Logger::ptr logger) {
+    char buf[8];
+    memcpy(buf, "abcdefgh", sizeof(buf));
+    int64_t big = -1234567890123ll;
+    uint64_t ubig = 18446744073709551615ull;
+
+    SYLAR_LOG_FMT_INFO(logger, "int %d %i %05d %-4d| %x %o %c", 42, -7, 3, 9, 255u, 8, 'z');
+    SYLAR_LOG_FMT_INFO(logger, "long %lld %llu %zu", (long long)big, (unsigned long long)ubig, (size_t)17);
+    SYLAR_LOG_FMT_ERROR(logger, "double %f %.3f %e %g %8.2f|", 3.5, 2.0 / 3, 12345.678, 0.0001, -1.25);
+    SYLAR_LOG_FMT_INFO(logger, "str %s [%10s] [%-6s] %.3s %%", "hello", "right", "left", "truncated");
+    SYLAR_LOG_FMT_INFO(logger, "star [%*d] [%-*d] [%.*s] [%*.*s]", 6, 12, 4, 5, 3, buf, 8, 5, buf);
+    SYLAR_LOG_FMT_INFO(logger, "nonul [%.*s] [%.8s]", (int)sizeof(buf), buf, buf);
+    SYLAR_LOG_FMT_INFO(logger, "empty [%s] [%.0s]", "", "x");
+    SYLAR_LOG_WARN(logger) << "text " << 42 << ' ' << 1.5;
+    SYLAR_LOG_ERROR(logger) << "text with\ttab";
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argv[0];
+    dir = dir.find('/') == std::string::npos ? "." : dir.substr(0, dir.rfind('/'));
+    std::string path = "/tmp/sylar_binlog_" + std::to_string(getpid()) + ".bin";
+    unlink(path.c_str());
+
+    sylar::Logger::ptr logger(new sylar::Logger("binlog"));
+    StringLogAppender::ptr appender(new StringLogAppender);
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter(PATTERN)));
+    logger->addAppender(appender);
+    Emit(logger);
+    const std::string& expect = appender->getText();
+
+    sylar::BinLogWriter::ptr writer(new sylar::BinLogWriter(path, logger->getName(), PATTERN));
+    logger->setBinLog(writer);
+    Emit(logger);
+    writer->stop();
+    CHECK(writer->getDropCount() == 0);
+
+    std::string decoded;
+    FILE* fp = popen((dir + "/sylar-logdecode " + path).c_str(), "r");
+    CHECK(fp != nullptr);
+    if (fp) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            decoded.append(buf, n);
+        }
+        CHECK(pclose(fp) == 0);
+    }
+    unlink(path.c_str());
+
+    CHECK(!expect.empty());
+    CHECK(decoded == expect);
+    if (decoded != expect) {
+        fprintf(stderr, "expect:\n%s\ndecoded:\n%s\n", expect.c_str(), decoded.c_str());
+    }
+    return CheckResult();
+}
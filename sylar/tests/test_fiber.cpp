@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sylar/log.h"
+#include "sylar/fiber.h"
+#include "check.h"
+
+/**
+ * 协程的测试:
+ *   1. resume/yield 来回切换, 日志里带上协程 id
+ *   2. 嵌套: 协程里再 resume 另一个协程
+ *   3. reset 复用栈, 异常结束的状态为 EXCEPT
+ *   4. 协程在一个线程上切出、在另一个线程上恢复
+ */
+
+namespace {
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+void TestSwitch() {
+    std::vector<int> steps;
+    uint64_t inner_id = 0;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&]() {
+        inner_id = sylar::GetFiberId();
+        SYLAR_LOG_INFO(g_logger) << "in fiber";
+        steps.push_back(1);
+        sylar::Fiber::YieldToHold();
+        steps.push_back(3);
+        sylar::Fiber::YieldToReady();
+        steps.push_back(5);
+    }));
+    CHECK(sylar::GetFiberId() == 0);
+    CHECK(fiber->resume() == sylar::Fiber::HOLD);
+    steps.push_back(2);
+    CHECK(fiber->resume() == sylar::Fiber::READY);
+    steps.push_back(4);
+    CHECK(fiber->resume() == sylar::Fiber::TERM);
+    CHECK((steps == std::vector<int>{1, 2, 3, 4, 5}));
+    CHECK(inner_id == fiber->getId() && inner_id != 0);
+    CHECK(sylar::GetFiberId() == 0);
+}
+
+void TestNested() {
+    std::string trace;
+    sylar::Fiber::ptr inner(new sylar::Fiber([&]() {
+        trace += "b";
+        sylar::Fiber::YieldToHold();
+        trace += "d";
+    }));
+    sylar::Fiber::ptr outer(new sylar::Fiber([&]() {
+        trace += "a";
+        inner->resume();
+        trace += "c";
+        inner->resume();
+        trace += "e";
+    }));
+    CHECK(outer->resume() == sylar::Fiber::TERM);
+    CHECK(trace == "abcde");
+}
+
+void TestResetAndExcept() {
+    int n = 0;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&]() { ++n; }, 64 * 1024));
+    for (int i = 0; i < 1000; ++i) {
+        CHECK(fiber->resume() == sylar::Fiber::TERM);
+        fiber->reset([&]() { ++n; });
+    }
+    CHECK(n == 1000);
+    fiber->reset([]() { throw std::runtime_error("oops"); });
+    CHECK(fiber->resume() == sylar::Fiber::EXCEPT);
+}
+
+void TestMigrate() {
+    std::vector<pid_t> tids;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&]() {
+        tids.push_back(sylar::GetThreadId());
+        sylar::Fiber::YieldToHold();
+        tids.push_back(sylar::GetThreadId());
+    }));
+    fiber->resume();
+    std::thread t([&]() {
+        CHECK(fiber->resume() == sylar::Fiber::TERM);
+    });
+    t.join();
+    CHECK(tids.size() == 2 && tids[0] != tids[1]);
+}
+
+}
+
+int main() {
+    TestSwitch();
+    TestNested();
+    TestResetAndExcept();
+    TestMigrate();
+    CHECK(sylar::Fiber::TotalFibers() == 0);
+    return CheckResult();
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "sylar/log.h"
+#include "sylar/iomanager.h"
+#include "sylar/fd_manager.h"
+#include "sylar/hook.h"
+#include "check.h"
+
+/**
+ * IOManager 的测试:
+ *   1. 定时器按到期时间执行, 取消的不执行, 循环定时器重复执行; 没有要求 hook 时不打开 hook
+ *   2. 打开 hook 后的 sleep 只挂起协程: 单线程上 100 个协程各睡 100ms, 总耗时远小于 10s
+ *   3. hook 后的 read 在 socketpair 上等数据, 设置 SO_RCVTIMEO 后超时返回 ETIMEDOUT
+ */
+
+namespace {
+
+void TestTimer() {
+    std::mutex mutex;
+    std::vector<int> order;
+    std::atomic<int> ticks{0};
+    std::atomic<bool> hooked{true};
+    {
+        sylar::IOManager iom(2, false, "timer");
+        // 没有要求 hook 的调度器不打开 hook
+        iom.schedule([&]() { hooked = sylar::is_hook_enable(); });
+        auto push = [&](int v) {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(v);
+        };
+        iom.addTimer(60, std::bind(push, 3));
+        iom.addTimer(20, std::bind(push, 1));
+        iom.addTimer(40, std::bind(push, 2));
+        sylar::Timer::ptr cancelled = iom.addTimer(30, std::bind(push, 100));
+        CHECK(cancelled->cancel());
+        CHECK(!cancelled->cancel());
+        sylar::Timer::ptr recurring;
+        recurring = iom.addTimer(10, [&]() {
+            if (++ticks == 5) {
+                recurring->cancel();
+            }
+        }, true);
+    }
+    CHECK((order == std::vector<int>{1, 2, 3}));
+    CHECK(ticks == 5);
+    CHECK(!hooked);
+}
+
+void TestSleep() {
+    std::atomic<int> done{0};
+    uint64_t start = sylar::GetMonotonicNS();
+    {
+        sylar::IOManager iom(1, false, "sleep", true);
+        for (int i = 0; i < 100; ++i) {
+            iom.schedule([&]() {
+                usleep(100 * 1000);
+                ++done;
+            });
+        }
+    }
+    uint64_t ms = (sylar::GetMonotonicNS() - start) / 1000000;
+    CHECK(done == 100);
+    CHECK(ms >= 100 && ms < 1000);
+}
+
+void TestReadTimeout() {
+    std::atomic<int> got{0};
+    std::atomic<int> err{0};
+    {
+        sylar::IOManager iom(2, false, "read", true);
+        iom.schedule([&]() {
+            int fds[2];
+            CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+            // socketpair 没有 hook, 手动登记
+            sylar::FdMgr::getInstance()->get(fds[0], true);
+            sylar::FdMgr::getInstance()->get(fds[1], true);
+            sylar::IOManager::GetThis()->schedule([fds]() {
+                usleep(50 * 1000);
+                write(fds[1], "ping", 4);
+            });
+            char buf[16];
+            got = read(fds[0], buf, sizeof(buf));
+
+            struct timeval tv = {0, 50 * 1000};
+            setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (read(fds[0], buf, sizeof(buf)) < 0) {
+                err = errno;
+            }
+            close(fds[0]);
+            close(fds[1]);
+        });
+    }
+    CHECK(got == 4);
+    CHECK(err == ETIMEDOUT);
+}
+
+}
+
+int main() {
+    TestTimer();
+    TestSleep();
+    TestReadTimeout();
+    return CheckResult();
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <atomic>
+#include <unistd.h>
+
+#include "sylar/log.h"
+#include "sylar/scheduler.h"
+#include "check.h"
+
+/**
+ * 调度器的测试:
+ *   1. 大量协程在多个线程间来回 yield, 全部执行完
+ *   2. YieldToHold 的协程由别的任务重新调度
+ *   3. 指定线程的任务只在该线程上运行
+ */
+
+namespace {
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+void TestManyFibers() {
+    const int N = 20000;
+    std::atomic<int> done{0};
+    std::atomic<int> yields{0};
+    {
+        sylar::Scheduler sc(4, true, "test");
+        sc.start();
+        for (int i = 0; i < N; ++i) {
+            sc.schedule([&, i]() {
+                for (int j = 0; j < 3; ++j) {
+                    sylar::Fiber::YieldToReady();
+                    ++yields;
+                }
+                if (i % 5000 == 0) {
+                    SYLAR_LOG_INFO(g_logger) << "fiber task " << i;
+                }
+                ++done;
+            });
+        }
+        sc.stop();
+    }
+    CHECK(done == N);
+    CHECK(yields == N * 3);
+    CHECK(sylar::Fiber::TotalFibers() == 0);
+}
+
+void TestHold() {
+    std::atomic<int> stage{0};
+    sylar::Scheduler sc(3, false, "hold");
+    sc.start();
+    sylar::Fiber::ptr waiter(new sylar::Fiber([&]() {
+        stage = 1;
+        sylar::Fiber::YieldToHold();
+        CHECK(stage == 2);
+        stage = 3;
+    }));
+    sc.schedule(waiter);
+    sc.schedule([&]() {
+        while (stage != 1) {
+            sylar::Fiber::YieldToReady();
+        }
+        stage = 2;
+        sylar::Scheduler::GetThis()->schedule(waiter);
+    });
+    sc.stop();
+    CHECK(stage == 3);
+}
+
+void TestPinned() {
+    sylar::Scheduler sc(3, false, "pinned");
+    sc.start();
+    std::atomic<pid_t> target{0};
+    sc.schedule([&]() { target = sylar::GetThreadId(); });
+    while (!target) {
+        usleep(100);
+    }
+    std::atomic<int> wrong{0};
+    std::atomic<int> count{0};
+    for (int i = 0; i < 1000; ++i) {
+        sc.schedule([&]() {
+            if (sylar::GetThreadId() != target) {
+                ++wrong;
+            }
+            ++count;
+        }, target.load());
+    }
+    sc.stop();
+    CHECK(count == 1000);
+    CHECK(wrong == 0);
+}
+
+}
+
+int main() {
+    TestManyFibers();
+    TestHold();
+    TestPinned();
+    return CheckResult();
+}
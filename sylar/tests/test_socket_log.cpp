@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "sylar/log.h"
+#include "check.h"
+
+/**
+ * SocketLogAppender 对本地监听 socket 的测试:
+ *   1. agent 未启动时日志留在缓冲区, 启动后全部送达
+ *   2. agent 重启后自动重连, 期间的日志不丢
+ *   3. unix 数据报 + RFC5424 分帧, 每条一个数据报
+ */
+
+namespace {
+
+int Listen(const std::string& path, int type) {
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, type, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(fd, 16) != 0)) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 接收一个连接上的数据, 按行计数, 直到收到 expect 行
+int ReceiveLines(int listenFd, int expect) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval tv = {3, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int lines = 0;
+    char buf[4096];
+    while (lines < expect) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; ++i) {
+            lines += buf[i] == '\n';
+        }
+    }
+    close(fd);
+    return lines;
+}
+
+void TestStream(const std::string& path) {
+    sylar::Logger::ptr logger(new sylar::Logger("socket"));
+    sylar::SocketLogAppender::ptr appender(new sylar::SocketLogAppender(sylar::SocketLogAppender::UNIX_STREAM, path));
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%p %m%n")));
+    logger->addAppender(appender);
+
+    // agent 还没启动
+    for (int i = 0; i < 100; ++i) {
+        SYLAR_LOG_INFO(logger) << "before listen " << i;
+    }
+    CHECK(!appender->isConnected());
+
+    int listenFd = Listen(path, SOCK_STREAM);
+    int received = 0;
+    std::thread agent([&]() { received = ReceiveLines(listenFd, 100); });
+    CHECK(appender->flush(5000));
+    agent.join();
+    CHECK(received == 100);
+
+    // agent 重启: 旧连接关闭, 新的监听 socket 稍后才出现
+    close(listenFd);
+    unlink(path.c_str());
+    for (int i = 0; i < 200; ++i) {
+        SYLAR_LOG_INFO(logger) << "while restarting " << i;
+    }
+    listenFd = Listen(path, SOCK_STREAM);
+    std::thread agent2([&]() { received = ReceiveLines(listenFd, 200); });
+    CHECK(appender->flush(5000));
+    agent2.join();
+    CHECK(received == 200);
+    CHECK(appender->getDropCount() == 0);
+
+    appender->stop();
+    close(listenFd);
+    unlink(path.c_str());
+}
+
+void TestDatagram(const std::string& path) {
+    int fd = Listen(path, SOCK_DGRAM);
+    sylar::Logger::ptr logger(new sylar::Logger("dgram"));
+    sylar::SocketLogAppender::ptr appender(new sylar::SocketLogAppender(sylar::SocketLogAppender::UNIX_DGRAM, path,
+                                                                        sylar::SocketLogAppender::RFC5424));
+    appender->setFormatter(sylar::LogFormatter::ptr(new sylar::LogFormatter("%m%n")));
+    appender->setAppName("test");
+    logger->addAppender(appender);
+
+    // unix 数据报的接收队列很短, agent 需要边收边处理
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int count = 0;
+    std::thread agent([&]() {
+        char buf[1024];
+        ssize_t n;
+        while (count < 50 && (n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+            buf[n] = '\0';
+            // <PRI>1 时间 主机 程序 pid - - 消息, user.warning = 8 + 4
+            CHECK(strncmp(buf, "<12>1 ", 6) == 0);
+            CHECK(strstr(buf, " test ") != nullptr);
+            CHECK(strstr(buf, "datagram ") != nullptr && buf[n - 1] != '\n');
+            ++count;
+        }
+    });
+    for (int i = 0; i < 50; ++i) {
+        SYLAR_LOG_WARN(logger) << "datagram " << i;
+    }
+    CHECK(appender->flush(5000));
+    agent.join();
+    CHECK(count == 50);
+    appender->stop();
+    close(fd);
+    unlink(path.c_str());
+}
+
+}
+
+int main() {
+    std::string base = "/tmp/sylar_socket_log_" + std::to_string(getpid());
+    TestStream(base + ".stream");
+    TestDatagram(base + ".dgram");
+    return CheckResult();
+}
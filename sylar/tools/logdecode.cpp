@@ -0,0 +1,444 @@
+/**
+ * sylar-logdecode: 把 BinLogWriter 写出的二进制日志还原成文本
+ *
+ *   sylar-logdecode [-p pattern] file...
+ *
+ * 默认使用文件头中记录的 LogFormatter 格式, -p 可以覆盖.
+ * 同一批落盘的记录按时间排序后输出.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sylar/log.h"
+
+
+namespace {
+
+using namespace sylar;
+
+struct Site {
+    int32_t line;
+    std::string file;
+    std::string fmt;
+    std::string types;
+};
+
+struct Value {
+    char type;
+    int64_t i;
+    uint64_t u;
+    double d;
+    std::string s;
+};
+
+struct Record {
+    uint64_t time;
+    uint32_t threadId;
+    uint32_t fiberId;
+    uint32_t elapse;
+    LogLevel::Level level;
+    int32_t line;
+    std::string file;
+    std::string message;
+};
+
+class Reader {
+private:
+    const char* m_p;
+    const char* m_end;
+    bool m_ok = true;
+public:
+    Reader(const char* p, size_t len) : m_p(p), m_end(p + len) {}
+
+    bool ok() const { return m_ok; }
+    const char* pos() const { return m_p; }
+
+    template<class T>
+    T fixed() {
+        T v = T();
+        if (m_end - m_p < (ptrdiff_t)sizeof(T)) {
+            m_ok = false;
+            m_p = m_end;
+            return v;
+        }
+        memcpy(&v, m_p, sizeof(T));
+        m_p += sizeof(T);
+        return v;
+    }
+
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_p >= m_end) {
+                m_ok = false;
+                return v;
+            }
+            uint8_t b = *m_p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+        m_ok = false;
+        return v;
+    }
+
+    std::string str() {
+        uint64_t len = varint();
+        if ((uint64_t)(m_end - m_p) < len) {
+            m_ok = false;
+            m_p = m_end;
+            return std::string();
+        }
+        std::string s(m_p, len);
+        m_p += len;
+        return s;
+    }
+};
+
+/**
+ * 按 printf 语法展开格式串, 参数按登记时的类型取出;
+ * 长度修饰符统一替换成 ll/无, 因为整数都以 64 位保存
+ */
+void FormatPrintf(std::string& out, const std::string& fmt, const std::vector<Value>& args) {
+    size_t next = 0;
+    char buf[512];
+    for (size_t i = 0; i < fmt.size(); ++i) {
+        if (fmt[i] != '%') {
+            out.append(1, fmt[i]);
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            out.append(1, '%');
+            ++i;
+            continue;
+        }
+
+        std::string spec = "%";
+        size_t j = i + 1;
+        while (j < fmt.size() && strchr("-+ #0'", fmt[j])) {
+            spec.append(1, fmt[j++]);
+        }
+        while (j < fmt.size() && (isdigit(fmt[j]) || fmt[j] == '*' || fmt[j] == '.')) {
+            if (fmt[j] == '*') {
+                int64_t v = next < args.size() ? args[next++].i : 0;
+                spec += std::to_string(v);
+            } else {
+                spec.append(1, fmt[j]);
+            }
+            ++j;
+        }
+        while (j < fmt.size() && strchr("hlLqjzt", fmt[j])) {
+            ++j;
+        }
+        if (j >= fmt.size()) {
+            out.append(fmt, i, std::string::npos);
+            break;
+        }
+        char conv = fmt[j];
+        i = j;
+
+        if (conv == 'n') {
+            continue;
+        }
+        if (next >= args.size()) {
+            out.append("<missing>");
+            continue;
+        }
+        const Value& v = args[next++];
+        int n = 0;
+        switch (conv) {
+        case 'd':
+        case 'i':
+            spec += "ll";
+            spec.append(1, conv);
+            n = snprintf(buf, sizeof(buf), spec.c_str(), v.type == binlog::ARG_INT ? (long long)v.i : (long long)v.u);
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec += "ll";
+            spec.append(1, conv);
+            n = snprintf(buf, sizeof(buf), spec.c_str(), v.type == binlog::ARG_INT ? (unsigned long long)v.i : (unsigned long long)v.u);
+            break;
+        case 'c':
+            spec.append(1, conv);
+            n = snprintf(buf, sizeof(buf), spec.c_str(), v.type == binlog::ARG_INT ? (int)v.i : (int)v.u);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec.append(1, conv);
+            n = snprintf(buf, sizeof(buf), spec.c_str(), v.d);
+            break;
+        case 'p':
+            spec.append(1, conv);
+            n = snprintf(buf, sizeof(buf), spec.c_str(), (void*)(uintptr_t)v.u);
+            break;
+        case 's':
+            if (v.type == binlog::ARG_STRING) {
+                spec.append(1, conv);
+                std::string tmp(v.s.size() + 256, '\0');
+                n = snprintf(&tmp[0], tmp.size(), spec.c_str(), v.s.c_str());
+                out.append(tmp.c_str(), std::min((size_t)n, tmp.size() - 1));
+                continue;
+            }
+            // fallthrough
+        default:
+            out.append("<bad %");
+            out.append(1, conv);
+            out.append(">");
+            continue;
+        }
+        if (n > 0) {
+            out.append(buf, std::min((size_t)n, sizeof(buf) - 1));
+        }
+    }
+}
+
+class Decoder {
+private:
+    std::string m_patternOverride;
+    std::map<uint32_t, Site> m_sites;
+    std::vector<Record> m_batch;
+    Logger::ptr m_logger;
+    LogFormatter::ptr m_formatter;
+    LogBuffer m_out;
+public:
+    Decoder(const std::string& pattern) : m_patternOverride(pattern) {}
+
+    bool decode(const std::string& data) {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            if (data.size() - pos >= sizeof(binlog::MAGIC)
+                    && memcmp(data.data() + pos, binlog::MAGIC, sizeof(binlog::MAGIC)) == 0) {
+                size_t len = readHeader(data.data() + pos, data.size() - pos);
+                if (!len) {
+                    return false;
+                }
+                pos += len;
+                continue;
+            }
+            if (data.size() - pos < binlog::RECORD_HEADER_SIZE || !m_formatter) {
+                std::cerr << "truncated or corrupt record at offset " << pos << std::endl;
+                break;
+            }
+            uint8_t type = data[pos];
+            uint32_t len;
+            memcpy(&len, data.data() + pos + 1, sizeof(len));
+            if (len < binlog::RECORD_HEADER_SIZE || len > data.size() - pos) {
+                std::cerr << "truncated or corrupt record at offset " << pos << std::endl;
+                break;
+            }
+            Reader rd(data.data() + pos + binlog::RECORD_HEADER_SIZE, len - binlog::RECORD_HEADER_SIZE);
+            switch (type) {
+            case binlog::BINLOG_SITE:
+                readSite(rd);
+                break;
+            case binlog::BINLOG_BATCH:
+                flushBatch();
+                break;
+            case binlog::BINLOG_LOG:
+                readLog(rd);
+                break;
+            case binlog::BINLOG_TEXT:
+                readText(rd);
+                break;
+            default:
+                std::cerr << "unknown record type " << (int)type << " at offset " << pos << std::endl;
+                break;
+            }
+            pos += len;
+        }
+        flushBatch();
+        return true;
+    }
+private:
+    size_t readHeader(const char* p, size_t len) {
+        flushBatch();
+        Reader rd(p + sizeof(binlog::MAGIC), len - sizeof(binlog::MAGIC));
+        uint32_t version = rd.fixed<uint32_t>();
+        uint32_t endian = rd.fixed<uint32_t>();
+        rd.fixed<uint64_t>();
+        std::string name = rd.str();
+        std::string pattern = rd.str();
+        std::string host = rd.str();
+        if (!rd.ok() || version != binlog::VERSION) {
+            std::cerr << "unsupported binlog header, version=" << version << std::endl;
+            return 0;
+        }
+        if (endian != binlog::ENDIAN_MARK) {
+            std::cerr << "binlog was written with a different byte order" << std::endl;
+            return 0;
+        }
+        // 每个进程的调用点 id 独立编号, 遇到新文件头要清空
+        m_sites.clear();
+        m_logger.reset(new Logger(name));
+        m_formatter.reset(new LogFormatter(m_patternOverride.empty() ? pattern : m_patternOverride));
+        return rd.pos() - p;
+    }
+
+    void readSite(Reader& rd) {
+        uint32_t id = rd.fixed<uint32_t>();
+        Site site;
+        site.line = rd.fixed<int32_t>();
+        site.file = rd.str();
+        site.fmt = rd.str();
+        site.types = rd.str();
+        if (rd.ok()) {
+            m_sites[id] = site;
+        }
+    }
+
+    void readLog(Reader& rd) {
+        uint32_t id = rd.fixed<uint32_t>();
+        Record rec;
+        rec.level = (LogLevel::Level)rd.fixed<uint8_t>();
+        rec.time = rd.fixed<uint64_t>();
+        rec.threadId = rd.fixed<uint32_t>();
+        rec.fiberId = rd.fixed<uint32_t>();
+        rec.elapse = rd.fixed<uint32_t>();
+        auto it = m_sites.find(id);
+        if (it == m_sites.end()) {
+            std::cerr << "record references unknown call site " << id << std::endl;
+            return;
+        }
+        const Site& site = it->second;
+        std::vector<Value> args;
+        for (char t : site.types) {
+            Value v;
+            v.type = t;
+            v.i = 0;
+            v.u = 0;
+            v.d = 0;
+            switch (t) {
+            case binlog::ARG_INT: {
+                uint64_t z = rd.varint();
+                v.i = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+                v.u = v.i;
+                v.d = v.i;
+                break;
+            }
+            case binlog::ARG_UINT:
+            case binlog::ARG_POINTER:
+                v.u = rd.varint();
+                v.i = v.u;
+                v.d = v.u;
+                break;
+            case binlog::ARG_DOUBLE:
+                v.d = rd.fixed<double>();
+                break;
+            case binlog::ARG_STRING:
+                v.s = rd.str();
+                break;
+            default:
+                break;
+            }
+            args.push_back(v);
+        }
+        if (!rd.ok()) {
+            std::cerr << "truncated arguments for call site " << id << std::endl;
+            return;
+        }
+        rec.line = site.line;
+        rec.file = site.file;
+        FormatPrintf(rec.message, site.fmt, args);
+        m_batch.push_back(std::move(rec));
+    }
+
+    void readText(Reader& rd) {
+        Record rec;
+        rec.time = rd.fixed<uint64_t>();
+        rec.threadId = rd.fixed<uint32_t>();
+        rec.fiberId = rd.fixed<uint32_t>();
+        rec.elapse = rd.fixed<uint32_t>();
+        rec.level = (LogLevel::Level)rd.fixed<uint8_t>();
+        rec.line = rd.fixed<int32_t>();
+        rec.file = rd.str();
+        rec.message = rd.str();
+        if (rd.ok()) {
+            m_batch.push_back(std::move(rec));
+        }
+    }
+
+    void flushBatch() {
+        std::stable_sort(m_batch.begin(), m_batch.end(), [](const Record& a, const Record& b) {
+            return a.time < b.time;
+        });
+        for (auto& rec : m_batch) {
+            LogEvent::ptr event(new LogEvent(m_logger, rec.level, rec.file.c_str(), rec.line, rec.elapse,
+                                             rec.threadId, rec.fiberId, rec.time / 1000000000ull,
+                                             rec.time % 1000000000ull));
+            event->getSS().write(rec.message.data(), rec.message.size());
+            m_out.clear();
+            m_formatter->format(m_out, m_logger, rec.level, event);
+            fwrite(m_out.data(), 1, m_out.size(), stdout);
+        }
+        m_batch.clear();
+    }
+};
+
+bool ReadFile(const char* path, std::string& data) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string pattern;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            pattern = optarg;
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [-p pattern] file..." << std::endl;
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "usage: " << argv[0] << " [-p pattern] file..." << std::endl;
+        return 1;
+    }
+
+    int rt = 0;
+    for (int i = optind; i < argc; ++i) {
+        std::string data;
+        if (!ReadFile(argv[i], data)) {
+            std::cerr << "open " << argv[i] << " failed" << std::endl;
+            rt = 1;
+            continue;
+        }
+        Decoder decoder(pattern);
+        if (!decoder.decode(data)) {
+            rt = 1;
+        }
+    }
+    fflush(stdout);
+    return rt;
+}
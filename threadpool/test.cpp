@@ -1,6 +1,15 @@
 #include "threadpool.hpp"
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <future>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 
 void print() {
@@ -8,13 +17,226 @@ void print() {
 }
 
 
+// 任务里继续拆分提交，子任务进本线程的队列，空闲线程去偷
+void split(ThreadPool* pool, std::atomic<long>* sum, long lo, long hi) {
+    if (hi - lo <= 1000) {
+        long s = 0;
+        for (long i = lo; i < hi; i++) s += i;
+        sum->fetch_add(s);
+        return;
+    }
+    long mid = (lo + hi) / 2;
+    pool->add([=]() { split(pool, sum, lo, mid); });
+    pool->add([=]() { split(pool, sum, mid, hi); });
+}
+
+
+int square(int x) {
+    return x * x;
+}
+
+
+int s_failed = 0;
+
+// 检查结果，失败的记下来，main 据此返回非 0
+const char* verdict(bool ok) {
+    if (!ok) {
+        ++s_failed;
+    }
+    return ok ? " ok" : " wrong";
+}
+
+
+// 计数器，可以等到计数达到目标，代替固定时长的 sleep
+class Counter {
+public:
+    void add() {
+        std::lock_guard<std::mutex> lock(mtx);
+        n++;
+        cv.notify_all();
+    }
+    int get() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return n;
+    }
+    // 等到了返回 true，最多等 timeout_ms
+    bool wait(int target, int timeout_ms = 10000) {
+        std::unique_lock<std::mutex> lock(mtx);
+        return cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]() { return n >= target; });
+    }
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    int n = 0;
+};
+
+
 int main() {
     std::shared_ptr<ThreadPool> pool(new ThreadPool());
-    
+
     std::function<void()> f = print;
     for (int i = 0; i < 5; i++) {
         pool->add(f);
     }
 
+    std::atomic<long> sum(0);
+    const long n = 10000000;
+    {
+        ThreadPool p(4);
+        p.add([&]() { split(&p, &sum, 0, n); });
+    }
+    std::cout << "sum " << sum << verdict(sum == n * (n - 1) / 2) << std::endl;
+
+    // submit 拿返回值，异常从 future 里抛出
+    {
+        ThreadPool p(2);
+        std::vector<std::future<int>> futures;
+        for (int i = 0; i < 10; i++) {
+            futures.push_back(p.submit(square, i));
+        }
+        int total = 0;
+        for (auto& f : futures) total += f.get();
+        std::cout << "square sum " << total << verdict(total == 285) << std::endl;
+
+        std::unique_ptr<int> moved(new int(42));    // 只能移动的捕获
+        std::future<int> f = p.submit([](std::unique_ptr<int>& v) { return *v; }, std::move(moved));
+        int v = f.get();
+        std::cout << "move only " << v << verdict(v == 42) << std::endl;
+
+        std::future<void> e = p.submit([]() { throw std::runtime_error("boom"); });
+        try {
+            e.get();
+            std::cout << "exception lost" << verdict(false) << std::endl;
+        } catch (const std::runtime_error& ex) {
+            std::cout << "exception " << ex.what() << std::endl;
+        }
+    }
+
+    // 任务积压时加线程，空闲超时后退回 min
+    {
+        ThreadPool p(1, 8);
+        p.set_idle_timeout(50);
+        p.set_grow_threshold(1, 0);
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+        Counter started, finished;
+        // 任务都卡在 gate 上，线程只能由后面的提交加出来；一直提交到 4 个任务同时在跑
+        int submitted = 0;
+        while (submitted < 5000 && !started.wait(4, 1)) {
+            p.add([&started, &finished, opened]() {
+                started.add();
+                opened.wait();
+                finished.add();
+            });
+            submitted++;
+        }
+        int peak = p.size();
+        gate.set_value();
+        bool drained = finished.wait(submitted);
+        // 线程退出没有事件可等，只能轮询，最多 10 秒
+        for (int i = 0; i < 10000 && p.size() != 1; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::cout << "elastic peak " << peak << " idle " << p.size()
+                  << verdict(peak >= 4 && drained && p.size() == 1) << std::endl;
+
+        p.resize(4, 4);
+        std::cout << "resize " << p.size() << verdict(p.size() == 4) << std::endl;
+    }
+
+    // 优先级和截止时间：唯一的线程被堵住时排队，放开后先执行 CRITICAL，过期的不执行
+    {
+        ThreadPool p(1);
+        std::atomic<int> expired(0);
+        p.set_expired_handler([&](ThreadPool::Priority) { expired++; });
+        std::promise<void> gate, running;
+        std::shared_future<void> opened = gate.get_future().share();
+        std::future<void> blocked = running.get_future();
+        p.add([&running, opened]() { running.set_value(); opened.wait(); });
+        blocked.wait();     // 唯一的线程已经卡在 gate 上，后面的任务都在排队
+
+        std::mutex mtx;
+        std::vector<int> order;
+        std::vector<std::future<void>> futures;
+        for (int i = 0; i < 3; i++) {
+            futures.push_back(p.submit(ThreadPool::BACKGROUND, [&]() { std::lock_guard<std::mutex> l(mtx); order.push_back(ThreadPool::BACKGROUND); }));
+            futures.push_back(p.submit(ThreadPool::CRITICAL, [&]() { std::lock_guard<std::mutex> l(mtx); order.push_back(ThreadPool::CRITICAL); }));
+        }
+        // 截止时间在入队前就过了，轮到它时一定过期
+        ThreadPool::TaskOptions late(ThreadPool::NORMAL, ThreadPool::Clock::now() - std::chrono::milliseconds(1));
+        std::future<int> dropped = p.submit(late, square, 3);
+        gate.set_value();
+
+        try {
+            dropped.get();
+            std::cout << "deadline ignored" << verdict(false) << std::endl;
+        } catch (const std::future_error&) {
+            std::cout << "deadline dropped, expired " << expired << verdict(expired == 1) << std::endl;
+        }
+        for (auto& f : futures) f.get();
+        std::lock_guard<std::mutex> l(mtx);
+        // 防饿死最多让一个 BACKGROUND 插到前面，三个 CRITICAL 都在最后两个 BACKGROUND 之前
+        bool critical_first = order.size() == 6
+            && std::count(order.begin(), order.end(), (int)ThreadPool::CRITICAL) == 3
+            && order[4] == ThreadPool::BACKGROUND && order[5] == ThreadPool::BACKGROUND;
+        ThreadPool::LaneStats st = p.stats(ThreadPool::BACKGROUND);
+        std::cout << "priority" << verdict(critical_first) << ", background executed " << st.executed
+                  << " max wait " << st.max_wait_us << "us" << std::endl;
+    }
+
+    // 有界队列：唯一的线程被堵住后把队列塞满，再看各种溢出策略
+    {
+        ThreadPool p(1, 1, 4);
+        std::promise<void> gate, running;
+        std::shared_future<void> opened = gate.get_future().share();
+        std::future<void> blocked = running.get_future();
+        p.add([&running, opened]() { running.set_value(); opened.wait(); });
+        blocked.wait();
+
+        std::atomic<int> done(0);
+        int accepted = 0;
+        while (p.try_add([&]() { done++; })) {
+            accepted++;
+        }
+
+        int rejected = 0;
+        p.set_reject_handler([&](ThreadPool::Priority) { rejected++; });
+        p.set_overflow_policy(ThreadPool::REJECT);
+        p.add([&]() { done++; });
+
+        std::thread::id runner;
+        p.set_overflow_policy(ThreadPool::CALLER_RUNS);
+        p.add([&]() { runner = std::this_thread::get_id(); });
+        // 在提交线程里执行也要检查截止时间并计入统计
+        ThreadPool::LaneStats before = p.stats(ThreadPool::NORMAL);
+        ThreadPool::TaskOptions past(ThreadPool::NORMAL, ThreadPool::Clock::now() - std::chrono::milliseconds(1));
+        p.add(past, [&]() { done++; });
+        ThreadPool::LaneStats after = p.stats(ThreadPool::NORMAL);
+        bool caller_stats = after.executed == before.executed && after.expired == before.expired + 1;
+
+        bool timeout = false;
+        p.set_overflow_policy(ThreadPool::BLOCK, 20);
+        try {
+            p.add([&]() { done++; });
+        } catch (const std::runtime_error&) {
+            timeout = true;
+        }
+
+        gate.set_value();
+        p.set_overflow_policy(ThreadPool::BLOCK);
+        for (int i = 0; i < 100; i++) {     // 满了就等，最后都能执行
+            p.add([&]() { done++; });
+        }
+        // 只有一个线程，同一条队列先进先出，最后这个做完前面的都做完了
+        p.submit([]() {}).get();
+        bool ok = accepted == 4 && rejected == 1 && runner == std::this_thread::get_id() && caller_stats && timeout && done == 104;
+        std::cout << "bounded accepted " << accepted << " done " << done << verdict(ok) << std::endl;
+    }
+
+    if (s_failed) {
+        std::cout << s_failed << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all passed" << std::endl;
     return 0;
 }
@@ -1,49 +1,648 @@
 #include <vector>
-#include <queue>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <chrono>
+#include <algorithm>
+#include <future>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
 
 
+/**
+ * Chase-Lev 工作窃取双端队列（按 Lê 等人给出的 C11 内存序版本）。
+ * 只有所属线程调用 push/pop，在底部后进先出；其他线程调用 steal，从顶部先进先出地偷。
+ * 元素是指针，数组满了就换一个两倍大的，旧数组留到析构时再释放，正在偷的线程可能还在读它
+ */
+template<typename T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256);
+    ~WorkStealingDeque();
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    void push(T item);
+    bool pop(T& item);
+    bool steal(T& item);
+    bool empty() const;
+    int64_t size() const;   // 其他线程调用时只是近似值
+private:
+    struct Array {
+        int64_t capacity;
+        int64_t mask;
+        std::atomic<T>* buffer;
+
+        explicit Array(int64_t c) : capacity(c), mask(c - 1), buffer(new std::atomic<T>[c]) {}
+        ~Array() { delete[] buffer; }
+
+        T get(int64_t i) const { return buffer[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T x) { buffer[i & mask].store(x, std::memory_order_relaxed); }
+
+        Array* grow(int64_t bottom, int64_t top) const {
+            Array* a = new Array(capacity * 2);
+            for (int64_t i = top; i != bottom; i++) {
+                a->put(i, get(i));
+            }
+            return a;
+        }
+    };
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Array*> array;
+    std::vector<Array*> garbage;    // 换下来的旧数组，只有所属线程访问
+};
+
+
+template<typename T>
+WorkStealingDeque<T>::WorkStealingDeque(int64_t capacity) : top(0), bottom(0) {
+    int64_t c = 1;
+    while (c < capacity) c <<= 1;
+    array.store(new Array(c), std::memory_order_relaxed);
+}
+
+
+template<typename T>
+WorkStealingDeque<T>::~WorkStealingDeque() {
+    for (Array* a : garbage) {
+        delete a;
+    }
+    delete array.load(std::memory_order_relaxed);
+}
+
+
+template<typename T>
+void WorkStealingDeque<T>::push(T item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+        Array* bigger = a->grow(b, t);
+        garbage.push_back(a);
+        a = bigger;
+        array.store(a, std::memory_order_release);
+    }
+    a->put(b, item);
+    bottom.store(b + 1, std::memory_order_release);
+}
+
+
+template<typename T>
+bool WorkStealingDeque<T>::pop(T& item) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {    // 空的
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    item = a->get(b);
+    if (t == b) {   // 最后一个元素，和偷的线程抢
+        bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+
+template<typename T>
+bool WorkStealingDeque<T>::steal(T& item) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+    Array* a = array.load(std::memory_order_acquire);
+    item = a->get(t);
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+
+template<typename T>
+int64_t WorkStealingDeque<T>::size() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+
+template<typename T>
+bool WorkStealingDeque<T>::empty() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b <= t;
+}
+
+
+/**
+ * 有界多生产者多消费者环形队列（Vyukov 的做法）。
+ * 数组构造时一次分配好，每个格子带一个序号，生产者和消费者各自 CAS 自己的位置，不用锁；
+ * 满了 push 返回 false，空了 pop 返回 false
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity);
+    ~BoundedQueue() { delete[] buffer; }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool push(T item);
+    bool pop(T& item);
+    size_t size() const;    // 近似值
+    size_t capacity() const { return mask + 1; }
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    Cell* buffer;
+    size_t mask;
+    char pad0[64];      // 生产者和消费者的位置放在不同的缓存行
+    std::atomic<size_t> enqueue_pos;
+    char pad1[64];
+    std::atomic<size_t> dequeue_pos;
+    char pad2[64];
+};
+
+
+template<typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) : enqueue_pos(0), dequeue_pos(0) {
+    size_t c = 2;
+    while (c < capacity) c <<= 1;
+    buffer = new Cell[c];
+    mask = c - 1;
+    for (size_t i = 0; i < c; i++) {
+        buffer[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+
+template<typename T>
+bool BoundedQueue<T>::push(T item) {
+    Cell* cell;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &buffer[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {     // 格子空着，抢这个位置
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {   // 上一圈的数据还没被取走，满了
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->data = item;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+
+template<typename T>
+bool BoundedQueue<T>::pop(T& item) {
+    Cell* cell;
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &buffer[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {   // 还没写进来，空的
+            return false;
+        } else {
+            pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    item = cell->data;
+    cell->seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+
+template<typename T>
+size_t BoundedQueue<T>::size() const {
+    size_t d = dequeue_pos.load(std::memory_order_relaxed);
+    size_t e = enqueue_pos.load(std::memory_order_relaxed);
+    return e > d ? e - d : 0;
+}
+
+
+/**
+ * 只能移动的任务包装，代替 std::function<void()>。
+ * 不超过 BUFFER_SIZE 字节、移动不抛异常的可调用对象直接放在内部缓冲区里，不用在堆上分配；
+ * 更大的才 new 一份，缓冲区里只存指针
+ */
+class Task {
+public:
+    Task() : ops(nullptr) {}
+
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) : ops(nullptr) {
+        typedef typename std::decay<F>::type Fn;
+        init<Fn>(std::forward<F>(f), std::integral_constant<bool, fits<Fn>()>());
+    }
+
+    // 只有移动不抛异常的可调用对象才放在缓冲区里，堆上的只移动指针，所以移动不会抛异常
+    Task(Task&& other) noexcept : ops(other.ops) {
+        if (ops) {
+            ops->move(storage, other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            clear();
+            if (other.ops) {
+                other.ops->move(storage, other.storage);
+                ops = other.ops;
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { clear(); }
+
+    void operator()() { ops->call(storage); }
+    explicit operator bool() const { return ops != nullptr; }
+
+    void clear() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+private:
+    static const size_t BUFFER_SIZE = 64;
+    typedef std::aligned_storage<BUFFER_SIZE, alignof(std::max_align_t)>::type Storage;
+
+    struct Ops {
+        void (*call)(Storage&);
+        void (*move)(Storage& dst, Storage& src);   // 移到 dst 并析构 src
+        void (*destroy)(Storage&);
+    };
+
+    template<typename Fn>
+    static constexpr bool fits() {
+        return sizeof(Fn) <= BUFFER_SIZE && alignof(std::max_align_t) % alignof(Fn) == 0
+            && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    // 放在缓冲区里
+    template<typename Fn>
+    struct Inline {
+        static Fn& get(Storage& s) { return *reinterpret_cast<Fn*>(&s); }
+        static void call(Storage& s) { get(s)(); }
+        static void move(Storage& dst, Storage& src) noexcept {
+            new (&dst) Fn(std::move(get(src)));
+            get(src).~Fn();
+        }
+        static void destroy(Storage& s) { get(s).~Fn(); }
+        static const Ops* table() {
+            static const Ops t = {&call, &move, &destroy};
+            return &t;
+        }
+    };
+
+    // 放在堆上，缓冲区里存指针
+    template<typename Fn>
+    struct Heap {
+        static Fn*& get(Storage& s) { return *reinterpret_cast<Fn**>(&s); }
+        static void call(Storage& s) { (*get(s))(); }
+        static void move(Storage& dst, Storage& src) noexcept { new (&dst) Fn*(get(src)); }
+        static void destroy(Storage& s) { delete get(s); }
+        static const Ops* table() {
+            static const Ops t = {&call, &move, &destroy};
+            return &t;
+        }
+    };
+
+    template<typename Fn, typename F>
+    void init(F&& f, std::true_type) {
+        new (&storage) Fn(std::forward<F>(f));
+        ops = Inline<Fn>::table();
+    }
+
+    template<typename Fn, typename F>
+    void init(F&& f, std::false_type) {
+        new (&storage) Fn*(new Fn(std::forward<F>(f)));
+        ops = Heap<Fn>::table();
+    }
+
+    Storage storage;
+    const Ops* ops;
+};
+
+static_assert(std::is_nothrow_move_constructible<Task>::value && std::is_nothrow_move_assignable<Task>::value,
+              "Task moves must not throw");
+
+
+/**
+ * 工作窃取线程池。
+ * 每个工作线程有自己的 Chase-Lev 队列，任务里再 add 的任务放进本线程的队列（后进先出，数据还在缓存里）；
+ * 外部线程 add 的任务放进共享的注入队列。工作线程按 本地队列 -> 注入队列 -> 随机偷别的线程 的顺序找任务，
+ * 都没有才睡眠。每 61 次先看一次注入队列，避免本地任务不断产生时外部任务饿死。
+ * 线程数在 [min, max] 之间伸缩：所有线程都在忙时，积压任务数超过阈值或任务等待时间太长就加线程，
+ * 线程由常驻的 spawner 线程创建，提交者只做标记；空闲超时就退出，最少保留 min 个。
+ * 任务分 CRITICAL / NORMAL / BACKGROUND 三条队列，先取高优先级的；每 8 次先看一次 NORMAL，
+ * 每 64 次先看一次 BACKGROUND，低优先级不会一直饿着。任务可以带截止时间，过期的不执行，交给过期回调。
+ * 外部线程提交的任务进每条优先级一个的有界环形队列，满了按溢出策略处理：等待、在调用线程里执行或者拒绝；
+ * 任务里再提交的任务进本线程的队列，不受容量限制，不会在工作线程里阻塞
+ */
 class ThreadPool {
 public:
-    ThreadPool(int size=2);
+    // f(args...) 的返回值类型
+    template<typename F, typename... Args>
+    using Result = typename std::result_of<typename std::decay<F>::type&(typename std::decay<Args>::type&...)>::type;
+
+    typedef std::chrono::steady_clock Clock;
+
+    enum Priority {
+        CRITICAL = 0,
+        NORMAL = 1,
+        BACKGROUND = 2,
+    };
+    static const int LANES = 3;
+
+    struct TaskOptions {
+        Priority priority;
+        Clock::time_point deadline;     // 开始执行时超过这个时间就丢掉
+
+        TaskOptions(Priority p = NORMAL, Clock::time_point d = Clock::time_point::max())
+            : priority(p), deadline(d) {}
+    };
+
+    // 每条队列的统计，各工作线程的计数加起来
+    struct LaneStats {
+        uint64_t executed = 0;      // 执行了的任务数
+        uint64_t expired = 0;       // 过期丢掉的任务数
+        uint64_t wait_us = 0;       // 从入队到开始执行的累计等待时间
+        uint64_t max_wait_us = 0;
+    };
+
+    // 过期任务的回调，在工作线程里调用
+    typedef std::function<void(Priority)> ExpiredHandler;
+
+    // 队列满了怎么办
+    enum OverflowPolicy {
+        BLOCK,          // 等到有空位，可以设超时，超时抛异常
+        CALLER_RUNS,    // 在提交的线程里直接执行
+        REJECT,         // 丢掉并调用拒绝回调
+    };
+    typedef std::function<void(Priority)> RejectHandler;
+    static const size_t DEFAULT_CAPACITY = 8192;
+
+    ThreadPool(int size=2);     // 固定大小
+    // 按负载伸缩，max 同时是线程数的上限；capacity 是每条优先级队列最多积压的外部任务数
+    ThreadPool(int min_threads, int max_threads, size_t capacity = DEFAULT_CAPACITY);
     ~ThreadPool();
-    void add(std::function<void()>);
+
+    template<typename F>
+    void add(F&& f);
+    template<typename F>
+    void add(const TaskOptions& options, F&& f);
+
+    // 队列满了不等待，直接返回 false，任务被丢掉
+    template<typename F>
+    bool try_add(F&& f);
+    template<typename F>
+    bool try_add(const TaskOptions& options, F&& f);
+
+    // 提交任务并通过 future 拿到返回值，任务抛出的异常也从 future.get() 抛出；
+    // 过期丢掉的任务 future.get() 抛 broken_promise
+    template<typename F, typename... Args>
+    std::future<Result<F, Args...>> submit(F&& f, Args&&... args);
+    template<typename F, typename... Args>
+    std::future<Result<F, Args...>> submit(const TaskOptions& options, F&& f, Args&&... args);
+
+    void set_expired_handler(ExpiredHandler handler);
+    LaneStats stats(Priority lane) const;
+
+    // timeout_ms 只对 BLOCK 有效，小于 0 一直等
+    void set_overflow_policy(OverflowPolicy policy, int timeout_ms = -1);
+    void set_reject_handler(RejectHandler handler);
+    size_t capacity() const { return injection[0]->capacity(); }
+
+    int size() const { return live.load(std::memory_order_relaxed); }
+    int min_threads() const { return min_size.load(std::memory_order_relaxed); }
+    int max_threads() const { return max_size.load(std::memory_order_relaxed); }
+    // 调整上下限，max 不能超过构造时的 max；多出来的线程做完手上的任务后退出
+    void resize(int min_threads, int max_threads);
+    // 空闲多久退出
+    void set_idle_timeout(int ms);
+    // 积压任务数超过 depth * 当前线程数，或任务等待超过 wait_ms 时加线程
+    void set_grow_threshold(int depth, int wait_ms);
+    // 后台加线程时创建线程失败的次数
+    uint64_t spawn_failures() const { return spawn_failed.load(std::memory_order_relaxed); }
 private:
-    std::vector<std::thread> threads;
-    std::queue<std::function<void()>> tasks;
-    std::mutex tasks_mtx;
+
+    // 队列里存的是节点指针，节点从线程局部的缓存里分配，用完还回去，稳定运行时不再 new
+    struct TaskNode {
+        Task task;
+        TaskNode* next = nullptr;
+        Clock::time_point enqueue;  // 入队时间，用来算等待时长
+        Clock::time_point deadline;
+        int lane = NORMAL;
+    };
+
+    // 把 promise 和可调用对象放在一起，整体放进 Task 的缓冲区
+    template<typename R, typename Fn>
+    struct PromiseTask {
+        std::promise<R> promise;
+        Fn fn;
+
+        explicit PromiseTask(Fn&& f) : fn(std::move(f)) {}
+
+        void operator()() {
+            try {
+                call(std::is_void<R>());
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        }
+        void call(std::true_type) { fn(); promise.set_value(); }
+        void call(std::false_type) { promise.set_value(fn()); }
+    };
+
+    // 工作线程的计数器只有所属线程写，读的时候汇总，避免所有线程抢同一个计数器；
+    // CALLER_RUNS 的计数器由提交线程共同写，用原子加
+    struct LaneCounter {
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> expired{0};
+        std::atomic<uint64_t> wait_us{0};
+        std::atomic<uint64_t> max_wait_us{0};
+    };
+
+    struct Worker {
+        WorkStealingDeque<TaskNode*> deques[LANES];
+        LaneCounter counters[LANES];
+        uint32_t tick = 0;
+        uint32_t rand = 0;
+        std::atomic<bool> active{false};    // 槽位上有线程在跑
+    };
+
+    // 当前线程所在的线程池和对应的工作线程，外部线程为空
+    struct Current {
+        ThreadPool* pool = nullptr;
+        Worker* worker = nullptr;
+    };
+    static Current& current() {
+        static thread_local Current cur;
+        return cur;
+    }
+
+    // 节点缓存：每个线程攒一批，多了整批交给全局，空了从全局整批拿
+    static const int NODE_BATCH = 64;
+    struct NodeStash {
+        std::mutex mtx;
+        std::vector<TaskNode*> batches;     // 每项是 NODE_BATCH 个节点串成的链表
+    };
+    struct NodeCache {
+        TaskNode* head = nullptr;
+        int count = 0;
+        ~NodeCache();
+    };
+    static NodeStash& node_stash();
+    static NodeCache& node_cache();
+    static TaskNode* new_node();
+    static void free_node(TaskNode* node);
+
+    template<typename F, typename... Args>
+    std::future<Result<F, Args...>> submit_task(const TaskOptions& options, F&& f, Args&&... args);
+    void check_stop();
+    bool push(TaskNode* node, bool try_only = false);
+    bool overflow(TaskNode* node);
+    bool wait_for_space(TaskNode* node, int64_t timeout_ms);
+    void release(TaskNode* node);
+    void maybe_grow();
+    void request_grow();
+    void spawner_loop();
+    bool spawn_worker();
+    bool spawn_locked();
+    void spawn_done();
+    bool try_retire(int floor);
+    void worker_loop(int index);
+    bool find_task(Worker& self, int index, TaskNode*& node);
+    bool find_in_lane(Worker& self, int index, int lane, bool injection_first, TaskNode*& node);
+    bool pop_injection(int lane, TaskNode*& node);
+    bool steal_task(Worker& self, int index, int lane, TaskNode*& node);
+    bool has_work();
+    bool local_empty(Worker& self);
+    void notify();
+    void run(Worker& self, TaskNode* node);
+    void execute(LaneCounter& c, TaskNode* node, Clock::time_point now, bool shared);
+    static void count(std::atomic<uint64_t>& v, uint64_t n, bool shared);
+
+    std::vector<std::unique_ptr<Worker>> workers;   // 按 max 预先分配好的槽位，不会再变
+    std::vector<std::thread> threads;               // 只有拿到 spawning 的线程能动
+    std::atomic<int> slot_count;    // 用到过的最大槽位 + 1，偷任务和统计只扫到这里
+    std::atomic<int> live;          // 当前线程数
+    std::atomic<int> min_size;
+    std::atomic<int> max_size;
+    std::atomic<int> grow_depth;
+    std::atomic<int64_t> grow_wait_us;
+    std::atomic<int64_t> idle_timeout_ms;
+    std::atomic<bool> spawning;     // 同一时间只有一个线程在创建线程
+    std::atomic<bool> grow_requested;   // 提交者和工作线程只做标记，由 spawner 创建线程
+    std::atomic<uint64_t> spawn_failed;
+    std::thread spawner;            // 常驻的加线程线程，max 大于 1 时才有
+    std::mutex spawn_mtx;
+    std::condition_variable spawn_cv;   // 有加线程请求，或者一次加线程/线程退出结束
+    int spawn_events;               // 加线程和线程退出结束的次数，spawn_mtx 保护
+    bool spawner_exit;              // spawn_mtx 保护
+    std::atomic<int64_t> pending;   // 排队中的任务数，入队加出队减，只是近似值，用来判断要不要加线程
+
+    std::unique_ptr<BoundedQueue<TaskNode*>> injection[LANES];   // 外部线程提交的任务
+    std::atomic<int> overflow_policy;
+    std::atomic<int64_t> block_timeout_ms;
+    std::shared_ptr<RejectHandler> reject_handler;      // 用 atomic_load/atomic_store 访问
+    std::mutex space_mtx;
+    std::condition_variable space_cv;
+    std::atomic<int> blocked;       // 在等空位的外部线程数
+    LaneCounter caller_counters[LANES];     // CALLER_RUNS 在提交线程里执行的任务
+    std::shared_ptr<ExpiredHandler> expired_handler;    // 用 atomic_load/atomic_store 访问
+
+    std::mutex park_mtx;
     std::condition_variable cv;
-    bool stop;
+    std::atomic<int> idle;          // 准备睡眠或在睡眠的线程数
+    int wakeups;                    // 还没被领走的唤醒次数，park_mtx 保护
+    std::atomic<bool> stop;
 };
 
 
-ThreadPool::ThreadPool(int size) : stop(false) {
-    for (int i = 0; i < size; i++) {
-        threads.emplace_back(std::thread([this]() {
-            while (true) {
-                std::function<void()> task;
-                {   // 在作用域内对 std::mutex 加 unique_lock 锁，出了作用域会自动解锁
-                    std::unique_lock<std::mutex> lock(tasks_mtx);
-                    cv.wait(lock, [this]() {    // 等待条件变量，任务队列不为空或线程池停止时停止等待
-                        return stop || !tasks.empty();
-                    });
-                    if (stop && tasks.empty()) return;
-                    task = tasks.front();
-                    tasks.pop();
-                }
-                task();
-            }
-        }));
+inline ThreadPool::ThreadPool(int size) : ThreadPool(size, size) {}
+
+
+inline ThreadPool::ThreadPool(int min_threads, int max_threads, size_t capacity)
+    : slot_count(0), live(0), min_size(0), max_size(0), grow_depth(8), grow_wait_us(10000),
+      idle_timeout_ms(60000), spawning(false), grow_requested(false), spawn_failed(0),
+      spawn_events(0), spawner_exit(false), pending(0), overflow_policy(BLOCK), block_timeout_ms(-1),
+      blocked(0), idle(0), wakeups(0), stop(false) {
+    for (auto& q : injection) {
+        q.reset(new BoundedQueue<TaskNode*>(capacity));
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (min_threads < 1) min_threads = 1;
+    if (min_threads > max_threads) min_threads = max_threads;
+    min_size = min_threads;
+    max_size = max_threads;
+    for (int i = 0; i < max_threads; i++) {
+        workers.emplace_back(new Worker);
+        workers.back()->rand = 0x9E3779B9u * (i + 1);
+    }
+    threads.resize(max_threads);
+    for (int i = 0; i < min_threads; i++) {
+        spawn_worker();
+    }
+    if (max_threads > 1) {
+        spawner = std::thread([this]() {
+            spawner_loop();
+        });
     }
 }
 
 
-ThreadPool::~ThreadPool() {
+inline ThreadPool::~ThreadPool() {
+    if (spawner.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(spawn_mtx);
+            spawner_exit = true;
+        }
+        spawn_cv.notify_all();
+        spawner.join();
+    }
+    // 占住 spawning 不再放开，之后不会再创建线程，threads 也只归这里用
+    while (spawning.exchange(true, std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
     {
-        std::unique_lock<std::mutex> lock(tasks_mtx);
+        std::unique_lock<std::mutex> lock(park_mtx);
         stop = true;
     }
     cv.notify_all();
@@ -55,13 +654,643 @@ ThreadPool::~ThreadPool() {
 }
 
 
-void ThreadPool::add(std::function<void()> task) {
+inline void ThreadPool::resize(int min_threads, int max_threads) {
+    if (max_threads > (int)workers.size()) max_threads = (int)workers.size();
+    if (max_threads < 1) max_threads = 1;
+    if (min_threads < 1) min_threads = 1;
+    if (min_threads > max_threads) min_threads = max_threads;
+    min_size = min_threads;
+    max_size = max_threads;
+    while (live.load() < min_threads && !stop) {
+        int events;
+        {
+            std::unique_lock<std::mutex> lock(spawn_mtx);
+            events = spawn_events;
+        }
+        if (spawn_worker()) {
+            continue;
+        }
+        // 别的线程正在加线程，或者退出的线程还没让出槽位，等它结束再试，最多等 10ms
+        std::unique_lock<std::mutex> lock(spawn_mtx);
+        spawn_cv.wait_for(lock, std::chrono::milliseconds(10), [&]() {
+            return spawn_events != events;
+        });
+    }
+    if (live.load() > max_threads) {
+        std::unique_lock<std::mutex> lock(park_mtx);
+        cv.notify_all();    // 睡着的线程醒来看到超出上限就退出
+    }
+}
+
+
+inline void ThreadPool::set_idle_timeout(int ms) {
+    idle_timeout_ms = ms < 1 ? 1 : ms;
+}
+
+
+inline void ThreadPool::set_grow_threshold(int depth, int wait_ms) {
+    grow_depth = depth < 1 ? 1 : depth;
+    grow_wait_us = (int64_t)(wait_ms < 0 ? 0 : wait_ms) * 1000;
+}
+
+
+inline void ThreadPool::check_stop() {
+    // 停止后外部不能再提交；正在收尾的任务还可以继续拆分提交
+    if (current().pool != this && stop.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("ThreadPool already stop, can't add task!");
+    }
+}
+
+
+template<typename F>
+void ThreadPool::add(F&& f) {
+    add(TaskOptions(), std::forward<F>(f));
+}
+
+
+template<typename F>
+void ThreadPool::add(const TaskOptions& options, F&& f) {
+    check_stop();
+    TaskNode* node = new_node();
+    node->task = Task(std::forward<F>(f));
+    node->lane = options.priority;
+    node->deadline = options.deadline;
+    push(node);
+}
+
+
+template<typename F>
+bool ThreadPool::try_add(F&& f) {
+    return try_add(TaskOptions(), std::forward<F>(f));
+}
+
+
+template<typename F>
+bool ThreadPool::try_add(const TaskOptions& options, F&& f) {
+    check_stop();
+    TaskNode* node = new_node();
+    node->task = Task(std::forward<F>(f));
+    node->lane = options.priority;
+    node->deadline = options.deadline;
+    return push(node, true);
+}
+
+
+template<typename F, typename... Args>
+std::future<ThreadPool::Result<F, Args...>> ThreadPool::submit(F&& f, Args&&... args) {
+    return submit_task(TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+
+template<typename F, typename... Args>
+std::future<ThreadPool::Result<F, Args...>> ThreadPool::submit(const TaskOptions& options, F&& f, Args&&... args) {
+    return submit_task(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+
+template<typename F, typename... Args>
+std::future<ThreadPool::Result<F, Args...>> ThreadPool::submit_task(const TaskOptions& options, F&& f, Args&&... args) {
+    typedef Result<F, Args...> R;
+    typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) Fn;
+    check_stop();
+    PromiseTask<R, Fn> pt(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    std::future<R> future = pt.promise.get_future();
+    TaskNode* node = new_node();
+    node->task = Task(std::move(pt));
+    node->lane = options.priority;
+    node->deadline = options.deadline;
+    push(node);
+    return future;
+}
+
+
+inline void ThreadPool::set_expired_handler(ExpiredHandler handler) {
+    std::shared_ptr<ExpiredHandler> h;
+    if (handler) {
+        h = std::make_shared<ExpiredHandler>(std::move(handler));
+    }
+    std::atomic_store(&expired_handler, h);
+}
+
+
+inline void ThreadPool::set_overflow_policy(OverflowPolicy policy, int timeout_ms) {
+    overflow_policy = policy;
+    block_timeout_ms = timeout_ms;
+}
+
+
+inline void ThreadPool::set_reject_handler(RejectHandler handler) {
+    std::shared_ptr<RejectHandler> h;
+    if (handler) {
+        h = std::make_shared<RejectHandler>(std::move(handler));
+    }
+    std::atomic_store(&reject_handler, h);
+}
+
+
+inline ThreadPool::LaneStats ThreadPool::stats(Priority lane) const {
+    LaneStats st;
+    int n = slot_count.load(std::memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        const LaneCounter& c = workers[i]->counters[lane];
+        st.executed += c.executed.load(std::memory_order_relaxed);
+        st.expired += c.expired.load(std::memory_order_relaxed);
+        st.wait_us += c.wait_us.load(std::memory_order_relaxed);
+        st.max_wait_us = std::max(st.max_wait_us, c.max_wait_us.load(std::memory_order_relaxed));
+    }
+    const LaneCounter& c = caller_counters[lane];
+    st.executed += c.executed.load(std::memory_order_relaxed);
+    st.expired += c.expired.load(std::memory_order_relaxed);
+    st.wait_us += c.wait_us.load(std::memory_order_relaxed);
+    st.max_wait_us = std::max(st.max_wait_us, c.max_wait_us.load(std::memory_order_relaxed));
+    return st;
+}
+
+
+inline bool ThreadPool::push(TaskNode* node, bool try_only) {
+    node->enqueue = Clock::now();
+    Current& cur = current();
+    if (cur.pool == this) {     // 工作线程里提交，放进自己的队列
+        cur.worker->deques[node->lane].push(node);
+    } else if (!injection[node->lane]->push(node)) {
+        if (try_only) {
+            release(node);
+            return false;
+        }
+        if (!overflow(node)) {  // 没放进队列，已经执行或丢掉了
+            return true;
+        }
+    }
+    pending.fetch_add(1, std::memory_order_relaxed);
+    notify();
+    return true;
+}
+
+
+inline void ThreadPool::release(TaskNode* node) {
+    node->task.clear();
+    free_node(node);
+}
+
+
+// 队列满了，按策略处理；放进了队列返回 true
+inline bool ThreadPool::overflow(TaskNode* node) {
+    switch (overflow_policy.load(std::memory_order_relaxed)) {
+        case CALLER_RUNS:
+            // 和工作线程一样检查过期并计入统计，任务抛出的异常直接抛给提交者
+            execute(caller_counters[node->lane], node, Clock::now(), true);
+            return false;
+        case REJECT: {
+            std::shared_ptr<RejectHandler> handler = std::atomic_load(&reject_handler);
+            if (handler) {
+                (*handler)((Priority)node->lane);
+            }
+            release(node);      // submit 的 future 会收到 broken_promise
+            return false;
+        }
+        default:
+            if (!wait_for_space(node, block_timeout_ms.load(std::memory_order_relaxed))) {
+                release(node);
+                throw std::runtime_error("ThreadPool queue full, add timeout!");
+            }
+            return true;
+    }
+}
+
+
+inline bool ThreadPool::wait_for_space(TaskNode* node, int64_t timeout_ms) {
+    BoundedQueue<TaskNode*>& queue = *injection[node->lane];
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+    std::unique_lock<std::mutex> lock(space_mtx);
+    // 先登记再重试，和 pop_injection 取走任务后的检查配对，不会漏掉通知
+    blocked.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool pushed = queue.push(node);
+    while (!pushed) {
+        if (timeout_ms < 0) {
+            space_cv.wait(lock);
+        } else if (space_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            pushed = queue.push(node);
+            break;
+        }
+        pushed = queue.push(node);
+    }
+    blocked.fetch_sub(1);
+    return pushed;
+}
+
+
+inline ThreadPool::NodeStash& ThreadPool::node_stash() {
+    // 故意不释放，线程退出时的 NodeCache 析构还会用到
+    static NodeStash* stash = new NodeStash;
+    return *stash;
+}
+
+
+inline ThreadPool::NodeCache& ThreadPool::node_cache() {
+    static thread_local NodeCache cache;
+    return cache;
+}
+
+
+inline ThreadPool::NodeCache::~NodeCache() {
+    while (head) {
+        TaskNode* next = head->next;
+        delete head;
+        head = next;
+    }
+}
+
+
+inline ThreadPool::TaskNode* ThreadPool::new_node() {
+    NodeCache& cache = node_cache();
+    if (!cache.head) {
+        NodeStash& stash = node_stash();
+        std::unique_lock<std::mutex> lock(stash.mtx);
+        if (stash.batches.empty()) {
+            lock.unlock();
+            return new TaskNode;
+        }
+        cache.head = stash.batches.back();
+        cache.count = NODE_BATCH;
+        stash.batches.pop_back();
+    }
+    TaskNode* node = cache.head;
+    cache.head = node->next;
+    cache.count--;
+    node->next = nullptr;
+    return node;
+}
+
+
+inline void ThreadPool::free_node(TaskNode* node) {
+    NodeCache& cache = node_cache();
+    node->next = cache.head;
+    cache.head = node;
+    if (++cache.count < 2 * NODE_BATCH) {
+        return;
+    }
+    // 攒够两批，把前面一批交给全局，通常是消费者线程还给生产者线程
+    TaskNode* batch = cache.head;
+    TaskNode* last = batch;
+    for (int i = 1; i < NODE_BATCH; i++) {
+        last = last->next;
+    }
+    cache.head = last->next;
+    cache.count -= NODE_BATCH;
+    last->next = nullptr;
+    NodeStash& stash = node_stash();
+    std::unique_lock<std::mutex> lock(stash.mtx);
+    stash.batches.push_back(batch);
+}
+
+
+inline void ThreadPool::notify() {
+    // 和 worker_loop 里 idle 自增之后的重新检查配对：要么这里看到有线程要睡，要么那边看到新任务
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle.load(std::memory_order_relaxed) == 0) {
+        maybe_grow();   // 都在忙，看看要不要加线程
+        return;
+    }
     {
-        std::unique_lock<std::mutex> lock(tasks_mtx);
-        if (stop) {
-            throw std::runtime_error("ThreadPool already stop, can't add task!");
+        std::unique_lock<std::mutex> lock(park_mtx);
+        if (wakeups >= idle.load(std::memory_order_relaxed)) {
+            return;
         }
-        tasks.emplace(task);
+        wakeups++;
     }
     cv.notify_one();
 }
+
+
+// 在提交路径上，只看计数器和做标记，不扫队列也不创建线程
+inline void ThreadPool::maybe_grow() {
+    int n = live.load(std::memory_order_relaxed);
+    if (n < max_size.load(std::memory_order_relaxed)
+        && pending.load(std::memory_order_relaxed) > (int64_t)grow_depth.load(std::memory_order_relaxed) * n) {
+        request_grow();
+    }
+}
+
+
+inline void ThreadPool::request_grow() {
+    if (grow_requested.load(std::memory_order_relaxed) || grow_requested.exchange(true)) {
+        return;
+    }
+    // 只有标记从无到有时进一次锁，和 spawner_loop 里的检查配对，不会漏掉唤醒
+    {
+        std::unique_lock<std::mutex> lock(spawn_mtx);
+    }
+    spawn_cv.notify_all();
+}
+
+
+inline void ThreadPool::spawner_loop() {
+    std::unique_lock<std::mutex> lock(spawn_mtx);
+    while (true) {
+        spawn_cv.wait(lock, [this]() {
+            return grow_requested.load() || spawner_exit;
+        });
+        if (spawner_exit) {
+            break;
+        }
+        grow_requested.store(false);
+        lock.unlock();
+        try {
+            spawn_worker();
+        } catch (const std::system_error&) {
+            spawn_failed.fetch_add(1, std::memory_order_relaxed);   // 创建不了线程，下次有积压时再试
+        }
+        lock.lock();
+    }
+}
+
+
+// 加线程或线程退出结束，叫醒在 resize 里等槽位的线程
+inline void ThreadPool::spawn_done() {
+    {
+        std::unique_lock<std::mutex> lock(spawn_mtx);
+        spawn_events++;
+    }
+    spawn_cv.notify_all();
+}
+
+
+// 加了线程返回 true；已经有线程在创建、到了上限或者没有空槽位返回 false
+inline bool ThreadPool::spawn_worker() {
+    if (spawning.exchange(true, std::memory_order_acquire)) {
+        return false;
+    }
+    bool spawned = false;
+    try {
+        spawned = spawn_locked();
+    } catch (...) {
+        spawning.store(false, std::memory_order_release);
+        spawn_done();
+        throw;
+    }
+    spawning.store(false, std::memory_order_release);
+    spawn_done();
+    return spawned;
+}
+
+
+// 调用方已经拿到 spawning
+inline bool ThreadPool::spawn_locked() {
+    int n = live.load();
+    if (!stop && n < max_size.load()) {
+        int index = -1;
+        for (int i = 0; i < (int)workers.size(); i++) {
+            if (!workers[i]->active.load(std::memory_order_acquire)) {
+                index = i;
+                break;
+            }
+        }
+        if (index >= 0) {
+            // 槽位上退出的旧线程已经不再访问线程池，join 只是等它真正结束
+            if (threads[index].joinable()) {
+                threads[index].join();
+            }
+            workers[index]->active = true;
+            live.fetch_add(1);
+            if (slot_count.load(std::memory_order_relaxed) <= index) {
+                slot_count.store(index + 1, std::memory_order_release);
+            }
+            try {
+                threads[index] = std::thread([this, index]() {
+                    worker_loop(index);
+                });
+            } catch (...) {
+                workers[index]->active = false;
+                live.fetch_sub(1);
+                throw;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// 线程数大于 floor 时减一，成功的线程退出
+inline bool ThreadPool::try_retire(int floor) {
+    int n = live.load();
+    while (n > floor) {
+        if (live.compare_exchange_weak(n, n - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+inline bool ThreadPool::pop_injection(int lane, TaskNode*& node) {
+    if (injection[lane]->size() == 0 || !injection[lane]->pop(node)) {
+        return false;
+    }
+    // 空出了位置，有外部线程在等就叫醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (blocked.load(std::memory_order_relaxed) > 0) {
+        std::unique_lock<std::mutex> lock(space_mtx);
+        space_cv.notify_all();
+    }
+    return true;
+}
+
+
+inline bool ThreadPool::steal_task(Worker& self, int index, int lane, TaskNode*& node) {
+    int n = slot_count.load(std::memory_order_acquire);
+    if (n <= 1) {
+        return false;
+    }
+    // xorshift 选一个随机起点，依次试一遍
+    self.rand ^= self.rand << 13;
+    self.rand ^= self.rand >> 17;
+    self.rand ^= self.rand << 5;
+    int start = (int)(self.rand % (uint32_t)n);
+    for (int k = 0; k < n; k++) {
+        int victim = (start + k) % n;
+        if (victim == index) {
+            continue;
+        }
+        WorkStealingDeque<TaskNode*>& deque = workers[victim]->deques[lane];
+        if (!deque.empty() && deque.steal(node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+inline bool ThreadPool::find_in_lane(Worker& self, int index, int lane, bool injection_first, TaskNode*& node) {
+    if (injection_first && pop_injection(lane, node)) {
+        return true;
+    }
+    WorkStealingDeque<TaskNode*>& deque = self.deques[lane];
+    return (!deque.empty() && deque.pop(node)) || pop_injection(lane, node) || steal_task(self, index, lane, node);
+}
+
+
+inline bool ThreadPool::find_task(Worker& self, int index, TaskNode*& node) {
+    uint32_t tick = ++self.tick;
+    int first = tick % 64 == 0 ? BACKGROUND : (tick % 8 == 0 ? NORMAL : CRITICAL);
+    bool injection_first = tick % 61 == 0;
+    // 轮到的低优先级先看一次，没有任务再按优先级从高到低找
+    if (first != CRITICAL && find_in_lane(self, index, first, injection_first, node)) {
+        return true;
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        if (lane != first || first == CRITICAL) {
+            if (find_in_lane(self, index, lane, injection_first, node)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+inline bool ThreadPool::has_work() {
+    int n = slot_count.load(std::memory_order_acquire);
+    for (int lane = 0; lane < LANES; lane++) {
+        if (injection[lane]->size() > 0) {
+            return true;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!workers[i]->deques[lane].empty()) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+inline bool ThreadPool::local_empty(Worker& self) {
+    for (auto& d : self.deques) {
+        if (!d.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+inline void ThreadPool::run(Worker& self, TaskNode* node) {
+    pending.fetch_sub(1, std::memory_order_relaxed);
+    Clock::time_point now = Clock::now();
+    uint64_t wait_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - node->enqueue).count();
+    // 任务等太久且没有空闲线程，说明线程不够
+    if (wait_us > (uint64_t)grow_wait_us.load(std::memory_order_relaxed)
+        && idle.load(std::memory_order_relaxed) == 0
+        && live.load(std::memory_order_relaxed) < max_size.load(std::memory_order_relaxed)) {
+        request_grow();
+    }
+
+    execute(self.counters[node->lane], node, now, false);
+}
+
+
+inline void ThreadPool::count(std::atomic<uint64_t>& v, uint64_t n, bool shared) {
+    if (shared) {
+        v.fetch_add(n, std::memory_order_relaxed);
+    } else {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
+
+
+// 记录等待时间，过期的丢掉，没过期的执行，最后回收节点
+inline void ThreadPool::execute(LaneCounter& c, TaskNode* node, Clock::time_point now, bool shared) {
+    uint64_t wait_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - node->enqueue).count();
+    count(c.wait_us, wait_us, shared);
+    uint64_t max_wait = c.max_wait_us.load(std::memory_order_relaxed);
+    while (wait_us > max_wait) {
+        if (!shared) {
+            c.max_wait_us.store(wait_us, std::memory_order_relaxed);
+            break;
+        }
+        if (c.max_wait_us.compare_exchange_weak(max_wait, wait_us, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (now > node->deadline) {
+        count(c.expired, 1, shared);
+        std::shared_ptr<ExpiredHandler> handler = std::atomic_load(&expired_handler);
+        if (handler) {
+            (*handler)((Priority)node->lane);
+        }
+        release(node);      // submit 的 future 会收到 broken_promise
+        return;
+    }
+    count(c.executed, 1, shared);
+    try {
+        node->task();
+    } catch (...) {
+        release(node);
+        throw;
+    }
+    release(node);          // 先析构捕获的对象再回收节点
+}
+
+
+inline void ThreadPool::worker_loop(int index) {
+    Worker& self = *workers[index];
+    Current& cur = current();
+    cur.pool = this;
+    cur.worker = &self;
+
+    while (true) {
+        // 上限调小了，本地队列空了就退出
+        if (live.load(std::memory_order_relaxed) > max_size.load(std::memory_order_relaxed)
+            && local_empty(self) && try_retire(max_size.load())) {
+            break;
+        }
+
+        TaskNode* node = nullptr;
+        if (find_task(self, index, node)) {
+            run(self, node);
+            continue;
+        }
+
+        // 先登记要睡，再检查一遍，和 notify() 配对不会漏掉唤醒
+        idle.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (find_task(self, index, node)) {
+            idle.fetch_sub(1, std::memory_order_relaxed);
+            run(self, node);
+            continue;
+        }
+        bool retire = false;
+        {
+            std::unique_lock<std::mutex> lock(park_mtx);
+            // 有人唤醒、线程池停止或线程数超过上限时停止等待，等到超时说明一直空闲
+            bool woken = cv.wait_for(lock, std::chrono::milliseconds(idle_timeout_ms.load()), [this]() {
+                return wakeups > 0 || stop || live.load() > max_size.load();
+            });
+            if (wakeups > 0) {
+                wakeups--;
+            } else if (!stop) {
+                retire = try_retire(woken ? max_size.load() : min_size.load());
+            }
+            if (retire) {
+                // 在锁里减，notify() 不会把唤醒给已经要走的线程
+                idle.fetch_sub(1);
+            }
+        }
+        if (retire) {
+            break;
+        }
+        idle.fetch_sub(1, std::memory_order_relaxed);
+        if (stop && !has_work()) {
+            // 还有线程在跑的任务可能继续提交，让别的线程也醒来检查
+            cv.notify_all();
+            live.fetch_sub(1);
+            break;
+        }
+    }
+    cur.pool = nullptr;
+    cur.worker = nullptr;
+    self.active.store(false, std::memory_order_release);
+    spawn_done();
+}